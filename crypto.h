@@ -1,18 +1,83 @@
 #pragma once
 
+#include <cstring>
 #include "pbft_types.h"
+#include "profile.h"
 
 // There're mocks for digest and signature functions
 // signature() signs message using node address as it being private key
 // recover_digest() recovers digest using node address as public key
 // high-end crypto lib, sort of
 
+// Payload bytes are found by their SHA-256, the one real hash here: nobody can give a
+// node other bytes for the digest a request names. Hashed once per node, on receipt.
+inline PayloadDigest sha256(uint8_t const *data, size_t size) {
+    PBFT_PROFILE_SCOPE("sha256");
+    static uint32_t const k[64] = {
+        0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+        0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+        0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+        0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+        0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+        0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+        0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+        0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+    uint32_t h[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+    auto rotr = [](uint32_t x, int n) { return (x >> n) | (x << (32 - n)); };
+    auto block = [&](uint8_t const *p) {
+        uint32_t w[64], v[8];
+        for(int i = 0; i < 16; ++i)
+            w[i] = uint32_t(p[4 * i]) << 24 | uint32_t(p[4 * i + 1]) << 16 | uint32_t(p[4 * i + 2]) << 8 | p[4 * i + 3];
+        for(int i = 16; i < 64; ++i)
+            w[i] = w[i - 16] + (rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3)) + w[i - 7]
+                + (rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10));
+        std::memcpy(v, h, sizeof(h));
+        for(int i = 0; i < 64; ++i) {
+            auto const t1 = v[7] + (rotr(v[4], 6) ^ rotr(v[4], 11) ^ rotr(v[4], 25)) + ((v[4] & v[5]) ^ (~v[4] & v[6])) + k[i] + w[i];
+            auto const t2 = (rotr(v[0], 2) ^ rotr(v[0], 13) ^ rotr(v[0], 22)) + ((v[0] & v[1]) ^ (v[0] & v[2]) ^ (v[1] & v[2]));
+            std::memmove(v + 1, v, 7 * sizeof(uint32_t));
+            v[4] += t1;
+            v[0] = t1 + t2;
+        }
+        for(int i = 0; i < 8; ++i)
+            h[i] += v[i];
+    };
+    size_t i = 0;
+    for(; i + 64 <= size; i += 64)
+        block(data + i);
+    uint8_t tail[128] = {};
+    if(size > i)
+        std::memcpy(tail, data + i, size - i);
+    tail[size - i] = 0x80;
+    size_t const end = size - i < 56 ? 64 : 128;
+    for(size_t j = 0; j < 8; ++j)
+        tail[end - 1 - j] = static_cast<uint8_t>(uint64_t(size) * 8 >> 8 * j);
+    for(size_t j = 0; j < end; j += 64)
+        block(tail + j);
+    PayloadDigest d;
+    for(size_t j = 0; j < d.size(); ++j)
+        d[j] = static_cast<uint8_t>(h[j / 4] >> (24 - 8 * (j % 4)));
+    return d;
+}
+
+// Messages mix in the payload by its digest
+inline Digest digest(Message::Payload const &p) {
+    Digest d = p.size;
+    for(size_t i = 0; i < p.digest.size(); i += 8) {
+        uint64_t w;
+        std::memcpy(&w, p.digest.data() + i, 8);
+        d = d * 0x9e3779b97f4a7c15 + w;
+    }
+    return d;
+}
+
 inline Digest digest(Message::WriteOpRequest const &msg) {
-    return (static_cast<Digest>(Message::Type::Write) << 60) + static_cast<Digest>(msg.value);
+    return (static_cast<Digest>(Message::Type::Write) << 60) + static_cast<Digest>(msg.value) + (msg.timestamp << 32)
+        + digest(msg.payload);
 }
 
 inline Digest digest(Message::ReadOpRequest const &msg) {
-    return (static_cast<Digest>(Message::Type::Read) << 60) + static_cast<Digest>(msg.index);
+    return (static_cast<Digest>(Message::Type::Read) << 60) + static_cast<Digest>(msg.index) + (msg.timestamp << 32);
 }
 
 inline Digest digest(Message::WriteOpResponse const &msg) {
@@ -20,10 +85,28 @@ inline Digest digest(Message::WriteOpResponse const &msg) {
 }
 
 inline Digest digest(Message::ReadOpResponse const &msg) {
-    return (static_cast<Digest>(Message::Type::ReadAck) << 60) + static_cast<Digest>(msg.value);
+    return (static_cast<Digest>(Message::Type::ReadAck) << 60) + static_cast<Digest>(msg.value) + digest(msg.payload);
+}
+
+inline Digest digest(Message::KvRequest const &msg) {
+    Digest d = (static_cast<Digest>(Message::Type::Kv) << 60) + (msg.timestamp << 32);
+    for(uint8_t i = 0; i < msg.size; ++i) {
+        auto const &op = msg.ops[i];
+        d = d * 31 + (static_cast<Digest>(op.code) << 56) + op.count + op.key + static_cast<Digest>(op.value) * 7
+            + static_cast<Digest>(op.expected) * 13;
+    }
+    return d;
+}
+
+inline Digest digest(Message::KvResponse const &msg) {
+    Digest d = (static_cast<Digest>(Message::Type::KvAck) << 60) + msg.success;
+    for(uint8_t i = 0; i < msg.size; ++i)
+        d = d * 31 + msg.results[i].key + static_cast<Digest>(msg.results[i].value) * 7 + msg.results[i].found;
+    return d;
 }
 
 inline Digest digest(Message const &msg) {
+    PBFT_PROFILE_SCOPE("digest");
     switch(msg.type) {
     case Message::Type::Write:
         return digest(msg.data.write);
@@ -33,6 +116,10 @@ inline Digest digest(Message const &msg) {
         return digest(msg.data.write_ack);
     case Message::Type::ReadAck:
         return digest(msg.data.read_ack);
+    case Message::Type::Kv:
+        return digest(msg.data.kv);
+    case Message::Type::KvAck:
+        return digest(msg.data.kv_ack);
     default:
         std::cout << msg << std::endl;
         assert(not("Unreachable"));
@@ -61,5 +148,24 @@ inline bool verify_digest(Message const &m, Digest d) {
 }
 
 inline bool verify_message(Message const &m, Signature s, uintptr_t node) {
+    PBFT_PROFILE_SCOPE("verify");
     return verify_digest(m, recover_digest(s, node));
 }
+
+inline bool verify_signature(Digest d, Signature s, uintptr_t node) {
+    return recover_digest(s, node) == d;
+}
+
+// Multi-signature, BLS-like: signatures of the same digest by several nodes aggregate
+// into one of the same size, checked against the set of signers
+inline Signature aggregate(Signature a, Signature b) {
+    return a + b; // wraps around, as both sides of the check do
+}
+
+inline bool verify_aggregate(Digest d, Signature s, std::vector<uintptr_t> const &signers) {
+    PBFT_PROFILE_SCOPE("verify");
+    Signature expected = 0;
+    for(auto n : signers)
+        expected = aggregate(expected, signature(d, n));
+    return !signers.empty() && expected == s;
+}
@@ -0,0 +1,334 @@
+#pragma once
+
+#include <vector>
+#include <map>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <condition_variable>
+
+// Fixed set of threads running index loops. The caller takes part in the loop too.
+
+class ThreadPool {
+public:
+    explicit ThreadPool(size_t threads) {
+        for(size_t i = 0; i < threads; ++i)
+            _threads.emplace_back([this] { work(); });
+    }
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _stop = true;
+        }
+        _wake.notify_all();
+        for(auto &t : _threads)
+            t.join();
+    }
+
+    size_t size() const { return _threads.size() + 1; }
+
+    // Calls f(i) for every i in [0, n), returns when all calls are done
+    void parallel_for(size_t n, std::function<void(size_t)> const &f) {
+        if(n < 2 || _threads.empty()) {
+            for(size_t i = 0; i < n; ++i)
+                f(i);
+            return;
+        }
+        auto batch = std::make_shared<Batch>(f, n);
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _batch = batch;
+            ++_generation;
+        }
+        _wake.notify_all();
+        run(*batch);
+        std::unique_lock<std::mutex> lock(_mutex);
+        _finished.wait(lock, [&batch] { return batch->done == batch->size; });
+        _batch.reset();
+    }
+
+private:
+    // One parallel_for call. A worker keeps the batch it took, so one still finishing its
+    // loop when the next batch is published takes no index and counts nothing of it.
+    struct Batch {
+        Batch(std::function<void(size_t)> const &job, size_t size) : job(job), size(size) {}
+
+        std::function<void(size_t)> const &job;
+        size_t const size;
+        std::atomic<size_t> next{0};
+        size_t done = 0; // under the mutex
+    };
+
+    void work() {
+        uint64_t seen = 0;
+        for(;;) {
+            std::shared_ptr<Batch> batch;
+            {
+                std::unique_lock<std::mutex> lock(_mutex);
+                _wake.wait(lock, [this, seen] { return _stop || _generation != seen; });
+                if(_stop)
+                    return;
+                seen = _generation;
+                batch = _batch;
+            }
+            if(batch != nullptr)
+                run(*batch);
+        }
+    }
+
+    void run(Batch &batch) {
+        size_t completed = 0;
+        for(size_t i; (i = batch.next.fetch_add(1)) < batch.size; ++completed)
+            batch.job(i);
+        if(completed == 0)
+            return;
+        std::lock_guard<std::mutex> lock(_mutex);
+        batch.done += completed;
+        if(batch.done == batch.size)
+            _finished.notify_one();
+    }
+
+    std::vector<std::thread> _threads;
+    std::mutex _mutex;
+    std::condition_variable _wake, _finished;
+    std::shared_ptr<Batch> _batch; // the one in progress
+    uint64_t _generation = 0;
+    bool _stop = false;
+};
+
+
+// Access of an operation to a state entry
+struct Access {
+    uint64_t key;
+    bool write;
+};
+
+// Splits a run of ordered operations into waves. Operations of one wave don't conflict
+// (no common entry which one of them writes), and every operation is in a later wave
+// than each earlier operation it conflicts with. So executing the waves one after
+// another, operations of a wave in any order or concurrently, gives the same result as
+// executing the run sequentially. The schedule depends on the input only.
+// Returns the wave of every operation.
+
+inline std::vector<size_t> schedule_waves(std::vector<std::vector<Access>> const &ops) {
+    struct Last {
+        size_t write = 0, read = 0; // wave + 1 of the last writer and of the latest reader, 0 if none
+    };
+    std::map<uint64_t, Last> last;
+    std::vector<size_t> waves;
+    waves.reserve(ops.size());
+    for(auto const &op : ops) {
+        size_t wave = 0;
+        for(auto const &a : op) {
+            auto it = last.find(a.key);
+            if(it == last.end())
+                continue;
+            wave = std::max(wave, it->second.write);
+            if(a.write)
+                wave = std::max(wave, it->second.read);
+        }
+        for(auto const &a : op) {
+            auto &l = last[a.key];
+            if(a.write)
+                l.write = wave + 1;
+            else
+                l.read = std::max(l.read, wave + 1);
+        }
+        waves.push_back(wave);
+    }
+    return waves;
+}
+
+// Runs operations wave by wave on the pool, `execute(i)` runs i-th operation
+inline void execute_waves(ThreadPool &pool, std::vector<size_t> const &waves, std::function<void(size_t)> const &execute) {
+    size_t count = 0;
+    for(auto w : waves)
+        count = std::max(count, w + 1);
+    std::vector<std::vector<size_t>> by_wave(count);
+    for(size_t i = 0; i < waves.size(); ++i)
+        by_wave[waves[i]].push_back(i);
+    for(auto const &ops : by_wave)
+        pool.parallel_for(ops.size(), [&ops, &execute](size_t i) { execute(ops[i]); });
+}
+
+
+// Lock-free ring buffer for one producer and one consumer thread. Slots are filled with
+// `fill` upfront, so T doesn't need the default constructor. The capacity is rounded up
+// to a power of two, `capacity()` is the effective one.
+
+template<typename T>
+class SpscQueue {
+public:
+    SpscQueue(size_t capacity, T const &fill) : _items(round_up(capacity), fill), _mask(_items.size() - 1) {}
+
+    size_t capacity() const { return _items.size(); }
+    // The load of the tail is sequentially consistent, see ExecutionStage::work
+    size_t size() const { return _tail.load(std::memory_order_seq_cst) - _head.load(std::memory_order_acquire); }
+    bool empty() const { return size() == 0; }
+
+    bool push(T const &item) {
+        auto tail = _tail.load(std::memory_order_relaxed);
+        if(tail - _head.load(std::memory_order_acquire) == _items.size())
+            return false;
+        _items[tail & _mask] = item;
+        _tail.store(tail + 1, std::memory_order_seq_cst);
+        return true;
+    }
+
+    bool pop(T &item) {
+        auto head = _head.load(std::memory_order_relaxed);
+        if(head == _tail.load(std::memory_order_seq_cst))
+            return false;
+        item = std::move(_items[head & _mask]);
+        _head.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+private:
+    static size_t round_up(size_t n) {
+        size_t p = 1;
+        while(p < n)
+            p <<= 1;
+        return p;
+    }
+
+    // head and tail on their own cache lines, producer and consumer don't bounce each other
+    std::atomic<size_t> _head{0};
+    char _pad0[64 - sizeof(std::atomic<size_t>)];
+    std::atomic<size_t> _tail{0};
+    char _pad1[64 - sizeof(std::atomic<size_t>)];
+    std::vector<T> _items;
+    size_t _mask;
+};
+
+
+// Pipeline stage running on its own thread. The owner thread pushes jobs, the stage takes
+// whatever is queued as one batch, runs `execute` on it and queues the results back, the
+// owner picks them up with `drain`. At most `capacity` jobs are in the stage including
+// undrained results, `push` returns false beyond that, it's the backpressure.
+// An idle stage sleeps; the wakeup is lock-free on the push side unless the stage sleeps:
+// the stage raises `_sleeping` and checks the queue again, push publishes the job and
+// checks `_sleeping`, both sequentially consistent, so one of them sees the other.
+
+template<typename In, typename Out>
+class ExecutionStage {
+public:
+    using Execute = std::function<void(std::vector<In> const &, std::vector<Out> &)>;
+
+    struct Stats {
+        uint64_t pushed = 0;
+        uint64_t executed = 0;
+        uint64_t rejected = 0;     // pushes refused because the stage was full
+        size_t max_depth = 0;      // of the job queue, seen on push
+        double depth_sum = 0;      // job queue depth summed over pushes
+        double busy_seconds = 0;   // spent in `execute`
+        double seconds = 0;        // since the stage started
+
+        double mean_depth() const { return pushed == 0 ? 0.0 : depth_sum / pushed; }
+        double utilization() const { return seconds == 0 ? 0.0 : busy_seconds / seconds; }
+    };
+
+    ExecutionStage(size_t capacity, Execute execute, In const &in_fill, Out const &out_fill)
+        : _capacity(capacity), _jobs(capacity, in_fill), _results(capacity, out_fill), _in_fill(in_fill), _out_fill(out_fill),
+          _execute(std::move(execute)), _start(std::chrono::steady_clock::now()) {
+        _thread = std::thread([this] { work(); });
+    }
+
+    ~ExecutionStage() {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _stop = true;
+        }
+        _wake.notify_one();
+        _thread.join();
+    }
+
+    size_t capacity() const { return _capacity; } // as asked, not the queues' rounded one
+    size_t in_flight() const { return _stats.pushed - _drained; }
+
+    bool push(In const &job) {
+        if(in_flight() == capacity()) {
+            ++_stats.rejected;
+            return false;
+        }
+        _jobs.push(job);
+        ++_stats.pushed;
+        auto depth = _jobs.size();
+        _stats.max_depth = std::max(_stats.max_depth, depth);
+        _stats.depth_sum += depth;
+        if(_sleeping.load(std::memory_order_seq_cst)) {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _wake.notify_one();
+        }
+        return true;
+    }
+
+    // Calls f(Out&&) for every ready result, in the order of pushes
+    template<typename F>
+    void drain(F &&f) {
+        Out out = _out_fill;
+        while(_results.pop(out)) {
+            ++_drained;
+            f(std::move(out));
+        }
+    }
+
+    // Owner thread only
+    Stats stats() const {
+        auto s = _stats;
+        s.executed = _executed.load();
+        s.busy_seconds = _busy_ns.load() * 1e-9;
+        s.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - _start).count();
+        return s;
+    }
+
+private:
+    void work() {
+        std::vector<In> batch;
+        std::vector<Out> out;
+        In job = _in_fill;
+        for(;;) {
+            while(_jobs.pop(job))
+                batch.push_back(job);
+            if(batch.empty()) {
+                std::unique_lock<std::mutex> lock(_mutex);
+                if(_stop)
+                    return;
+                _sleeping.store(true, std::memory_order_seq_cst);
+                _wake.wait(lock, [this] { return _stop || !_jobs.empty(); });
+                _sleeping.store(false, std::memory_order_relaxed);
+                continue;
+            }
+            auto start = std::chrono::steady_clock::now();
+            _execute(batch, out);
+            auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+            _busy_ns += static_cast<uint64_t>(ns);
+            assert(out.size() == batch.size());
+            for(auto &o : out)
+                _results.push(o); // never full, in_flight is limited by push
+            _executed += batch.size();
+            batch.clear();
+            out.clear();
+        }
+    }
+
+    size_t const _capacity;
+    SpscQueue<In> _jobs;
+    SpscQueue<Out> _results;
+    In const _in_fill;
+    Out const _out_fill;
+    Execute _execute;
+    std::chrono::steady_clock::time_point _start;
+    Stats _stats;               // owner side
+    uint64_t _drained = 0;
+    std::atomic<uint64_t> _executed{0}, _busy_ns{0};
+    std::atomic<bool> _sleeping{false};
+    std::mutex _mutex;
+    std::condition_variable _wake;
+    bool _stop = false;
+    std::thread _thread;
+};
@@ -0,0 +1,206 @@
+#pragma once
+
+#include <set>
+#include <map>
+#include <vector>
+#include <cassert>
+#include "pbft_types.h"
+
+// Hash index of the key-value state machine: open addressing with linear probing.
+// Erased entries leave tombstones, so probe chains stay intact; they're dropped when
+// the table grows. The table doubles once live entries and tombstones pass 70%.
+
+class KvIndex {
+public:
+    explicit KvIndex(size_t capacity = 16) : _slots(round_up(capacity)) {}
+
+    size_t size() const { return _size; }
+    size_t capacity() const { return _slots.size(); }
+
+    int64_t const *find(uint64_t key) const {
+        auto i = probe(key);
+        return _slots[i].state == Slot::Full ? &_slots[i].value : nullptr;
+    }
+
+    void put(uint64_t key, int64_t value) {
+        if((_size + _tombstones + 1) * 10 > _slots.size() * 7)
+            rehash(_size * 4 >= _slots.size() ? _slots.size() * 2 : _slots.size()); // mostly tombstones: same size
+        auto i = probe(key);
+        auto &s = _slots[i];
+        if(s.state != Slot::Full) {
+            if(s.state == Slot::Deleted)
+                --_tombstones;
+            ++_size;
+            s.state = Slot::Full;
+            s.key = key;
+        }
+        s.value = value;
+    }
+
+    // false if there's no such key
+    bool erase(uint64_t key) {
+        auto i = probe(key);
+        if(_slots[i].state != Slot::Full)
+            return false;
+        _slots[i].state = Slot::Deleted;
+        --_size;
+        ++_tombstones;
+        return true;
+    }
+
+private:
+    struct Slot {
+        enum State : uint8_t { Empty, Full, Deleted };
+        uint64_t key = 0;
+        int64_t value = 0;
+        State state = Empty;
+    };
+
+    static size_t round_up(size_t n) {
+        size_t p = 8;
+        while(p < n)
+            p <<= 1;
+        return p;
+    }
+
+    // splitmix64 finalizer, sequential keys spread over the table
+    static uint64_t hash(uint64_t x) {
+        x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9;
+        x = (x ^ (x >> 27)) * 0x94d049bb133111eb;
+        return x ^ (x >> 31);
+    }
+
+    // Slot of the key if it's there, otherwise the slot to insert it to: the first
+    // tombstone on the way or the empty slot ending the chain
+    size_t probe(uint64_t key) const {
+        auto const mask = _slots.size() - 1;
+        size_t insert = _slots.size();
+        for(size_t i = hash(key) & mask;; i = (i + 1) & mask) {
+            auto const &s = _slots[i];
+            if(s.state == Slot::Empty)
+                return insert != _slots.size() ? insert : i;
+            if(s.state == Slot::Full && s.key == key)
+                return i;
+            if(s.state == Slot::Deleted && insert == _slots.size())
+                insert = i;
+        }
+    }
+
+    void rehash(size_t capacity) {
+        std::vector<Slot> old(capacity);
+        std::swap(old, _slots);
+        _size = _tombstones = 0;
+        for(auto const &s : old)
+            if(s.state == Slot::Full)
+                put(s.key, s.value);
+    }
+
+    std::vector<Slot> _slots;
+    size_t _size = 0, _tombstones = 0;
+};
+
+
+// Key-value state machine. Point operations go to the hash index, scans walk the
+// ordered set of keys next to it.
+// A transaction runs against a staged overlay on top of the store and is applied only
+// when all its operations succeed; failed Cas aborts it and nothing changes. So a
+// transaction observes its own writes, including in scans.
+
+class KvStore {
+public:
+    size_t size() const { return _index.size(); }
+
+    Message::KvResponse apply(Message::KvRequest const &req) {
+        Message::KvResponse r{true, 0, {}};
+        std::map<uint64_t, Staged> staged;
+        auto lookup = [this, &staged](uint64_t key) -> int64_t const * {
+            auto it = staged.find(key);
+            if(it != staged.end())
+                return it->second.present ? &it->second.value : nullptr;
+            return _index.find(key);
+        };
+        auto result = [&r](uint64_t key, int64_t value, bool found) {
+            if(r.size < Message::KvResponse::max_results)
+                r.results[r.size++] = Message::KvResult{key, value, found};
+        };
+        assert(req.size <= Message::KvRequest::max_ops);
+        for(uint8_t i = 0; i < req.size && r.success; ++i) {
+            auto const &op = req.ops[i];
+            switch(op.code) {
+            case Message::KvOp::Code::Get: {
+                auto v = lookup(op.key);
+                result(op.key, v ? *v : 0, v != nullptr);
+            } break;
+            case Message::KvOp::Code::Put:
+                staged[op.key] = Staged{true, op.value};
+                result(op.key, op.value, true);
+                break;
+            case Message::KvOp::Code::Delete: {
+                auto v = lookup(op.key);
+                result(op.key, v ? *v : 0, v != nullptr);
+                staged[op.key] = Staged{false, 0};
+            } break;
+            case Message::KvOp::Code::Cas: {
+                auto v = lookup(op.key);
+                if(v == nullptr || *v != op.expected) {
+                    result(op.key, v ? *v : 0, false);
+                    r.success = false;
+                    break;
+                }
+                staged[op.key] = Staged{true, op.value};
+                result(op.key, op.value, true);
+            } break;
+            case Message::KvOp::Code::Scan:
+                scan(op.key, op.count, staged, result);
+                break;
+            }
+        }
+        if(!r.success)
+            return r;
+        for(auto const &s : staged) {
+            if(s.second.present) {
+                _index.put(s.first, s.second.value);
+                _keys.insert(s.first);
+            } else if(_index.erase(s.first)) {
+                _keys.erase(s.first);
+            }
+        }
+        return r;
+    }
+
+private:
+    struct Staged {
+        bool present;
+        int64_t value;
+    };
+
+    // Merges the ordered keys of the store with the staged ones, at most `count` pairs
+    // from `from` on; what doesn't fit the response is cut
+    template<typename Result>
+    void scan(uint64_t from, uint8_t count, std::map<uint64_t, Staged> const &staged, Result &&result) const {
+        auto k = _keys.lower_bound(from);
+        auto s = staged.lower_bound(from);
+        for(uint8_t n = 0; n < count;) {
+            bool const store = k != _keys.end() && (s == staged.end() || *k <= s->first);
+            bool const stage = s != staged.end() && (k == _keys.end() || s->first <= *k);
+            if(!store && !stage)
+                return;
+            if(stage) {
+                if(s->second.present) {
+                    result(s->first, s->second.value, true);
+                    ++n;
+                }
+                if(store)
+                    ++k; // shadowed by the staged one
+                ++s;
+            } else {
+                result(*k, *_index.find(*k), true);
+                ++n;
+                ++k;
+            }
+        }
+    }
+
+    KvIndex _index;
+    std::set<uint64_t> _keys;
+};
@@ -0,0 +1,208 @@
+#pragma once
+
+#include <map>
+#include <set>
+#include <deque>
+#include <vector>
+#include <functional>
+#include <algorithm>
+#include "pbft.h"
+
+// Non-voting replica. Voting replicas send it the Decision of every request they commit:
+// the request with its commit certificate. It takes Decision-s from replicas only, with
+// the primary's signature and the aggregated votes of 2f+1 voters; a request is decided
+// when f+1 replicas sent matching ones, so one of them is correct. It executes decided
+// requests in req_id order on its own state machine and answers reads from it alone;
+// such reads may be stale. The replicas don't wait for it, it costs the group one message
+// per request per replica feeding it. A req_id not decided within `timeout`, e.g. its
+// Decision-s are lost, is fetched from the feeding replicas, every `timeout` till it is;
+// nothing after it is executed meanwhile.
+// Executed requests are kept in a log of `retention` entries and streamed to subscribers
+// in order, in batches, on the learner's ticks. A subscriber resumes from any req_id not
+// trimmed from the log yet.
+
+class Learner : public Node {
+public:
+    struct Committed {
+        uint32_t seq; // req_id
+        uintptr_t client;
+        Message::OpRequestMessage msg;
+    };
+    using Subscriber = std::function<void(std::vector<Committed> const &batch)>;
+
+    Learner(int f, PBFTNode::SuccessStrategyPtr &&strategy, size_t retention = 1 << 16)
+        : _f(f), _strategy(std::move(strategy)), _retention(std::max<size_t>(retention, 1)) {
+        assert(f > 0 && _strategy != nullptr);
+    }
+
+    // The order defines primaries of views, as for PBFTNode
+    void set_replicas(std::vector<uintptr_t> const &r) { _replicas = r; }
+    void set_timeout(uint64_t ticks) { _timeout = ticks; }
+
+    uint32_t applied() const { return _next - 1; } // req_ids up to it are executed
+    uint64_t executed() const { return _executed; }
+    uint64_t fetches() const { return _fetches; } // of missed Decision-s
+    uint64_t reads() const { return _reads; }
+
+    // Committed requests from req_id `from` on, at most `batch` in a call. Returns the
+    // subscription id, 0 if `from` is trimmed from the log already. Subscribers don't
+    // (un)subscribe from their callbacks.
+    size_t subscribe(uint32_t from, size_t batch, Subscriber s) {
+        if(from <= _trimmed)
+            return 0;
+        _subscriptions.emplace(++_subscription, Subscription{from, std::max<size_t>(batch, 1), std::move(s)});
+        return _subscription;
+    }
+
+    void unsubscribe(size_t id) { _subscriptions.erase(id); }
+
+    void on_tick() override {
+        ++_now;
+        auto inbox = take_inbox();
+        std::vector<std::pair<uintptr_t, Message::OpRequestMessage>> reads;
+        for(auto &m : inbox) {
+            switch(m.second.type) {
+            case Message::Type::Decision:
+                process(m.first, std::move(m.second.data.decision));
+                break;
+            case Message::Type::Read:
+                reads.emplace_back(m.first, Message::OpRequestMessage(m.second.data.read));
+                break;
+            case Message::Type::Write:
+            case Message::Type::Kv:
+                break; // not ordered here
+            case Message::Type::WriteAck:
+            case Message::Type::ReadAck:
+            case Message::Type::KvAck:
+            case Message::Type::Response:
+            case Message::Type::PrePrepare:
+            case Message::Type::Prepare:
+            case Message::Type::Commit:
+            case Message::Type::ViewChange:
+            case Message::Type::NewView:
+            case Message::Type::PrepareCertificate:
+            case Message::Type::CommitCertificate:
+            case Message::Type::Busy:
+            case Message::Type::Lease:
+            case Message::Type::SpecCommit:
+            case Message::Type::LocalCommit:
+            case Message::Type::Fetch:
+                assert(not("Unreachable"));
+            }
+        }
+        apply();
+        for(auto &r : reads) {
+            auto answer = _strategy->accept(r.second);
+            auto sig = signature(digest(answer), id());
+            send_to(r.first, Message::Response{std::move(answer), sig, r.second.timestamp()});
+            ++_reads;
+        }
+        publish();
+    }
+
+private:
+    struct Subscription {
+        uint32_t next;
+        size_t batch;
+        Subscriber callback;
+    };
+
+    void process(uintptr_t sender, Message::Decision &&msg) {
+        if(msg.req_id < _next || _decided.count(msg.req_id) != 0 || __builtin_popcountll(msg.voters) < 2 * _f + 1)
+            return;
+        if(std::find(_replicas.begin(), _replicas.end(), sender) == _replicas.end() || !certified(msg))
+            return;
+        auto &senders = _matching[msg.req_id][PBFTNode::request_digest(msg)];
+        senders.insert(sender);
+        if(senders.size() < static_cast<size_t>(_f) + 1)
+            return;
+        _matching.erase(msg.req_id);
+        _decided.emplace(msg.req_id, std::make_pair(msg.client, msg.msg));
+    }
+
+    bool certified(Message::Decision const &msg) const {
+        if(!verify_message(msg.msg, msg.sig, _replicas[msg.view % _replicas.size()]))
+            return false;
+        std::vector<uintptr_t> signers;
+        for(size_t i = 0; i < _replicas.size() && i < 64; ++i)
+            if(msg.voters >> i & 1)
+                signers.push_back(_replicas[i]);
+        return signers.size() == static_cast<size_t>(__builtin_popcountll(msg.voters)) &&
+               verify_aggregate(PBFTNode::vote_digest(Phase::Commit, msg), msg.votes, signers);
+    }
+
+    // Executes decided requests from `_next` on as one run, a gap is fetched
+    void apply() {
+        if(!_decided.empty() && _decided.begin()->first > _next) {
+            if(_gap == 0)
+                _gap = _now;
+            if(_now - _gap >= _timeout) {
+                _gap = _now;
+                fetch();
+            }
+            return;
+        }
+        _gap = 0;
+        std::vector<Message::OpRequestMessage> run;
+        for(auto it = _decided.begin(); it != _decided.end() && it->first == _next; it = _decided.erase(it), ++_next) {
+            auto const client = it->second.first;
+            auto const &msg = it->second.second;
+            if(_replies.check(client, msg.timestamp()) != ReplyCache::Status::New)
+                continue; // ordered twice, executed once as on replicas
+            _replies.commit(client, msg.timestamp());
+            payloads().keep(msg);
+            run.push_back(msg);
+            _log.push_back(Committed{it->first, client, msg});
+        }
+        if(run.empty())
+            return;
+        std::vector<Message::OpResponseMessage> answers;
+        answers.reserve(run.size());
+        _strategy->accept_run(run, answers);
+        _executed += run.size();
+        while(_log.size() > _retention) {
+            _trimmed = _log.front().seq;
+            _log.pop_front();
+        }
+    }
+
+    // Replicas not feeding this learner aren't linked to it
+    void fetch() {
+        ++_fetches;
+        for(auto r : _replicas)
+            if(has_link(r))
+                send_to(r, Message::Fetch{_next});
+    }
+
+    void publish() {
+        for(auto &s : _subscriptions) {
+            auto &sub = s.second;
+            auto it = std::lower_bound(_log.begin(), _log.end(), sub.next,
+                                       [](Committed const &c, uint32_t seq) { return c.seq < seq; });
+            while(it != _log.end()) {
+                auto const n = std::min<size_t>(sub.batch, static_cast<size_t>(_log.end() - it));
+                std::vector<Committed> batch(it, it + n);
+                it += n;
+                sub.next = batch.back().seq + 1;
+                sub.callback(batch);
+            }
+        }
+    }
+
+    int _f;
+    PBFTNode::SuccessStrategyPtr _strategy;
+    size_t _retention;
+    std::vector<uintptr_t> _replicas;
+    uint64_t _timeout = 50;
+    uint64_t _now = 0;
+    uint64_t _gap = 0;       // tick the gap at `_next` was seen first, 0 if there's none
+    uint32_t _next = 1;      // req_id to execute next
+    uint32_t _trimmed = 0;   // the log has req_ids after it
+    uint64_t _executed = 0, _fetches = 0, _reads = 0;
+    std::map<uint32_t, std::map<Digest, std::set<uintptr_t>>> _matching; // senders of Decision-s by req_id and request
+    std::map<uint32_t, std::pair<uintptr_t, Message::OpRequestMessage>> _decided; // not executed yet
+    ReplyCache _replies;
+    std::deque<Committed> _log;
+    std::map<size_t, Subscription> _subscriptions;
+    size_t _subscription = 0;
+};
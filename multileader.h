@@ -0,0 +1,83 @@
+#pragma once
+
+#include <map>
+#include <vector>
+#include "pbft.h"
+
+// Merges committed requests of the lanes of one replica into one order: position
+// (req_id - 1) * lanes + lane, see PBFTNode's multi-leader mode. Ready requests from
+// the next position on are executed as one run by the replica's strategy. A lane
+// commits every req_id in order, a position not committed yet is waited for.
+
+class LaneMerger : public PBFTNode::Merger {
+public:
+    LaneMerger(size_t lanes, PBFTNode::SuccessStrategyPtr &&strategy)
+        : _strategy(std::move(strategy)), _lanes(lanes, nullptr), _pending(lanes), _done(lanes, 0) {
+        assert(lanes > 0);
+    }
+
+    void attach(size_t lane, PBFTNode &node) {
+        _lanes.at(lane) = &node;
+        node.set_merger(this, lane);
+    }
+
+    // Lane node is gone with its replica
+    void detach(size_t lane) { _lanes.at(lane) = nullptr; }
+
+    void set_strategy(PBFTNode::SuccessStrategyPtr &&s) { _strategy = std::move(s); }
+
+    uint64_t position() const { return _next; }
+    uint64_t executed() const { return _executed; }
+
+    void committed(size_t lane, uint32_t req_id, uintptr_t client, Message::OpRequestMessage const &msg) override {
+        _done[lane] = std::max(_done[lane], req_id);
+        _pending[lane].emplace(req_id, std::make_pair(client, msg));
+        drain();
+    }
+
+    bool behind(size_t lane, uint32_t committed) const override {
+        auto const next = uint64_t(committed) * _lanes.size() + lane;
+        for(size_t l = 0; l < _lanes.size(); ++l)
+            if(_done[l] != 0 && uint64_t(_done[l] - 1) * _lanes.size() + l > next)
+                return true;
+        return false;
+    }
+
+private:
+    void drain() {
+        std::vector<Message::OpRequestMessage> run;
+        std::vector<std::pair<size_t, uintptr_t>> to; // lane and client
+        for(;;) {
+            auto const lane = _next % _lanes.size();
+            auto const req_id = static_cast<uint32_t>(_next / _lanes.size() + 1);
+            auto &pending = _pending[lane];
+            auto it = pending.find(req_id);
+            if(it == pending.end()) {
+                assert(_done[lane] < req_id);
+                break;
+            }
+            if(it->second.first != 0) {
+                run.push_back(it->second.second);
+                to.emplace_back(lane, it->second.first);
+            }
+            pending.erase(it);
+            ++_next;
+        }
+        if(run.empty())
+            return;
+        std::vector<Message::OpResponseMessage> answers;
+        answers.reserve(run.size());
+        _strategy->accept_run(run, answers);
+        _executed += run.size();
+        for(size_t i = 0; i < run.size(); ++i)
+            if(_lanes[to[i].first] != nullptr)
+                _lanes[to[i].first]->respond(to[i].second, std::move(answers[i]), run[i].timestamp());
+    }
+
+    PBFTNode::SuccessStrategyPtr _strategy;
+    std::vector<PBFTNode *> _lanes;
+    std::vector<std::map<uint32_t, std::pair<uintptr_t, Message::OpRequestMessage>>> _pending;
+    std::vector<uint32_t> _done; // highest req_id committed by the lane
+    uint64_t _next = 0;          // position to execute next
+    uint64_t _executed = 0;
+};
@@ -0,0 +1,126 @@
+#pragma once
+
+#include <string>
+#include <sstream>
+#include <istream>
+#include "pbft_types.h"
+
+// Network topology declared in one place. Nodes are put into zones, a link gets the
+// profile of its pair of zones, or the default one. Text form, one statement per line,
+// `#` starts a comment:
+//
+//   seed 42
+//   default latency 1
+//   zone eu 0 1 clients
+//   zone us 2 3
+//   link eu us latency 40 jitter 5 normal bandwidth 2000 drop 0.001
+//
+// Zone members are replica indexes, `clients` stands for all client nodes.
+// Profile keys: latency, jitter, uniform|normal|exponential, bandwidth, drop, duplicate,
+// window, queue.
+
+struct NetworkConfig {
+    enum : int { clients = -1 }; // zone member standing for all client nodes
+
+    uint64_t seed = 0;
+    LinkProfile default_profile;
+    std::map<std::string, std::vector<int>> zones;
+    std::map<std::pair<std::string, std::string>, LinkProfile> links;
+
+    void link(std::string const &a, std::string const &b, LinkProfile const &p) {
+        links[std::make_pair(a, b)] = p;
+        links[std::make_pair(b, a)] = p;
+    }
+
+    std::string zone(int member) const {
+        for(auto const &z : zones)
+            for(auto m : z.second)
+                if(m == member)
+                    return z.first;
+        return {};
+    }
+
+    LinkProfile const &profile(int a, int b) const {
+        auto it = links.find(std::make_pair(zone(a), zone(b)));
+        return it == links.end() ? default_profile : it->second;
+    }
+
+    // Returns false and describes the first bad line in `error`
+    bool parse(std::istream &is, std::string *error = nullptr) {
+        std::string line;
+        for(int n = 1; std::getline(is, line); ++n) {
+            auto comment = line.find('#');
+            if(comment != std::string::npos)
+                line.erase(comment);
+            std::istringstream ls(line);
+            std::string cmd;
+            if(!(ls >> cmd))
+                continue;
+            bool ok = false;
+            if(cmd == "seed") {
+                ok = bool(ls >> seed);
+            } else if(cmd == "default") {
+                ok = parse_profile(ls, default_profile);
+            } else if(cmd == "zone") {
+                std::string name, member;
+                ok = bool(ls >> name);
+                auto &z = zones[name];
+                while(ok && ls >> member) {
+                    if(member == "clients") {
+                        z.push_back(clients);
+                    } else {
+                        std::istringstream ms(member);
+                        int index;
+                        ok = bool(ms >> index) && ms.eof() && index >= 0;
+                        z.push_back(index);
+                    }
+                }
+            } else if(cmd == "link") {
+                std::string a, b;
+                LinkProfile p = default_profile;
+                ok = ls >> a >> b && parse_profile(ls, p);
+                if(ok)
+                    link(a, b, p);
+            }
+            if(!ok) {
+                if(error != nullptr)
+                    *error = "line " + std::to_string(n) + ": " + line;
+                return false;
+            }
+        }
+        return true;
+    }
+
+private:
+    static bool parse_profile(std::istream &is, LinkProfile &p) {
+        std::string key;
+        while(is >> key) {
+            bool ok = true;
+            if(key == "latency")
+                ok = bool(is >> p.latency);
+            else if(key == "jitter")
+                ok = bool(is >> p.jitter);
+            else if(key == "uniform")
+                p.jitter_dist = LinkProfile::Jitter::Uniform;
+            else if(key == "normal")
+                p.jitter_dist = LinkProfile::Jitter::Normal;
+            else if(key == "exponential")
+                p.jitter_dist = LinkProfile::Jitter::Exponential;
+            else if(key == "bandwidth")
+                ok = bool(is >> p.bandwidth);
+            else if(key == "drop")
+                ok = is >> p.drop && p.drop >= 0.0 && p.drop <= 1.0;
+            else if(key == "duplicate")
+                ok = is >> p.duplicate && p.duplicate >= 0.0 && p.duplicate <= 1.0;
+            else if(key == "window")
+                ok = bool(is >> p.window);
+            else if(key == "queue")
+                ok = bool(is >> p.queue);
+            else
+                ok = false;
+            if(!ok)
+                return false;
+        }
+        return true;
+    }
+};
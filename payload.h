@@ -0,0 +1,154 @@
+#pragma once
+
+#include <map>
+#include <memory>
+#include <vector>
+#include "crypto.h"
+
+// Opaque payloads of requests and responses. Messages are unions copied by value, so
+// their requests hold the `Message::Payload` handle: the SHA-256 and the size. The bytes
+// are made once into a reference-counted immutable buffer and never copied after that,
+// the messages which carry them point to it in `Message::payload`: the request itself,
+// its PrePrepare, the view change messages re-proposing it, decisions and read answers.
+// Votes and certificates refer to the bytes by the digest only.
+//
+// Every node keeps the bytes it got in its own `Payloads`: `Node::put` checks them against
+// the digest, `Node::send` attaches them. A replica keeps the ones of requests it executed,
+// as its state; the others go once `limit` newer ones came.
+
+// Handle and the buffer, empty bytes are no payload and no buffer
+inline std::pair<Message::Payload, Buffer> make_payload(Bytes &&bytes) {
+    if(bytes.empty())
+        return {Message::Payload{}, nullptr};
+    Message::Payload p{sha256(bytes.data(), bytes.size()), static_cast<uint32_t>(bytes.size())};
+    return {p, std::make_shared<Bytes const>(std::move(bytes))};
+}
+
+// Handle of the payload the request carries, nullptr if none
+inline Message::Payload const *payload_of(Message::OpRequestMessage const &msg) {
+    return msg.type == Message::Type::Write && msg.data.write.payload.size != 0 ? &msg.data.write.payload : nullptr;
+}
+
+// Handle of the payload whose bytes go with the message, nullptr if none
+inline Message::Payload const *payload_of(Message const &msg) {
+    Message::Payload const *p = nullptr;
+    switch(msg.type) {
+    case Message::Type::Write:
+        p = &msg.data.write.payload;
+        break;
+    case Message::Type::ReadAck:
+        p = &msg.data.read_ack.payload;
+        break;
+    case Message::Type::Response:
+        if(msg.data.response.msg.type == Message::Type::ReadAck)
+            p = &msg.data.response.msg.data.read_ack.payload;
+        break;
+    case Message::Type::PrePrepare:
+        return payload_of(msg.data.preprepare.msg);
+    case Message::Type::ViewChange:
+        return msg.data.view_change.prepared ? payload_of(msg.data.view_change.proposal.msg) : nullptr;
+    case Message::Type::NewView:
+        return msg.data.new_view.prepared ? payload_of(msg.data.new_view.proposal.msg) : nullptr;
+    case Message::Type::Decision:
+        return payload_of(msg.data.decision.msg);
+    case Message::Type::Read:
+    case Message::Type::Kv:
+    case Message::Type::WriteAck:
+    case Message::Type::KvAck:
+    case Message::Type::Prepare:
+    case Message::Type::Commit:
+    case Message::Type::PrepareCertificate:
+    case Message::Type::CommitCertificate:
+    case Message::Type::Busy:
+    case Message::Type::Lease:
+    case Message::Type::SpecCommit:
+    case Message::Type::LocalCommit:
+    case Message::Type::Fetch:
+        break;
+    }
+    return p != nullptr && p->size != 0 ? p : nullptr;
+}
+
+class Payloads {
+public:
+    explicit Payloads(size_t limit = 4096) : _limit(limit) {}
+
+    // Takes the bytes the message carries; false if they don't match its digest
+    bool absorb(Message const &msg) {
+        auto const p = payload_of(msg);
+        if(p == nullptr || msg.payload == nullptr)
+            return true;
+        if(get(*p) == nullptr && (msg.payload->size() != p->size || sha256(msg.payload->data(), p->size) != p->digest))
+            return false;
+        put(*p, msg.payload);
+        return true;
+    }
+
+    // Bytes go with the message if it carries them and the node has them
+    void attach(Message &msg) const {
+        if(msg.payload != nullptr)
+            return;
+        if(auto const p = payload_of(msg))
+            msg.payload = get(*p);
+    }
+
+    // The bytes must match the handle, the ones the node has stay
+    void put(Message::Payload const &p, Buffer const &bytes) {
+        auto &e = _entries[p.digest];
+        if(e.bytes == nullptr) {
+            e.bytes = bytes;
+            ++_transient;
+        }
+        e.seq = ++_seq;
+        if(_transient > 2 * _limit)
+            sweep();
+    }
+
+    // nullptr if the node doesn't have the bytes
+    Buffer get(Message::Payload const &p) const {
+        auto it = _entries.find(p.digest);
+        return it != _entries.end() && it->second.bytes->size() == p.size ? it->second.bytes : nullptr;
+    }
+
+    // True if the request has no payload or the node has its bytes
+    bool has(Message::OpRequestMessage const &msg) const {
+        auto const p = payload_of(msg);
+        return p == nullptr || get(*p) != nullptr;
+    }
+
+    // The request is executed, its bytes are the state now
+    void keep(Message::OpRequestMessage const &msg) {
+        auto const p = payload_of(msg);
+        auto it = p != nullptr ? _entries.find(p->digest) : _entries.end();
+        if(it != _entries.end() && !it->second.kept) {
+            it->second.kept = true;
+            --_transient;
+        }
+    }
+
+    size_t size() const { return _entries.size(); }
+
+private:
+    struct Entry {
+        Buffer bytes;
+        uint64_t seq = 0; // of the last put
+        bool kept = false;
+    };
+
+    // Drops the bytes not kept and not put again among the last `_limit`
+    void sweep() {
+        for(auto it = _entries.begin(); it != _entries.end();) {
+            if(!it->second.kept && it->second.seq + _limit < _seq) {
+                it = _entries.erase(it);
+                --_transient;
+            } else {
+                ++it;
+            }
+        }
+    }
+
+    std::map<PayloadDigest, Entry> _entries;
+    size_t _limit;
+    size_t _transient = 0; // not kept
+    uint64_t _seq = 0;
+};
@@ -1,47 +1,110 @@
 #pragma once
 
 #include <cassert>
+#include <array>
+#include <limits>
+#include <tuple>
+#include <deque>
+#include <set>
+#include <functional>
+#include <algorithm>
 #include "pbft_types.h"
 #include "crypto.h"
+#include "payload.h"
+#include "executor.h"
+#include "votes.h"
+#include "reply_cache.h"
+#include "profile.h"
 
 #if defined (__clang__)
 #define FALLTHROUGH [[clang::fallthrough]]
+#elif defined (__GNUC__) && __GNUC__ >= 7
+#define FALLTHROUGH [[gnu::fallthrough]]
 #else
 #define FALLTHROUGH
 #endif
 
 // Represents state of the pbft node.
 // Has few hacky fallthrough-s in order to cover f=0
+// Votes are counted by the tracker per replica (its position), so repeated votes of
+// one replica don't make a quorum. `State` takes f at runtime, BasicState<VoteTracker<F>>
+// is the compile time specialized one, its record fits the cache line for F <= 3.
 
-class State {
+template<typename Votes>
+class BasicState {
 public:
-    enum class Type { Init, PrePrepare, Prepare, Prepared, Commit, Committed };
+    enum class Type : uint8_t { Init, PrePrepare, Prepare, Prepared, Commit, Committed };
 
-    State(int f = 1) : _f(f) {}
+    BasicState(int f = 1) : _votes(f) {}
 
     Type state() const { return _state; }
-    int approves() const { return _approves; }
+    // Votes of the phase in progress or just finished
+    int approves() const {
+        switch(_state) {
+        case Type::Init:
+        case Type::PrePrepare:
+            return 0;
+        case Type::Prepare:
+        case Type::Prepared:
+            return _votes.count(Phase::Prepare);
+        case Type::Commit:
+        case Type::Committed:
+            return _votes.count(Phase::Commit);
+        }
+        return 0; // happy gcc
+    }
     uint32_t view() const { return _view; }
     uint32_t req_id() const { return _req_id; }
-    int f() const { return _f; }
+    int f() const { return _votes.f(); }
+
+    // The last req_id known to be committed
+    uint32_t committed() const {
+        switch(_state) {
+        case Type::Init:
+            return 0;
+        case Type::Committed:
+            return _req_id;
+        case Type::PrePrepare:
+        case Type::Prepare:
+        case Type::Prepared:
+        case Type::Commit:
+            return _req_id - 1;
+        }
+        return 0; // happy gcc
+    }
+
+    bool prepared() const {
+        return _state == Type::Prepared || _state == Type::Commit;
+    }
+
+    // Enters `view`, which continues the sequence after `committed`.
+    // In-flight instance, if any, is abandoned.
+    void new_view(uint32_t view, uint32_t committed) {
+        _view = view;
+        _req_id = committed;
+        _votes.clear();
+        _state = Type::Committed;
+    }
 
+    // The next instance starts only once this one is committed, it's never skipped
     bool preprepare(uint32_t view, uint32_t req_id) {
         switch(_state) {
         case Type::Init:
             _view = view;
             _req_id = req_id;
-            _approves = 1;
+            _votes.clear();
             _state = Type::PrePrepare;
             return true;
         case Type::PrePrepare:
         case Type::Prepare:
         case Type::Prepared:
         case Type::Commit:
+            return false;
         case Type::Committed:
             if(_view == view && _req_id == req_id - 1) {
                 _view = view;
                 _req_id = req_id;
-                _approves = 1;
+                _votes.clear();
                 _state = Type::PrePrepare;
                 return true;
             }
@@ -50,7 +113,8 @@ public:
         return false; // happy gcc
     }
 
-    bool prepare(uint32_t view, uint32_t req_id) {
+    // `voter` is the position of the replica, false if it has voted already
+    bool prepare(uint32_t view, uint32_t req_id, size_t voter) {
         if(_view != view || _req_id != req_id)
             return false;
         switch(_state) {
@@ -58,14 +122,12 @@ public:
             return false;
         case Type::PrePrepare:
             _state = Type::Prepare;
-            _approves = 0;
             FALLTHROUGH;
         case Type::Prepare:
-            ++_approves;
-            if(_approves >= _f * 2) {
+            if(!_votes.vote(Phase::Prepare, voter))
+                return false;
+            if(_votes.count(Phase::Prepare) >= _votes.quorum(Phase::Prepare))
                 _state = Type::Prepared;
-                _approves = 1;
-            }
             return true;
         case Type::Prepared:
         case Type::Commit:
@@ -75,7 +137,7 @@ public:
         return false; // happy gcc
     }
 
-    bool commit(uint32_t view, uint32_t req_id) {
+    bool commit(uint32_t view, uint32_t req_id, size_t voter) {
         if(_view != view || _req_id != req_id)
             return false;
         switch(_state) {
@@ -85,14 +147,12 @@ public:
             return false;
         case Type::Prepared:
             _state = Type::Commit;
-            _approves = 0;
             FALLTHROUGH;
         case Type::Commit:
-            ++_approves;
-            if(_approves >= _f * 2 + 1) {
+            if(!_votes.vote(Phase::Commit, voter))
+                return false;
+            if(_votes.count(Phase::Commit) >= _votes.quorum(Phase::Commit))
                 _state = Type::Committed;
-                _approves = 1;
-            }
             return true;
         case Type::Committed:
             return false;
@@ -100,147 +160,1516 @@ public:
         return false; // happy gcc
     }
 
+    // Weighted voting, see VoteTracker<0>
+    void set_weights(std::vector<uint8_t> const &weights, int prepare_quorum, int commit_quorum) {
+        _votes.set_weights(weights, prepare_quorum, commit_quorum);
+    }
+
+    // Speculative mode: the instance is executed on the primary's order alone
+    bool speculate(uint32_t view, uint32_t req_id) {
+        if(!preprepare(view, req_id))
+            return false;
+        _state = Type::Committed;
+        return true;
+    }
+
+    // Quorum of Prepare-s is proven by the collector's certificate
+    bool certify_prepare(uint32_t view, uint32_t req_id) {
+        if(_view != view || _req_id != req_id || (_state != Type::PrePrepare && _state != Type::Prepare))
+            return false;
+        _state = Type::Prepared;
+        return true;
+    }
+
+    // Quorum of Commit-s is proven by the collector's certificate
+    bool certify_commit(uint32_t view, uint32_t req_id) {
+        if(_view != view || _req_id != req_id || (_state != Type::Prepared && _state != Type::Commit))
+            return false;
+        _state = Type::Committed;
+        return true;
+    }
+
+    // Catch-up: the next req_id is committed by the certificate of another replica,
+    // the instance in flight, if any, is done with it
+    bool catch_up(uint32_t req_id) {
+        if(req_id != committed() + 1)
+            return false;
+        _req_id = req_id;
+        _votes.clear();
+        _state = Type::Committed;
+        return true;
+    }
+
 private:
+    uint32_t _view = 0, _req_id = 0;
     Type _state = Type::Init;
-    int _approves = 0;
-    uint32_t _view, _req_id;
-    int _f = 1;
+    Votes _votes;
 };
 
+using State = BasicState<VoteTracker<0>>;
+
+static_assert(sizeof(BasicState<VoteTracker<1>>) <= 64, "instance record must fit the cache line");
+static_assert(sizeof(BasicState<VoteTracker<3>>) <= 64, "instance record must fit the cache line");
+
 
-// The pbft node. Doesn't support change-view. You have to say which node is primary.
-// View is harcoded and 0.
-// No way to restore from broken (stuck) state.
+// The pbft node. Without the list of replicas it runs in view 0 with the primary given
+// by `set_primary`, and never changes view.
+// With the list of replicas the primary of view v is replicas[v mod n]. Every node keeps
+// client requests till they are committed, replica runs a request timer meanwhile. When
+// the timer expires, replica stops taking part in the current view and multicasts
+// ViewChange; it also joins a view change when f+1 others did. The new primary collects
+// 2f+1 ViewChange-s and multicasts NewView, which re-proposes the prepared request if
+// any. The timeout doubles with every failed attempt and resets on commit.
+// ViewChange carries the certificates of the last commit and of the prepared request,
+// replicas redo the primary's choice from the same ViewChange-s before taking NewView.
+// A replica which missed commits fetches them with their certificates from the others.
 // Doesn't work with f=0, seems to require additional internal hops. Or `State` handles
 // it in a wrong way.
 
+// Agreement phases go either all-to-all, O(n^2) messages per request, or through the
+// collector: replicas send their Prepare/Commit votes to it, and it multicasts one
+// certificate per phase when the quorum is collected, O(n) messages. Votes are signed,
+// a certificate carries the aggregate of its voters' signatures and is taken only from
+// the instance's collector. The collector is the primary, or rotates with req_id to
+// spread the load; the rotating one needs the view change to get over a dead collector.
+// Collector mode needs the list of replicas, 64 at most.
+
+// PrePrepare may be disseminated over a tree instead of direct multicast from the
+// primary. The tree of view v has the primary as root and replicas in the order
+// replicas[(v + i) mod n] at positions i, children of position i are i*fanout+1 ...
+// i*fanout+fanout. Inner replica forwards the proposal to its children as soon as it
+// accepts it. If some replicas haven't voted within the dissemination timeout, the
+// primary sends them the proposal directly.
+
+// Multi-leader mode: the node is one lane of a replica. Every lane is a PBFT instance of
+// its own with its own primary and clients, lane l of L orders global positions
+// (req_id - 1) * L + l. Committed requests go to the replica's Merger, which executes
+// them in the global order and answers clients through the lane. A lane primary with
+// nothing to order proposes a no-op (client 0) when other lanes are ahead of it, so the
+// merged order doesn't stall.
+
+// Learners are non-voting replicas, fed with Decision-s of committed requests, see
+// learner.h. They don't take part in the agreement.
+
 // After node handles user message it signs it by its private key (node->id())
 // Maybe we need to resign it after every hop? Or sign by user?
 
 class PBFTNode : public Node {
 public:
     enum class Role { Primary, Replica };
+    enum class Communication { AllToAll, Collector, RotatingCollector };
 
     struct SuccessStrategy {
         virtual ~SuccessStrategy() = default;
         virtual Message::OpResponseMessage accept(Message::OpRequestMessage const &msg) = 0;
+        // Executes the run of committed requests, appends their responses to `results`.
+        // Must give the same as accepting them one by one in the given order.
+        virtual void accept_run(std::vector<Message::OpRequestMessage> const &run, std::vector<Message::OpResponseMessage> &results) {
+            for(auto const &msg : run)
+                results.push_back(accept(msg));
+        }
     };
     using SuccessStrategyPtr = std::unique_ptr<SuccessStrategy>;
+    struct Merger {
+        virtual ~Merger() = default;
+        // Client 0 is a no-op or a request the lane doesn't execute again
+        virtual void committed(size_t lane, uint32_t req_id, uintptr_t client, Message::OpRequestMessage const &msg) = 0;
+        // Some lane has committed a later position than the next one of this lane
+        virtual bool behind(size_t lane, uint32_t committed) const = 0;
+    };
+    using Job = std::pair<uintptr_t, Message::OpRequestMessage>;
+    using Completion = std::pair<uintptr_t, Message::Response>;
+    using Stage = ExecutionStage<Job, Completion>;
 
     PBFTNode(Role r, int f): _state(f), _role(r) { assert (f > 0); }
 
     State const &state() const { return _state; }
     Role const &role() const { return _role; }
+    uint32_t view() const { return _view; }
+    bool view_changing() const { return _changing; }
+    uint64_t executed() const { return _executed; } // applied, not duplicates or cached answers
+    uint32_t last_commit_view() const { return _last_commit_view; }
     void set_primary(std::shared_ptr<Node> const &p) { _primary = p; }
-    void set_success_startegy(SuccessStrategyPtr &&s) { _success_strategy = std::move(s); }
+    // Protocol messages go to these nodes only, not to everyone linked (e.g. clients).
+    // Empty list means broadcast. The order defines primaries of views.
+    void set_replicas(std::vector<uintptr_t> const &r) {
+        _replicas = r;
+        _role = primary_id(_view) == id() ? Role::Primary : Role::Replica;
+    }
+    void set_timeout(uint64_t ticks) { _timeout = ticks; }
+    // Fanout 0 means direct multicast
+    void set_dissemination(unsigned fanout, uint64_t timeout) {
+        assert(fanout == 0 || view_change_enabled());
+        _fanout = fanout;
+        _tree_timeout = timeout;
+    }
+    void set_communication(Communication c) {
+        assert(c == Communication::AllToAll || (view_change_enabled() && _replicas.size() <= 64));
+        _communication = c;
+    }
+    void set_success_startegy(SuccessStrategyPtr &&s) {
+        assert(_stage == nullptr);
+        _success_strategy = std::move(s);
+    }
+    // The merger outlives the node
+    void set_merger(Merger *m, size_t lane) {
+        assert(_stage == nullptr);
+        _merger = m;
+        _lane = lane;
+    }
+    // Signs and sends the answer of a committed request, speculative one comes with the history
+    void respond(uintptr_t client, Message::OpResponseMessage &&answer, uint64_t timestamp, uint32_t req_id = 0, Digest history = 0) {
+        auto sig = signature(digest(answer), id());
+        Message::Response r{std::move(answer), sig, timestamp, false, _view, req_id, history};
+        _replies.answer(client, r);
+        send_to(client, std::move(r));
+    }
+    // Zyzzyva-like: replicas execute on the PrePrepare, no Prepare and Commit; there's no rollback
+    // if a faulty primary orders differently for some. Not with the execution stage or several leaders.
+    void set_speculative(bool on) {
+        assert(!on || (_stage == nullptr && _merger == nullptr));
+        _speculative = on;
+    }
+    bool speculative() const { return _speculative; }
+    // WHEAT-like voting of 3f+1+delta replicas: `heavy` is the bitmap of the 2f weighing more, 0 is
+    // off; with `adaptive` the ViewChange-s pick them for every view. Not with speculative mode or leases.
+    void set_weighted(uint64_t heavy, bool adaptive = true) {
+        assert(heavy == 0 || (view_change_enabled() && !_speculative && _lease_duration == 0));
+        _heavy = heavy;
+        _adaptive = adaptive;
+        apply_weights();
+    }
+    uint64_t heavy() const { return _heavy; }
+    // Moves execution to its own thread: committed requests go to it through a queue of
+    // `capacity`, it executes them and signs responses, the node sends them on its next
+    // ticks. When the queue is full, committed requests wait in the node and the primary
+    // stops proposing. Capacity 0 executes inline. Call after set_success_startegy.
+    void set_execution_stage(size_t capacity) {
+        _stage.reset();
+        if(capacity == 0 || _success_strategy == nullptr)
+            return;
+        auto strategy = _success_strategy.get();
+        auto signer = id();
+        _stage.reset(new Stage(capacity, [strategy, signer](std::vector<Job> const &jobs, std::vector<Completion> &out) {
+            std::vector<Message::OpRequestMessage> run;
+            std::vector<Message::OpResponseMessage> answers;
+            for(auto const &j : jobs)
+                run.push_back(j.second);
+            strategy->accept_run(run, answers);
+            for(size_t i = 0; i < jobs.size(); ++i)
+                out.emplace_back(jobs[i].first, Message::Response{answers[i], signature(digest(answers[i]), signer), jobs[i].second.timestamp()});
+        }, Job(0, Message::ReadOpRequest{0}), Completion(0, Message::Response{Message::ReadOpResponse{false, 0}, 0})));
+    }
+    // Non-voting learners get the Decision of every request this node commits, see learner.h
+    void set_learners(std::vector<uintptr_t> const &l) {
+        assert(l.empty() || (view_change_enabled() && _merger == nullptr));
+        _learners = l;
+    }
+    // The primary takes at most `window` client requests waiting to be ordered, it answers
+    // Busy to the rest. 0 is unlimited.
+    void set_admission(size_t window) { _admission = window; }
+    uint64_t rejected() const { return _rejected; }
+    // Restoring the cache is a part of restoring the replica from a checkpoint
+    ReplyCache const &reply_cache() const { return _replies; }
+    void set_reply_cache(ReplyCache const &c) { _replies = c; }
+    // Read leases: while 2f replicas promise to stay in its view, the primary answers reads
+    // alone. `duration` is in ticks, or in units of `clock` on a real transport; 0 is off.
+    using Clock = std::function<uint64_t()>;
+    void set_lease(uint64_t duration, Clock clock = nullptr) {
+        assert(duration == 0 || view_change_enabled());
+        _lease_duration = duration;
+        _clock = std::move(clock);
+    }
+    bool has_lease() const {
+        return _lease_duration != 0 && _role == Role::Primary && !_changing && clock() < _lease_until;
+    }
+    uint64_t lease_reads() const { return _lease_reads; } // answered under the lease
+    // Intake: with a budget the node handles that many messages a tick, the rest wait in lanes
+    // out of the inbox, not holding link credits. Without one, the whole inbox in arrival order.
+    struct Intake {
+        size_t budget = 0;        // messages handled a tick, 0 is the whole inbox
+        bool lanes = true;        // false is one lane, arrival order within the budget
+        std::array<size_t, 3> weights = {{8, 4, 1}}; // agreement, proposals, clients
+        uint64_t max_wait = 32;   // ticks
+    };
+    void set_intake(Intake const &i) {
+        assert(std::all_of(i.weights.begin(), i.weights.end(), [](size_t w) { return w > 0; }));
+        _intake = i;
+    }
+    size_t backlog() const { // messages waiting in the lanes
+        size_t n = 0;
+        for(auto const &l : _lanes)
+            n += l.size();
+        return n;
+    }
+    uint64_t aged() const { return _aged; } // handled for having waited `max_wait`
+    Stage::Stats execution_stats() const { return _stage == nullptr ? Stage::Stats() : _stage->stats(); }
+
+    // The request with its client, votes and proofs refer to it
+    static Digest request_digest(Message::PrePrepare const &m) {
+        return digest(m.msg) ^ (static_cast<Digest>(m.client) * 0x9e3779b97f4a7c15);
+    }
+
+    // What a replica signs voting in the phase for the request at (view, req_id)
+    static Digest vote_digest(Phase p, uint32_t view, uint32_t req_id, Digest request) {
+        return (request * 0x100000001b3 + ((static_cast<Digest>(view) << 32) | req_id)) * 2 + (p == Phase::Commit);
+    }
+
+    static Digest vote_digest(Phase p, Message::PrePrepare const &m) {
+        return vote_digest(p, m.view, m.req_id, request_digest(m));
+    }
 
     void on_tick() override {
+        PBFT_PROFILE_NODE(id(), "PBFTNode");
+        ++_now;
         auto inbox = take_inbox();
-        for(auto &mm : inbox) {
-            auto const s = mm.first;
-            auto &m = mm.second;
-            switch(m.type) {
-            case Message::Type::Write:
-                process(s, std::move(m.data.write));
-                break;
-            case Message::Type::Read:
-                process(s, std::move(m.data.read));
-                break;
-            case Message::Type::PrePrepare:
-                process(s, std::move(m.data.preprepare));
-                break;
-            case Message::Type::Prepare:
-                process(s, std::move(m.data.prepare));
-                break;
-            case Message::Type::Commit:
-                process(s, std::move(m.data.commit));
+        if(_intake.budget == 0) {
+            for(auto &mm : inbox)
+                handle(mm.first, std::move(mm.second));
+        } else {
+            for(auto &mm : inbox)
+                enqueue(mm.first, std::move(mm.second));
+            drain();
+        }
+        execute();
+        serve_reads();
+        if(_role == Role::Primary && !_changing && _run.empty() && _state.committed() >= _known_committed) {
+            propose();
+            check_dissemination();
+        }
+        check_stall();
+        check_timer();
+        renew_lease();
+    }
+
+private:
+    void dispatch(uintptr_t s, Message &&m) {
+        PBFT_PROFILE_SCOPE(type_name(m.type));
+        switch(m.type) {
+        case Message::Type::Write:
+            process(s, std::move(m.data.write));
+            break;
+        case Message::Type::Read:
+            process(s, std::move(m.data.read));
+            break;
+        case Message::Type::Kv:
+            process(s, std::move(m.data.kv));
+            break;
+        case Message::Type::PrePrepare:
+            process(s, std::move(m.data.preprepare));
+            break;
+        case Message::Type::Prepare:
+            process(s, std::move(m.data.prepare));
+            break;
+        case Message::Type::Commit:
+            process(s, std::move(m.data.commit));
+            break;
+        case Message::Type::ViewChange:
+            process(s, std::move(m.data.view_change));
+            break;
+        case Message::Type::NewView:
+            process(s, std::move(m.data.new_view));
+            break;
+        case Message::Type::PrepareCertificate:
+            process(s, std::move(m.data.prepare_certificate));
+            break;
+        case Message::Type::CommitCertificate:
+            process(s, std::move(m.data.commit_certificate));
+            break;
+        case Message::Type::Busy:
+            process(s, std::move(m.data.busy));
+            break;
+        case Message::Type::Lease:
+            process(s, std::move(m.data.lease));
+            break;
+        case Message::Type::SpecCommit:
+            process(s, std::move(m.data.spec_commit));
+            break;
+        case Message::Type::Decision:
+            process(s, std::move(m.data.decision));
+            break;
+        case Message::Type::Fetch:
+            process(s, std::move(m.data.fetch));
+            break;
+        case Message::Type::WriteAck:
+        case Message::Type::ReadAck:
+        case Message::Type::KvAck:
+        case Message::Type::Response:
+        case Message::Type::LocalCommit:
+            assert(not("Unreachable"));
+        }
+    }
+
+    void handle(uintptr_t s, Message &&m) {
+        auto const before = position();
+        dispatch(s, std::move(m));
+        if(position() != before)
+            replay();
+    }
+
+    // Agreement is votes, certificates, view change, lease and SpecCommit
+    enum Lane : size_t { Agreement, Proposals, Clients, Lanes };
+
+    // Vote of an instance this node is done with
+    bool done(Message::PrePrepare const &m) const {
+        return m.view < _view || (m.view == _view && m.req_id < _state.req_id());
+    }
+
+    // Votes of instances the node is done with are dropped as they come
+    void enqueue(uintptr_t s, Message &&m) {
+        auto lane = Agreement;
+        switch(m.type) {
+        case Message::Type::Prepare:
+            if(done(m.data.prepare))
+                return;
+            break;
+        case Message::Type::Commit:
+            if(done(m.data.commit))
+                return;
+            break;
+        case Message::Type::PrepareCertificate:
+            if(done(m.data.prepare_certificate))
+                return;
+            break;
+        case Message::Type::CommitCertificate:
+            if(done(m.data.commit_certificate))
+                return;
+            break;
+        case Message::Type::ViewChange:
+        case Message::Type::NewView:
+        case Message::Type::Lease:
+        case Message::Type::SpecCommit:
+        case Message::Type::Decision:
+        case Message::Type::Fetch:
+            break;
+        case Message::Type::PrePrepare:
+            lane = Proposals;
+            break;
+        case Message::Type::Write:
+        case Message::Type::Read:
+        case Message::Type::Kv:
+        case Message::Type::Busy:
+            lane = Clients;
+            break;
+        case Message::Type::WriteAck:
+        case Message::Type::ReadAck:
+        case Message::Type::KvAck:
+        case Message::Type::Response:
+        case Message::Type::LocalCommit:
+            assert(not("Unreachable"));
+        }
+        _lanes[_intake.lanes ? lane : Agreement].emplace_back(_now, s, std::move(m));
+    }
+
+    // Heads which waited `max_wait` first, so new requests still get in under saturation, then
+    // round robin turns of up to the lane's weight, a turn carries over to the next tick
+    void drain() {
+        auto budget = _intake.budget;
+        for(; budget != 0; --budget) {
+            auto oldest = Lanes;
+            for(size_t l = Agreement; l < Lanes; ++l)
+                if(!_lanes[l].empty() && _now - std::get<0>(_lanes[l].front()) >= _intake.max_wait &&
+                   (oldest == Lanes || std::get<0>(_lanes[l].front()) < std::get<0>(_lanes[oldest].front())))
+                    oldest = static_cast<Lane>(l);
+            if(oldest == Lanes)
                 break;
-            case Message::Type::WriteAck:
-            case Message::Type::ReadAck:
-            case Message::Type::Response:
-                assert(not("Unreachable"));
+            pop(oldest);
+            ++_aged;
+        }
+        while(budget != 0 && backlog() != 0) {
+            if(_lanes[_turn].empty() || _served == _intake.weights[_turn]) {
+                _turn = static_cast<Lane>((_turn + 1) % Lanes);
+                _served = 0;
+                continue;
             }
+            pop(_turn);
+            ++_served;
+            --budget;
         }
     }
 
-private:
+    void pop(Lane l) {
+        auto &m = _lanes[l].front();
+        handle(std::get<1>(m), std::move(std::get<2>(m)));
+        _lanes[l].pop_front();
+    }
+
+    std::tuple<uint32_t, uint32_t, State::Type> position() const {
+        return std::make_tuple(_state.view(), _state.req_id(), _state.state());
+    }
+
+    // Agreement message of the current view which came before its instance got to the
+    // phase it's for, e.g. Prepare which overtook its PrePrepare. It's kept and retried
+    // when the instance moves on.
+    bool early(uint32_t view, uint32_t req_id, State::Type phase) const {
+        return view == _view && (req_id > _state.req_id() || (req_id == _state.req_id() && _state.state() < phase));
+    }
+
     template<typename T>
-    bool verify_message(T const &msg) {
+    void postpone(uintptr_t sender, T &&msg) {
+        constexpr size_t limit = 1024;
+        if(_early.size() == limit)
+            _early.pop_front();
+        _early.emplace_back(sender, Message(std::move(msg)));
+    }
+
+    void replay() {
+        for(;;) {
+            auto const before = position();
+            auto early = std::move(_early);
+            _early.clear();
+            for(auto &m : early)
+                dispatch(m.first, std::move(m.second));
+            if(position() == before)
+                return;
+        }
+    }
+
+    bool view_change_enabled() const {
+        return !_replicas.empty();
+    }
+
+    uintptr_t primary_id(uint32_t view) const {
+        if(view_change_enabled())
+            return _replicas[view % _replicas.size()];
         auto ptr = _primary.lock();
-        return ptr != nullptr && ::verify_message(msg.msg, msg.sig, ptr->id());
+        return ptr != nullptr ? ptr->id() : 0;
     }
 
     template<typename T>
-    auto prepreare(uintptr_t client, T &&msg) const {
+    bool verify_message(T const &msg) const {
+        auto primary = primary_id(msg.view);
+        return primary != 0 && ::verify_message(msg.msg, msg.sig, primary);
+    }
+
+    template<typename T>
+    auto prepreare(uintptr_t client, T &&msg, uint32_t req_id) const {
         auto sig = signature(digest(msg), id());
-        return Message::PrePrepare{std::move(msg), sig, client, _view, req_id()};
+        return Message::PrePrepare{std::move(msg), sig, client, _view, req_id};
     }
 
     auto prepare(Message::PrePrepare &&msg) const {
-        return Message::Prepare(std::move(msg));
+        auto const vote = signature(vote_digest(Phase::Prepare, msg), id());
+        return Message::Prepare(std::move(msg), vote);
+    }
+
+    auto commit(Message::PrePrepare &&msg) const {
+        auto const vote = signature(vote_digest(Phase::Commit, msg), id());
+        return Message::Commit(std::move(msg), vote);
+    }
+
+    // Aggregate of the votes of the replicas in the bitmap
+    bool verify_votes(Digest vote, uint64_t voters, Signature votes) const {
+        std::vector<uintptr_t> signers;
+        for(size_t i = 0; voters != 0; ++i, voters >>= 1) {
+            if(!(voters & 1))
+                continue;
+            if(i >= _replicas.size())
+                return false;
+            signers.push_back(_replicas[i]);
+        }
+        return verify_aggregate(vote, votes, signers);
+    }
+
+    // Quorum of the phase in the view, the primary's PrePrepare stands for its Prepare
+    bool certified(Phase p, uint32_t view, uint32_t req_id, Digest request, uint64_t voters, Signature votes) const {
+        auto const primary = p == Phase::Prepare ? uint64_t(1) << (view % _replicas.size()) : 0;
+        return weight_in(view, voters | primary) >= quorum() && verify_votes(vote_digest(p, view, req_id, request), voters, votes);
+    }
+
+    bool certified(Phase p, Message::Certificate const &c) const {
+        return certified(p, c.view, c.req_id, request_digest(c), c.voters, c.votes);
+    }
+
+    bool certified(Message::Proof const &p) const {
+        return certified(Phase::Commit, p.view, p.req_id, p.request, p.voters, p.votes);
+    }
+
+    bool collecting() const {
+        return _communication != Communication::AllToAll;
+    }
+
+    uintptr_t collector_id(uint32_t view, uint32_t req_id) const {
+        if(_communication == Communication::RotatingCollector)
+            return _replicas[(view + req_id) % _replicas.size()];
+        return primary_id(view);
+    }
+
+    uint64_t voter_bit(uintptr_t node) const {
+        for(size_t i = 0; i < _replicas.size(); ++i)
+            if(_replicas[i] == node)
+                return uint64_t(1) << i;
+        return 0;
+    }
+
+    // Position of the node in votes of State: in the list of replicas, or in the order
+    // of appearance if there's no list
+    size_t voter_index(uintptr_t node) {
+        for(size_t i = 0; i < _replicas.size(); ++i)
+            if(_replicas[i] == node)
+                return i;
+        auto it = _voter_index.find(node);
+        if(it == _voter_index.end())
+            it = _voter_index.emplace(node, _replicas.size() + _voter_index.size()).first;
+        return it->second;
+    }
+
+    // Weight of the replica at the position, 1 each without weighted voting
+    int weight(size_t position) const {
+        if(_heavy == 0)
+            return 1;
+        return position < _weights.weight.size() ? _weights.weight[position] : 0;
+    }
+
+    int bitmap_weight(uint64_t bitmap) const {
+        int w = 0;
+        for(size_t i = 0; bitmap != 0; ++i, bitmap >>= 1)
+            w += (bitmap & 1) ? weight(i) : 0;
+        return w;
+    }
+
+    // Heavy replicas of other views aren't known here: the bitmap weighs at least as
+    // with the fewest of them in it
+    int weight_in(uint32_t view, uint64_t bitmap) const {
+        if(_heavy == 0 || view == _view)
+            return bitmap_weight(bitmap);
+        auto const n = static_cast<int>(_replicas.size()), f = _state.f(), k = voters(bitmap);
+        return k * f + (n - 3 * f - 1) * std::max(0, k - (n - 2 * f));
+    }
+
+    template<typename T>
+    int senders_weight(std::map<uintptr_t, T> const &votes) {
+        int w = 0;
+        for(auto const &v : votes)
+            w += weight(voter_index(v.first));
+        return w;
+    }
+
+    int quorum() const { return _heavy == 0 ? _state.f() * 2 + 1 : _weights.quorum; }
+    int faulty() const { return _heavy == 0 ? _state.f() : _weights.faulty; }
+
+    // For the instances of the current view: the primary's own vote is its PrePrepare
+    void apply_weights() {
+        if(_heavy == 0) {
+            _weights = Weights();
+            _state.set_weights({}, 0, 0);
+            return;
+        }
+        _weights = wheat_weights(_state.f(), _replicas.size(), _heavy);
+        _state.set_weights(_weights.weight, _weights.quorum - weight(_view % _replicas.size()), _weights.quorum);
+    }
+
+    // Delay of the replica's vote since this node started the instance, smoothed
+    void measure(uintptr_t sender) {
+        auto const i = voter_index(sender);
+        if(_heavy == 0 || !_adaptive || i >= _replicas.size())
+            return;
+        _vote_delay.resize(_replicas.size(), -1);
+        auto const d = static_cast<double>(_now - _instance_start);
+        _vote_delay[i] = _vote_delay[i] < 0 ? d : _vote_delay[i] * 0.875 + d * 0.125;
     }
 
-    auto commit(Message::Prepare &&msg) const {
-        return Message::Commit(std::move(msg));
+    // The 2f replicas whose votes came the fastest, this one first, named by its ViewChange
+    uint64_t pick_heavy() {
+        auto const self = voter_index(id());
+        auto delay = [this, self](size_t i) {
+            if(i == self)
+                return -1.0;
+            return i < _vote_delay.size() && _vote_delay[i] >= 0 ? _vote_delay[i] : std::numeric_limits<double>::max();
+        };
+        std::vector<size_t> order(_replicas.size());
+        for(size_t i = 0; i < order.size(); ++i)
+            order[i] = i;
+        std::stable_sort(order.begin(), order.end(), [&delay](size_t a, size_t b) { return delay(a) < delay(b); });
+        uint64_t heavy = 0;
+        for(int i = 0; i < 2 * _state.f(); ++i)
+            heavy |= uint64_t(1) << order[static_cast<size_t>(i)];
+        return heavy;
     }
 
+    static int voters(uint64_t bitmap) {
+        return __builtin_popcountll(bitmap);
+    }
+
+    void start_instance(Message::PrePrepare const &msg) {
+        _proposal.reset(new Message::PrePrepare(msg));
+        _prepare_voters = _commit_voters = 0;
+        _prepare_votes = _commit_votes = 0;
+        _instance_start = _now;
+    }
+
+    // Vote of the instance in flight goes to its certificate
+    void collect(Phase p, uintptr_t voter, Signature vote) {
+        auto const bit = voter_bit(voter);
+        auto &voters = p == Phase::Prepare ? _prepare_voters : _commit_voters;
+        if(bit == 0 || (voters & bit) != 0)
+            return;
+        voters |= bit;
+        auto &votes = p == Phase::Prepare ? _prepare_votes : _commit_votes;
+        votes = aggregate(votes, vote);
+    }
 
+    // Children of this node in the dissemination tree of `view`
+    std::vector<uintptr_t> children(uint32_t view) const {
+        std::vector<uintptr_t> c;
+        auto const n = _replicas.size();
+        size_t pos = 0;
+        while(pos < n && _replicas[(view + pos) % n] != id())
+            ++pos;
+        for(size_t i = pos * _fanout + 1; i <= pos * _fanout + _fanout && i < n; ++i)
+            c.push_back(_replicas[(view + i) % n]);
+        return c;
+    }
+
+    void disseminate(Message::PrePrepare const &msg) {
+        if(_fanout == 0) {
+            if(_role == Role::Primary)
+                to_replicas(Message::PrePrepare(msg));
+            return;
+        }
+        multicast(children(msg.view), Message::PrePrepare(msg));
+        if(_role == Role::Primary) {
+            _disseminated = _now;
+            _fallen_back = false;
+        }
+    }
+
+    // Replicas which haven't voted for the proposal in time get it from the primary directly
+    void check_dissemination() {
+        if(_fanout == 0 || _fallen_back || _proposal == nullptr || _now < _disseminated + _tree_timeout)
+            return;
+        if(_state.state() != State::Type::PrePrepare && _state.state() != State::Type::Prepare)
+            return;
+        _fallen_back = true;
+        for(auto r : _replicas)
+            if(r != id() && (_prepare_voters & voter_bit(r)) == 0)
+                send_to(r, Message::PrePrepare(*_proposal));
+    }
+
+    void to_replicas(Message &&msg) {
+        if(_replicas.empty())
+            broadcast(std::move(msg));
+        else
+            multicast(_replicas, std::move(msg));
+    }
+
+
+    // Every node keeps the request, the primary to order it, replicas to watch it's ordered
     void process(uintptr_t sender, Message::WriteOpRequest &&msg) {
-        if(_role != Role::Primary)
-            return; // only primary reacts on client requests. Change-view in TODO
-        auto p = prepreare(sender, std::move(msg));
-        if(_state.preprepare(p.view, p.req_id))
-            broadcast(std::move(p));
+        request(sender, std::move(msg));
     }
 
     void process(uintptr_t sender, Message::ReadOpRequest &&msg) {
-        if(_role != Role::Primary)
-            return; // only primary reacts on client requests. Change-view in TODO
-        auto p = prepreare(sender, std::move(msg));
-        if(_state.preprepare(p.view, p.req_id))
-            broadcast(std::move(p));
+        request(sender, std::move(msg));
     }
 
+    void process(uintptr_t sender, Message::KvRequest &&msg) {
+        request(sender, std::move(msg));
+    }
 
-    void process(uintptr_t sender[[gnu::unused]], Message::PrePrepare &&msg) {
-        if(_role == Role::Primary)
+    // Retransmitted request is answered from the reply cache, or dropped while it's in work
+    void request(uintptr_t client, Message::OpRequestMessage &&msg) {
+        auto const t = msg.timestamp();
+        switch(_replies.check(client, t)) {
+        case ReplyCache::Status::New:
+            break;
+        case ReplyCache::Status::Answered:
+            send_to(client, Message::Response(_replies.response(client)));
+            return;
+        case ReplyCache::Status::Stale:
+            return;
+        }
+        if(_role != Role::Primary && !view_change_enabled())
+            return;
+        if(msg.type == Message::Type::Read && _role == Role::Primary && has_lease()) {
+            _lease_reads_waiting.emplace_back(client, std::move(msg));
+            return;
+        }
+        if(msg.type == Message::Type::Read && _role == Role::Replica && clock() < _promised) {
+            unwatched_read(client, std::move(msg));
+            return;
+        }
+        if(t != 0) {
+            for(auto const &r : _requests)
+                if(r.first == client && r.second.timestamp() == t)
+                    return;
+            if(std::find(_busy.begin(), _busy.end(), std::make_pair(client, t)) != _busy.end())
+                return; // the primary has rejected it already
+        }
+        if(_role == Role::Primary && _admission != 0 && _requests.size() >= _admission) {
+            ++_rejected;
+            Message::Busy busy{client, t, _view};
+            send_to(client, Message::Busy(busy));
+            to_replicas(std::move(busy));
+            return;
+        }
+        _requests.emplace_back(client, std::move(msg));
+    }
+
+    // Replicas drop the request the primary has rejected, so it doesn't fire their timers.
+    // Busy may come before the request itself, last ones are remembered.
+    void process(uintptr_t sender, Message::Busy &&msg) {
+        constexpr size_t limit = 1024;
+        if(sender != primary_id(_view) || msg.view != _view || msg.timestamp == 0)
+            return;
+        for(auto it = _requests.begin(); it != _requests.end(); ++it) {
+            if(it->first == msg.client && it->second.timestamp() == msg.timestamp) {
+                _requests.erase(it);
+                break;
+            }
+        }
+        if(_busy.size() == limit)
+            _busy.pop_front();
+        _busy.emplace_back(msg.client, msg.timestamp);
+    }
+
+    // Primary's executed state has every write answered to clients when no instance is in
+    // flight and nothing committed waits for execution, reads wait for that. Without the
+    // lease they are ordered.
+    void serve_reads() {
+        if(_lease_reads_waiting.empty())
+            return;
+        if(!has_lease() || _success_strategy == nullptr) {
+            _requests.splice(_requests.end(), _lease_reads_waiting);
+            return;
+        }
+        if(!_run.empty() || (_stage != nullptr && _stage->in_flight() != 0))
+            return;
+        if(_state.state() != State::Type::Init && _state.state() != State::Type::Committed)
+            return;
+        for(auto const &r : _lease_reads_waiting) {
+            auto answer = _success_strategy->accept(r.second);
+            auto sig = signature(digest(answer), id());
+            send_to(r.first, Message::Response{std::move(answer), sig, r.second.timestamp(), true, _view});
+            ++_lease_reads;
+        }
+        _lease_reads_waiting.clear();
+    }
+
+    // Replica which promised the lease doesn't watch reads, the primary answers them.
+    // Recent ones are kept: if the primary fails, they are watched in the next view.
+    void unwatched_read(uintptr_t client, Message::OpRequestMessage &&msg) {
+        auto const now = clock();
+        while(!_unwatched.empty() && std::get<0>(_unwatched.front()) + 2 * _lease_duration < now)
+            _unwatched.pop_front();
+        _unwatched.emplace_back(now, client, std::move(msg));
+    }
+
+    // Primary orders one request at a time, the others wait till the current one is committed
+    void propose() {
+        PBFT_PROFILE_SCOPE("propose");
+        if(_state.state() != State::Type::Init && _state.state() != State::Type::Committed)
+            return;
+        if(_reproposal != nullptr) { // of NewView, this node has caught up since
+            auto p = std::move(*_reproposal);
+            _reproposal.reset();
+            if(_state.preprepare(p.view, p.req_id))
+                start_instance(p);
+            return;
+        }
+        if(_requests.empty()) {
+            if(_merger == nullptr || !_merger->behind(_lane, _state.committed()))
+                return;
+            _requests.emplace_back(0, Message::ReadOpRequest{0}); // no-op
+        }
+        auto r = std::move(_requests.front());
+        _requests.pop_front();
+        if(!payloads().has(r.second))
+            return; // the bytes are gone, the client sends them again
+        auto p = prepreare(r.first, std::move(r.second), _state.committed() + 1);
+        if(_speculative) {
+            if(_state.speculate(p.view, p.req_id)) {
+                p.history = chain(_history, p);
+                disseminate(p);
+                speculated(p);
+            }
+            return;
+        }
+        if(_state.preprepare(p.view, p.req_id)) {
+            start_instance(p);
+            disseminate(p);
+        }
+    }
+
+
+    void process(uintptr_t sender, Message::PrePrepare &&msg) {
+        if(_role == Role::Primary || _changing)
             return; // only replicas react on preprepare
-        if(!verify_message(msg))
+        if(!verify_message(msg) || !payloads().has(msg.msg))
+            return;
+        // The primary proposes the next request once it committed this one, votes of the
+        // others for this one may be still on the way
+        auto const idle = _state.state() == State::Type::Init || _state.state() == State::Type::Committed;
+        auto const next = idle && msg.req_id == _state.committed() + 1;
+        if(!next && early(msg.view, msg.req_id, State::Type::PrePrepare)) {
+            postpone(sender, std::move(msg));
+            return;
+        }
+        if(_speculative) {
+            if(msg.history == chain(_history, msg) && _state.speculate(msg.view, msg.req_id)) {
+                disseminate(msg);
+                speculated(msg);
+            }
             return;
-        if(_state.preprepare(msg.view, msg.req_id) && _state.prepare(msg.view, msg.req_id))
-            broadcast(prepare(std::move(msg)));
+        }
+        if(_state.preprepare(msg.view, msg.req_id) && _state.prepare(msg.view, msg.req_id, voter_index(id()))) {
+            start_instance(msg);
+            disseminate(msg);
+            auto p = prepare(std::move(msg));
+            collect(Phase::Prepare, id(), p.vote);
+            auto const collector = collector_id(p.view, p.req_id);
+            if(!collecting())
+                to_replicas(std::move(p));
+            else if(collector != id())
+                send_to(collector, std::move(p));
+        }
     }
 
-    void process(uintptr_t sender[[gnu::unused]], Message::Prepare &&msg) {
-        if(!verify_message(msg))
+    void process(uintptr_t sender, Message::Prepare &&msg) {
+        if(_changing || !verify_message(msg) || !verify_signature(vote_digest(Phase::Prepare, msg), msg.vote, sender))
+            return;
+        if(!_state.prepare(msg.view, msg.req_id, voter_index(sender))) {
+            if(early(msg.view, msg.req_id, State::Type::PrePrepare))
+                postpone(sender, std::move(msg));
+            return;
+        }
+        measure(sender);
+        collect(Phase::Prepare, sender, msg.vote);
+        if(!_state.commit(msg.view, msg.req_id, voter_index(id())))
             return;
-        if(_state.prepare(msg.view, msg.req_id) && _state.commit(msg.view, msg.req_id))
-            broadcast(commit(std::move(msg)));
+        _prepared.reset(new Message::Certificate(Message::PrePrepare(msg), _prepare_voters, _prepare_votes));
+        auto c = commit(Message::PrePrepare(msg));
+        collect(Phase::Commit, id(), c.vote);
+        if(collecting())
+            to_replicas(Message::PrepareCertificate(std::move(msg), _prepare_voters, _prepare_votes));
+        else
+            to_replicas(std::move(c));
+    }
+
+    void process(uintptr_t sender, Message::Commit &&msg) {
+        if(_changing || !verify_message(msg) || !verify_signature(vote_digest(Phase::Commit, msg), msg.vote, sender))
+            return;
+        if(!_state.commit(msg.view, msg.req_id, voter_index(sender))) {
+            if(early(msg.view, msg.req_id, State::Type::Prepared))
+                postpone(sender, std::move(msg));
+            return;
+        }
+        measure(sender);
+        collect(Phase::Commit, sender, msg.vote);
+        if(_state.state() != State::Type::Committed)
+            return;
+        if(collecting())
+            to_replicas(Message::CommitCertificate(Message::PrePrepare(msg), _commit_voters, _commit_votes));
+        decided(msg, _commit_voters, _commit_votes);
+    }
+
+    // Certificates come from the instance's collector only, with the votes of a quorum
+    void process(uintptr_t sender, Message::PrepareCertificate &&msg) {
+        if(_changing || sender != collector_id(msg.view, msg.req_id) || !verify_message(msg) || !certified(Phase::Prepare, msg))
+            return;
+        if(early(msg.view, msg.req_id, State::Type::PrePrepare)) {
+            postpone(sender, std::move(msg));
+        } else if(_state.certify_prepare(msg.view, msg.req_id) && _state.commit(msg.view, msg.req_id, voter_index(id()))) {
+            _prepare_voters = msg.voters;
+            _prepare_votes = msg.votes;
+            _prepared.reset(new Message::Certificate(msg));
+            auto c = commit(Message::PrePrepare(msg));
+            collect(Phase::Commit, id(), c.vote);
+            send_to(sender, std::move(c));
+        }
+    }
+
+    void process(uintptr_t sender, Message::CommitCertificate &&msg) {
+        if(_changing || sender != collector_id(msg.view, msg.req_id) || !verify_message(msg) || !certified(Phase::Commit, msg))
+            return;
+        if(early(msg.view, msg.req_id, State::Type::Prepared)) {
+            postpone(sender, std::move(msg));
+        } else if(_state.certify_commit(msg.view, msg.req_id)) {
+            _commit_voters = msg.voters;
+            _commit_votes = msg.votes;
+            decided(msg, msg.voters, msg.votes);
+        }
+    }
+
+    // Committed requests are logged with their certificates for replicas catching up
+    void decided(Message::PrePrepare const &msg, uint64_t voters, Signature votes) {
+        constexpr size_t limit = 1024;
+        Message::Decision d(Message::PrePrepare(msg), voters, votes);
+        if(_log.size() == limit)
+            _log.pop_front();
+        _log.push_back(d);
+        _known_committed = std::max(_known_committed, msg.req_id);
+        if(!_learners.empty())
+            multicast(_learners, std::move(d));
+        success(msg.client, msg.msg);
+    }
+
+    // Catch-up of replicas and learners: decisions from the log, a batch at a time
+    void process(uintptr_t sender, Message::Fetch &&msg) {
+        constexpr uint32_t batch = 64;
+        auto const learner = std::find(_learners.begin(), _learners.end(), sender) != _learners.end();
+        if((voter_bit(sender) == 0 && !learner) || _log.empty() || msg.from < _log.front().req_id)
+            return;
+        for(auto i = msg.from - _log.front().req_id; i < _log.size() && _log[i].req_id < msg.from + batch; ++i)
+            send_to(sender, Message::Decision(_log[i]));
+    }
+
+    // Decision of a request this node has missed, applied in order
+    void process(uintptr_t sender, Message::Decision &&msg) {
+        constexpr size_t limit = 1024;
+        if(_speculative || voter_bit(sender) == 0 || msg.req_id <= _state.committed() || _fetched.size() == limit)
+            return;
+        if(!verify_message(msg) || !certified(Phase::Commit, msg) || !payloads().has(msg.msg))
+            return;
+        _known_committed = std::max(_known_committed, msg.req_id);
+        _fetched.emplace(msg.req_id, std::move(msg));
+        while(!_fetched.empty() && _fetched.begin()->first <= _state.committed() + 1) {
+            auto d = std::move(_fetched.begin()->second);
+            _fetched.erase(_fetched.begin());
+            if(_state.catch_up(d.req_id))
+                decided(d, d.voters, d.votes);
+        }
+    }
+
+    void fetch(uintptr_t replica) {
+        if(replica != id())
+            send_to(replica, Message::Fetch{_state.committed() + 1});
+    }
+
+    // Nothing moved for a quarter of the timeout while there's work: own messages of the
+    // instance in flight or of the view change may be lost, they go again, and the next
+    // replica in turn is asked for decisions this one may have missed. The wait doubles
+    // till the node moves, so slow links aren't flooded.
+    void check_stall() {
+        if(!view_change_enabled() || _speculative)
+            return;
+        auto const idle = !_changing && _requests.empty() && _state.committed() >= _known_committed &&
+            (_state.state() == State::Type::Init || _state.state() == State::Type::Committed);
+        if(idle || position() != _last_position) {
+            _last_position = position();
+            _moved = _now;
+            _stalls = 0;
+            return;
+        }
+        if(_now < _moved + (std::max<uint64_t>(_timeout / 4, 1) << std::min(_stalls, 16u)))
+            return;
+        _moved = _now;
+        ++_stalls;
+        resend();
+        _fetch_turn = (_fetch_turn + 1) % _replicas.size();
+        fetch(_replicas[_fetch_turn]);
+    }
+
+    void resend() {
+        if(_changing) {
+            if(_own_view_change != nullptr)
+                to_replicas(Message::ViewChange(*_own_view_change));
+            return;
+        }
+        auto const s = _state.state();
+        if(_proposal == nullptr || _proposal->view != _view || _proposal->req_id != _state.req_id() ||
+           s == State::Type::Init || s == State::Type::Committed)
+            return;
+        auto const collector = collector_id(_view, _proposal->req_id);
+        if(_role == Role::Primary)
+            to_replicas(Message::PrePrepare(*_proposal));
+        else if(!collecting())
+            to_replicas(prepare(Message::PrePrepare(*_proposal)));
+        else if(collector != id())
+            send_to(collector, prepare(Message::PrePrepare(*_proposal)));
+        if(s != State::Type::Commit)
+            return;
+        if(!collecting())
+            to_replicas(commit(Message::PrePrepare(*_proposal)));
+        else if(collector != id())
+            send_to(collector, commit(Message::PrePrepare(*_proposal)));
+        else
+            to_replicas(Message::PrepareCertificate(Message::PrePrepare(*_proposal), _prepare_voters, _prepare_votes));
+    }
+
+    // History of the view, speculative answers carry it: the client is done with 3f+1 matching
+    static Digest chain(Digest history, Message::PrePrepare const &msg) {
+        return (history ^ digest(msg.msg)) * 0x100000001b3 + msg.req_id;
+    }
+
+    // Executes the accepted speculative request, the history is kept for the client's
+    // certificate a while
+    void speculated(Message::PrePrepare const &msg) {
+        constexpr size_t limit = 1024;
+        _history = msg.history;
+        _histories[msg.req_id] = _history;
+        if(_histories.size() > limit)
+            _histories.erase(_histories.begin());
+        success(msg.client, msg.msg);
     }
 
-    void process(uintptr_t sender[[gnu::unused]], Message::Commit &&msg) {
-        if(!verify_message(msg))
+    // 2f+1 matching answers the client got by its timeout, confirmed by replicas with the same
+    // history: any view change quorum then has one which executed the request
+    void process(uintptr_t sender, Message::SpecCommit &&msg) {
+        auto it = _histories.find(msg.req_id);
+        if(!_speculative || voters(msg.voters) < _state.f() * 2 + 1 || it == _histories.end() || it->second != msg.history)
             return;
-        if(_state.commit(msg.view, msg.req_id) && _state.state() == State::Type::Committed)
-            success(msg.client, msg.msg);
+        send_to(sender, Message::LocalCommit{msg.timestamp, msg.view, msg.req_id, msg.history});
     }
 
     void success(uintptr_t client, Message::OpRequestMessage const &msg) {
-        if(_success_strategy == nullptr)
+        payloads().keep(msg);
+        forget_request(client, msg);
+        _last_commit_view = _view;
+        _attempts = 0;
+        restart_timer();
+        if(_success_strategy == nullptr && _merger == nullptr)
             return;
-        auto answer = _success_strategy->accept(msg);
-        auto sig = signature(digest(answer), id());
-        send_to(client, Message::Response{std::move(answer), sig});
+        // The same request ordered twice, e.g. re-proposed after a view change, runs once
+        switch(_replies.check(client, msg.timestamp())) {
+        case ReplyCache::Status::New:
+            break;
+        case ReplyCache::Status::Answered:
+            send_to(client, Message::Response(_replies.response(client)));
+            if(_merger != nullptr)
+                _merger->committed(_lane, _state.req_id(), 0, msg);
+            return;
+        case ReplyCache::Status::Stale:
+            if(_merger != nullptr)
+                _merger->committed(_lane, _state.req_id(), 0, msg);
+            return;
+        }
+        _replies.commit(client, msg.timestamp());
+        ++_executed;
+        if(_merger != nullptr) {
+            _merger->committed(_lane, _state.req_id(), client, msg);
+            return;
+        }
+        _run_clients.push_back(client);
+        _run.push_back(msg);
+        if(_speculative)
+            _run_histories.emplace_back(_state.req_id(), _history);
+    }
+
+    // Requests committed within the tick are executed together, so the strategy may run
+    // non-conflicting ones in parallel
+    void execute() {
+        PBFT_PROFILE_SCOPE("execute");
+        if(_stage != nullptr) {
+            size_t pushed = 0;
+            while(pushed < _run.size() && _stage->push(Job(_run_clients[pushed], _run[pushed])))
+                ++pushed;
+            _run.erase(_run.begin(), _run.begin() + pushed);
+            _run_clients.erase(_run_clients.begin(), _run_clients.begin() + pushed);
+            _stage->drain([this](Completion &&c) {
+                _replies.answer(c.first, c.second);
+                send_to(c.first, std::move(c.second));
+            });
+            return;
+        }
+        if(_run.empty())
+            return;
+        std::vector<Message::OpResponseMessage> answers;
+        answers.reserve(_run.size());
+        {
+            PBFT_PROFILE_SCOPE("accept");
+            _success_strategy->accept_run(_run, answers);
+        }
+        assert(answers.size() == _run.size());
+        for(size_t i = 0; i < answers.size(); ++i) {
+            if(_speculative)
+                respond(_run_clients[i], std::move(answers[i]), _run[i].timestamp(), _run_histories[i].first, _run_histories[i].second);
+            else
+                respond(_run_clients[i], std::move(answers[i]), _run[i].timestamp());
+        }
+        _run.clear();
+        _run_clients.clear();
+        _run_histories.clear();
+    }
+
+    void forget_request(uintptr_t client, Message::OpRequestMessage const &msg) {
+        auto d = digest(msg);
+        for(auto it = _requests.begin(); it != _requests.end(); ++it) {
+            if(it->first == client && digest(it->second) == d) {
+                _requests.erase(it);
+                return;
+            }
+        }
+    }
+
+
+    // Request timer runs on replicas while there are requests waiting to be committed,
+    // view change timer runs while the view change isn't finished
+    void restart_timer() {
+        _deadline = _now + (_timeout << std::min(_attempts, 16u));
+    }
+
+    void check_timer() {
+        if(!view_change_enabled())
+            return;
+        if(_deferred_view != 0 && clock() >= _promised) {
+            start_view_change(_deferred_view);
+            return;
+        }
+        if(!_changing && (_role == Role::Primary || _requests.empty())) {
+            _deadline = 0;
+            return;
+        }
+        if(_deadline == 0)
+            restart_timer();
+        else if(_now >= _deadline)
+            start_view_change(_changing ? _target_view + 1 : _view + 1);
+    }
+
+    void start_view_change(uint32_t view) {
+        if(clock() < _promised) {
+            _deferred_view = std::max(_deferred_view, view); // the leased primary can't be replaced yet
+            return;
+        }
+        _deferred_view = 0;
+        if(_changing)
+            ++_attempts;
+        _changing = true;
+        _target_view = view;
+        restart_timer();
+        auto vc = view_change(view);
+        _own_view_change.reset(new Message::ViewChange(vc));
+        _view_changes[view].emplace(id(), vc);
+        to_replicas(std::move(vc));
+        try_new_view(view);
+    }
+
+    // Proves the last commit and the proposal prepared after it, if any. Made once per
+    // view, so every replica checks the NewView against the same one.
+    Message::ViewChange view_change(uint32_t view) {
+        auto const committed = _state.committed();
+        Message::Proof last{0, committed, 0, 0, 0};
+        if(!_log.empty() && _log.back().req_id == committed) {
+            auto const &d = _log.back();
+            last = Message::Proof{d.view, d.req_id, request_digest(d), d.voters, d.votes};
+        }
+        auto const prepared = _prepared != nullptr && _prepared->req_id == committed + 1;
+        auto const placeholder = Message::Certificate(Message::PrePrepare{Message::ReadOpRequest{0}, 0, 0, 0, 0}, 0, 0);
+        Message::ViewChange vc{view, static_cast<uint32_t>(voter_index(id())), last, prepared, prepared ? *_prepared : placeholder,
+                               _heavy != 0 && _adaptive ? pick_heavy() : 0, 0};
+        vc.sig = signature(view_change_digest(vc), id());
+        return vc;
+    }
+
+    static Digest view_change_digest(Message::ViewChange const &m) {
+        Digest d = 0xcbf29ce484222325;
+        for(Digest x : {Digest(m.view), Digest(m.replica), Digest(m.committed.view), Digest(m.committed.req_id),
+                        m.committed.request, m.committed.voters, m.committed.votes, Digest(m.prepared), m.heavy})
+            d = (d ^ x) * 0x100000001b3;
+        if(m.prepared)
+            for(Digest x : {request_digest(m.proposal), Digest(m.proposal.view), Digest(m.proposal.req_id),
+                            m.proposal.voters, m.proposal.votes, m.proposal.sig})
+                d = (d ^ x) * 0x100000001b3;
+        return d;
+    }
+
+    // Signed by the replica, with proofs which check. Speculative replicas commit without
+    // certificates, their ViewChange-s have none.
+    bool valid(Message::ViewChange const &m) const {
+        if(m.replica >= _replicas.size() || !verify_signature(view_change_digest(m), m.sig, _replicas[m.replica]))
+            return false;
+        if(_speculative)
+            return true;
+        if(m.committed.req_id != 0 && !certified(m.committed))
+            return false;
+        return !m.prepared || (m.proposal.req_id == m.committed.req_id + 1 && verify_message(m.proposal) &&
+                               certified(Phase::Prepare, m.proposal));
+    }
+
+    void process(uintptr_t sender, Message::ViewChange &&msg) {
+        if(!view_change_enabled())
+            return;
+        if(msg.view <= _view) {
+            // A while after the view started it's from a replica which missed NewView, the
+            // primary passes it on with the ViewChange-s
+            auto const own = msg.replica < _replicas.size() && _replicas[msg.replica] == sender;
+            if(_new_view != nullptr && _new_view->view == _view && !_changing && own && _now >= _entered + std::max<uint64_t>(_timeout / 4, 1)) {
+                send_to(sender, Message::NewView(*_new_view));
+                for(auto const &vc : _new_view_proof)
+                    send_to(sender, Message::ViewChange(vc));
+            }
+            return;
+        }
+        if(!valid(msg))
+            return;
+        auto const view = msg.view;
+        auto &votes = _view_changes[view];
+        votes.emplace(_replicas[msg.replica], std::move(msg));
+        if(_pending_new_view != nullptr && _pending_new_view->view == view) {
+            auto nv = std::move(*_pending_new_view);
+            _pending_new_view.reset();
+            process(primary_id(view), std::move(nv));
+            if(_view >= view)
+                return;
+        }
+        // f+1 replicas can't be all faulty, follow them
+        if((!_changing || _target_view < view) && senders_weight(votes) > faulty())
+            start_view_change(view);
+        else
+            try_new_view(view);
+    }
+
+    // ViewChange-s of the view by `senders`, in the order of replicas
+    std::vector<Message::ViewChange const *> view_changes(uint32_t view, uint64_t senders) {
+        std::vector<Message::ViewChange const *> r;
+        auto const &votes = _view_changes[view];
+        for(size_t i = 0; i < _replicas.size(); ++i) {
+            auto it = votes.find(_replicas[i]);
+            if((senders >> i & 1) != 0 && it != votes.end())
+                r.push_back(&it->second);
+        }
+        return r;
+    }
+
+    // What the view continues with by the ViewChange-s of `senders`: the highest proven
+    // commit, the proposal prepared right after it in the latest view, the heavy replicas
+    struct Choice {
+        uint32_t committed = 0;
+        uintptr_t ahead = 0; // a replica which has it
+        Message::Certificate const *prepared = nullptr;
+        uint64_t heavy = 0;
+    };
+
+    Choice choose(uint32_t view, uint64_t senders) {
+        Choice c;
+        auto const votes = view_changes(view, senders);
+        for(auto vc : votes) {
+            if(c.ahead == 0 || vc->committed.req_id > c.committed) {
+                c.committed = vc->committed.req_id;
+                c.ahead = _replicas[vc->replica];
+            }
+        }
+        for(auto vc : votes)
+            if(vc->prepared && vc->proposal.req_id == c.committed + 1 && (c.prepared == nullptr || c.prepared->view < vc->proposal.view))
+                c.prepared = &vc->proposal;
+        c.heavy = choose_heavy(view, votes);
+        return c;
     }
 
-    uint32_t req_id() const {
-        static uint32_t id = 0;
-        return ++id;
+    // With adaptive weights: the new primary and the 2f-1 other senders picked by the most
+    // ViewChange-s, ties go to the lower position. Silent replicas never get in.
+    uint64_t choose_heavy(uint32_t view, std::vector<Message::ViewChange const *> const &votes) const {
+        if(_heavy == 0 || !_adaptive)
+            return _heavy;
+        auto const primary = view % _replicas.size();
+        std::vector<int> picks(_replicas.size(), -1);
+        for(auto vc : votes)
+            picks[vc->replica] = 0;
+        for(auto vc : votes)
+            for(size_t i = 0; i < picks.size(); ++i)
+                if((vc->heavy >> i & 1) != 0 && picks[i] >= 0)
+                    ++picks[i];
+        std::vector<size_t> order;
+        for(size_t i = 0; i < picks.size(); ++i)
+            if(i != primary && picks[i] >= 0)
+                order.push_back(i);
+        std::stable_sort(order.begin(), order.end(), [&picks](size_t a, size_t b) { return picks[a] > picks[b]; });
+        uint64_t heavy = uint64_t(1) << primary;
+        for(size_t i = 0; i < order.size() && i + 1 < static_cast<size_t>(2 * _state.f()); ++i)
+            heavy |= uint64_t(1) << order[i];
+        return heavy;
+    }
+
+    void try_new_view(uint32_t view) {
+        auto const &votes = _view_changes[view];
+        if(primary_id(view) != id() || !_changing || _target_view != view ||
+           senders_weight(votes) < quorum())
+            return;
+        uint64_t senders = 0;
+        for(auto const &v : votes)
+            senders |= voter_bit(v.first);
+        auto const c = choose(view, senders);
+        auto proposal = Message::PrePrepare{Message::ReadOpRequest{0}, 0, 0, 0, 0};
+        if(c.prepared != nullptr) {
+            auto request = c.prepared->msg;
+            proposal = prepreare(c.prepared->client, std::move(request), c.committed + 1);
+            proposal.view = view;
+        }
+        Message::NewView nv{view, c.committed, c.prepared != nullptr, proposal, senders, c.heavy};
+        _new_view.reset(new Message::NewView(nv));
+        _new_view_proof.clear();
+        for(auto vc : view_changes(view, senders))
+            _new_view_proof.push_back(*vc);
+        to_replicas(Message::NewView(nv));
+        enter_view(std::move(nv), c.ahead);
+    }
+
+    // Replica takes NewView only as the primary made it of the ViewChange-s it names,
+    // it waits for the ones it hasn't got yet
+    void process(uintptr_t sender, Message::NewView &&msg) {
+        if(!view_change_enabled() || msg.view <= _view || sender != primary_id(msg.view))
+            return;
+        uint64_t have = 0;
+        for(auto const &v : _view_changes[msg.view])
+            have |= voter_bit(v.first);
+        if((msg.senders & ~have) != 0) {
+            _pending_new_view.reset(new Message::NewView(std::move(msg)));
+            return;
+        }
+        auto const c = choose(msg.view, msg.senders);
+        if(bitmap_weight(msg.senders) < quorum() || c.committed != msg.committed || (c.prepared != nullptr) != msg.prepared ||
+           c.heavy != msg.heavy)
+            return;
+        if(msg.prepared && (msg.proposal.view != msg.view || msg.proposal.req_id != c.committed + 1 || !verify_message(msg.proposal) ||
+                            msg.proposal.client != c.prepared->client || digest(msg.proposal.msg) != digest(c.prepared->msg)))
+            return;
+        enter_view(std::move(msg), c.ahead);
+    }
+
+    // The node keeps its own commits: if the view continues after more of them, it
+    // fetches the rest from `ahead`, the new primary proposes once it has them
+    void enter_view(Message::NewView &&msg, uintptr_t ahead) {
+        _view = msg.view;
+        _role = primary_id(_view) == id() ? Role::Primary : Role::Replica;
+        _changing = false;
+        if(_heavy != 0)
+            _heavy = msg.heavy;
+        apply_weights();
+        auto const own = _state.committed();
+        _state.new_view(_view, _speculative ? msg.committed : own);
+        _known_committed = std::max(_known_committed, msg.committed);
+        _proposal.reset();
+        _reproposal.reset();
+        _pending_new_view.reset();
+        _early.clear();
+        _view_changes.erase(_view_changes.begin(), _view_changes.upper_bound(_view));
+        _history = (static_cast<Digest>(_view) << 32) + msg.committed + 1;
+        _deadline = 0;
+        _deferred_view = 0;
+        _entered = _now;
+        _lease_until = _lease_asked = 0;
+        _lease_grants.clear();
+        _requests.splice(_requests.end(), _lease_reads_waiting);
+        for(auto &r : _unwatched)
+            _requests.emplace_back(std::get<1>(r), std::move(std::get<2>(r)));
+        _unwatched.clear();
+        if(!_speculative && own < msg.committed)
+            fetch(ahead);
+        if(!msg.prepared)
+            return;
+        forget_request(msg.proposal.client, msg.proposal.msg);
+        if(_role == Role::Primary) {
+            if(_state.preprepare(msg.proposal.view, msg.proposal.req_id))
+                start_instance(msg.proposal);
+            else
+                _reproposal.reset(new Message::PrePrepare(msg.proposal));
+        } else {
+            process(id(), std::move(msg.proposal));
+        }
+    }
+
+    uint64_t clock() const { return _clock ? _clock() : _now; }
+
+    // Primary asks for the lease again halfway through the current one, it holds the lease
+    // till stamp + duration with 2f echoes of the stamp: before any of them may leave the view
+    void renew_lease() {
+        if(_lease_duration == 0 || _role != Role::Primary || _changing)
+            return;
+        auto const now = clock();
+        if(_lease_asked != 0 && now < _lease_asked + _lease_duration / 2)
+            return;
+        _lease_asked = now;
+        _lease_grants.erase(_lease_grants.begin(), _lease_grants.lower_bound(now > _lease_duration ? now - _lease_duration : 0));
+        to_replicas(Message::Lease{_view, now});
+    }
+
+    void process(uintptr_t sender, Message::Lease &&msg) {
+        if(_lease_duration == 0 || _changing || msg.view != _view)
+            return;
+        if(_role == Role::Primary) {
+            // Echoes of replicas to the stamp asked last only
+            if(voter_bit(sender) == 0 || sender == id() || msg.stamp != _lease_asked || msg.stamp + _lease_duration <= _lease_until)
+                return;
+            auto &grants = _lease_grants[msg.stamp];
+            grants.insert(sender);
+            if(grants.size() < static_cast<size_t>(_state.f() * 2))
+                return;
+            _lease_until = msg.stamp + _lease_duration;
+            _lease_grants.erase(_lease_grants.begin(), _lease_grants.upper_bound(msg.stamp));
+            return;
+        }
+        // The echo promises no view change for the duration, plus 1/8 for the clock drift;
+        // a replica wanting one doesn't promise
+        if(sender != primary_id(_view) || _deferred_view != 0)
+            return;
+        _promised = std::max(_promised, clock() + _lease_duration + _lease_duration / 8);
+        send_to(sender, std::move(msg));
     }
 
     State _state;
+    std::map<uintptr_t, size_t> _voter_index; // of nodes not in the list of replicas
     Role _role = Role::Replica;
     uint32_t _view = 0;
     std::weak_ptr<Node> _primary;
+    std::vector<uintptr_t> _replicas;
     SuccessStrategyPtr _success_strategy;
+    std::vector<Message::OpRequestMessage> _run; // committed, not executed yet
+    std::vector<uintptr_t> _run_clients;
+    std::vector<std::pair<uint32_t, Digest>> _run_histories; // req_id and history, speculative
+    std::unique_ptr<Stage> _stage; // destroyed first, it uses the strategy
+    Merger *_merger = nullptr;
+    size_t _lane = 0;
+    std::vector<uintptr_t> _learners;
+    ReplyCache _replies;
+    size_t _admission = 0;
+    uint64_t _rejected = 0;
+    std::deque<std::pair<uintptr_t, uint64_t>> _busy; // requests rejected by the primary
+    std::list<std::pair<uintptr_t, Message::OpRequestMessage>> _requests; // client requests waiting to be ordered
+    std::unique_ptr<Message::PrePrepare> _proposal; // of the instance in flight
+    std::unique_ptr<Message::Certificate> _prepared; // the last proposal prepared, kept across views
+    std::unique_ptr<Message::PrePrepare> _reproposal; // of NewView, while the primary catches up
+    std::deque<Message::Decision> _log;              // the last committed requests, for catch-up
+    std::map<uint32_t, Message::Decision> _fetched;  // by req_id, wait for the ones before
+    uint32_t _known_committed = 0;                   // the highest req_id proven committed
+    size_t _fetch_turn = 0;
+    std::tuple<uint32_t, uint32_t, State::Type> _last_position;
+    uint64_t _moved = 0; // tick of the last move of the position or resend, see check_stall
+    unsigned _stalls = 0; // resends in a row
+    std::list<std::pair<uintptr_t, Message>> _early; // see `early()`
+    Intake _intake;
+    std::array<std::deque<std::tuple<uint64_t, uintptr_t, Message>>, Lanes> _lanes; // arrival tick, sender, message
+    Lane _turn = Agreement;
+    size_t _served = 0; // in the lane's turn
+    uint64_t _aged = 0;
+    Communication _communication = Communication::AllToAll;
+    unsigned _fanout = 0;
+    uint64_t _tree_timeout = 0;
+    uint64_t _disseminated = 0; // tick when the primary sent the proposal in flight
+    bool _fallen_back = false;
+    uint64_t _prepare_voters = 0, _commit_voters = 0; // of the instance in flight
+    Signature _prepare_votes = 0, _commit_votes = 0;  // their aggregates
+    bool _speculative = false;
+    uint64_t _heavy = 0; // weighted voting
+    bool _adaptive = true;
+    Weights _weights;
+    std::vector<double> _vote_delay; // by position, -1 if no vote came yet
+    uint64_t _instance_start = 0;    // tick
+    Digest _history = 1;                  // after the last request executed speculatively
+    std::map<uint32_t, Digest> _histories; // by req_id, the last ones
+
+    uint64_t _now = 0; // in ticks
+    uint64_t _executed = 0;
+    uint32_t _last_commit_view = 0;
+    uint64_t _timeout = 50;
+    uint64_t _deadline = 0; // of the running timer, 0 if it's stopped
+    unsigned _attempts = 0; // failed view changes in a row
+    bool _changing = false;
+    uint32_t _target_view = 0;
+    std::map<uint32_t, std::map<uintptr_t, Message::ViewChange>> _view_changes; // by view and signer
+    std::unique_ptr<Message::ViewChange> _own_view_change; // of the view change in progress, resent
+    std::unique_ptr<Message::NewView> _new_view;           // primary: of its view, for replicas which missed it
+    std::vector<Message::ViewChange> _new_view_proof;      // and the ViewChange-s it's made of
+    std::unique_ptr<Message::NewView> _pending_new_view;   // replica: waits for ViewChange-s it names
+    uint64_t _entered = 0; // tick
+    uint32_t _deferred_view = 0; // view change waiting for the promised lease to expire
+
+    uint64_t _lease_duration = 0;
+    Clock _clock;
+    uint64_t _lease_until = 0;   // primary holds the lease till then
+    uint64_t _lease_asked = 0;   // stamp of the last Lease multicast
+    std::map<uint64_t, std::set<uintptr_t>> _lease_grants; // by stamp
+    uint64_t _promised = 0;      // replica doesn't change view till then
+    uint64_t _lease_reads = 0;
+    std::list<std::pair<uintptr_t, Message::OpRequestMessage>> _lease_reads_waiting; // at the primary
+    std::deque<std::tuple<uint64_t, uintptr_t, Message::OpRequestMessage>> _unwatched; // at replicas, by arrival
 };
@@ -0,0 +1,450 @@
+#include "simulator.h"
+#include "sharding.h"
+#include "runtime.h"
+#include "sweep.h"
+#include <iomanip>
+#include <chrono>
+
+// Scenarios measured in simulator ticks. Every scenario prints a small table.
+
+// Ticks from the primary's death to the first commit in a new view, for several
+// request timeouts and link latencies. Closed-loop clients keep the cluster busy.
+void failover_bench() {
+    std::cout << "failover: primary destroyed at tick 200" << std::endl;
+    std::cout << std::setw(10) << "latency" << std::setw(10) << "timeout" << std::setw(10) << "failover"
+              << std::setw(10) << "p99" << std::setw(10) << "max" << std::endl;
+    for(uint32_t latency : {0, 5, 20}) {
+        for(uint64_t timeout : {10, 20, 50, 100}) {
+            if(timeout < latency * 4)
+                continue; // a single round doesn't fit, view changes never stop
+            WorkloadConfig c;
+            c.mode = Workload::Mode::Closed;
+            c.clients = 20;
+            c.ops = 1000;
+            c.think = 2;
+            WorkloadGenerator w(c);
+            NetworkConfig net;
+            net.default_profile.latency = latency;
+            Simulator sim(1, 0, c.clients);
+            sim.set_network(net);
+            sim.set_timeout(timeout);
+            sim.at(200, [&sim] { sim.destroy_node(0); });
+            auto stats = sim.run(w);
+            std::cout << std::setw(10) << latency << std::setw(10) << timeout << std::setw(10) << sim.failover()
+                      << std::setw(10) << stats.latency.percentile(0.99) << std::setw(10) << stats.latency.percentile(1.0)
+                      << std::endl;
+        }
+    }
+}
+
+// Messages per request and latency of all-to-all and collector-based agreement
+void communication_bench() {
+    std::cout << "communication: closed-loop, 8 clients, 200 requests" << std::endl;
+    std::cout << std::setw(6) << "n" << std::setw(10) << "mode" << std::setw(10) << "msgs/op"
+              << std::setw(10) << "mean" << std::setw(10) << "p99" << std::setw(10) << "ops/ktick" << std::endl;
+    std::pair<PBFTNode::Communication, char const *> modes[] = {
+        {PBFTNode::Communication::AllToAll, "all"},
+        {PBFTNode::Communication::Collector, "primary"},
+        {PBFTNode::Communication::RotatingCollector, "rotating"},
+    };
+    for(int n : {4, 16, 64}) {
+        for(auto const &mode : modes) {
+            WorkloadConfig c;
+            c.mode = Workload::Mode::Closed;
+            c.clients = 8;
+            c.ops = 200;
+            WorkloadGenerator w(c);
+            Simulator sim((n - 1) / 3, n, c.clients);
+            sim.set_communication(mode.first);
+            auto stats = sim.run(w);
+            std::cout << std::setw(6) << n << std::setw(10) << mode.second
+                      << std::setw(10) << sim.network_stats().sent / stats.completed
+                      << std::setw(10) << stats.latency.mean() << std::setw(10) << stats.latency.percentile(0.99)
+                      << std::setw(10) << stats.completed * 1000 / stats.ticks << std::endl;
+        }
+    }
+}
+
+// Primary egress per request with direct and tree dissemination of PrePrepare.
+// Rotating collector keeps the certificates off the primary.
+void dissemination_bench() {
+    std::cout << "dissemination: rotating collector, closed-loop, 8 clients, 200 requests" << std::endl;
+    std::cout << std::setw(6) << "n" << std::setw(10) << "fanout" << std::setw(14) << "primary msgs"
+              << std::setw(14) << "primary bytes" << std::setw(10) << "mean" << std::setw(10) << "p99" << std::endl;
+    for(int n : {4, 16, 64}) {
+        for(unsigned fanout : {0, 2, 4}) {
+            WorkloadConfig c;
+            c.mode = Workload::Mode::Closed;
+            c.clients = 8;
+            c.ops = 200;
+            WorkloadGenerator w(c);
+            Simulator sim((n - 1) / 3, n, c.clients);
+            sim.set_communication(PBFTNode::Communication::RotatingCollector);
+            sim.set_dissemination(fanout, 20);
+            auto stats = sim.run(w);
+            auto const &sent = sim.node(0)->sent();
+            std::cout << std::setw(6) << n << std::setw(10) << fanout
+                      << std::setw(14) << sent.messages / stats.completed << std::setw(14) << sent.bytes / stats.completed
+                      << std::setw(10) << stats.latency.mean() << std::setw(10) << stats.latency.percentile(0.99) << std::endl;
+        }
+    }
+}
+
+// Independent groups, one thread each, 500 closed-loop requests per group. Aggregate
+// throughput in simulated time scales by construction; wall clock scaling depends on
+// free cores.
+void sharding_bench() {
+    std::cout << "sharding: closed-loop, 8 clients and 500 requests per group, "
+              << std::thread::hardware_concurrency() << " cores" << std::endl;
+    std::cout << std::setw(6) << "groups" << std::setw(12) << "ops/ktick" << std::setw(12) << "ops/s"
+              << std::setw(10) << "mean" << std::setw(10) << "p99" << std::endl;
+    for(uint32_t groups : {1, 2, 4, 8}) {
+        WorkloadConfig c;
+        c.mode = Workload::Mode::Closed;
+        c.clients = 8 * groups;
+        c.ops = 500 * groups;
+        c.key_space = 100000;
+        WorkloadGenerator w(c);
+        ShardedCluster::Config sc;
+        sc.groups = groups;
+        sc.clients = 8;
+        auto r = ShardedCluster(sc).run(w);
+        LatencyStats latency;
+        for(auto const &g : r.groups)
+            latency.merge(g.latency);
+        std::cout << std::setw(6) << groups << std::setw(12) << r.completed * 1000 / r.ticks
+                  << std::setw(12) << static_cast<uint64_t>(r.completed / r.seconds)
+                  << std::setw(10) << latency.mean() << std::setw(10) << latency.percentile(0.99) << std::endl;
+    }
+}
+
+
+// Open-loop load against the primary's admission window: what's served, what's shed
+void overload_bench() {
+    std::cout << "overload: open-loop, 20 clients, 1000 requests" << std::endl;
+    std::cout << std::setw(6) << "rate" << std::setw(8) << "window" << std::setw(10) << "completed"
+              << std::setw(10) << "rejected" << std::setw(10) << "mean" << std::setw(10) << "p99" << std::endl;
+    for(double rate : {0.1, 0.3, 1.0}) {
+        for(size_t window : {0, 4, 16}) {
+            WorkloadConfig c;
+            c.clients = 20;
+            c.ops = 1000;
+            c.rate = rate;
+            WorkloadGenerator w(c);
+            Simulator sim(1, 0, c.clients);
+            sim.set_admission(window);
+            auto stats = sim.run(w);
+            std::cout << std::setw(6) << rate << std::setw(8) << window << std::setw(10) << stats.completed
+                      << std::setw(10) << stats.rejected << std::setw(10) << stats.latency.mean()
+                      << std::setw(10) << stats.latency.percentile(0.99) << std::endl;
+        }
+    }
+}
+
+// The tracker State had before: plain counter of votes, no idea who voted
+class CountingVotes {
+public:
+    explicit CountingVotes(int f) : _f(f) {}
+    int f() const { return _f; }
+    int quorum(Phase p) const { return p == Phase::Prepare ? 2 * _f : 2 * _f + 1; }
+    void clear() { _prepare = _commit = 0; }
+    bool vote(Phase p, size_t) { ++(p == Phase::Prepare ? _prepare : _commit); return true; }
+    int count(Phase p) const { return p == Phase::Prepare ? _prepare : _commit; }
+
+private:
+    int _f, _prepare = 0, _commit = 0;
+};
+
+// Full instance, preprepare to committed, on the state alone
+template<typename S>
+double instance_ns(int f) {
+    constexpr uint32_t instances = 2000000;
+    S state(f);
+    uint64_t committed = 0;
+    auto start = std::chrono::steady_clock::now();
+    for(uint32_t r = 1; r <= instances; ++r) {
+        state.preprepare(0, r);
+        for(int v = 1; v <= 2 * f; ++v)
+            state.prepare(0, r, static_cast<size_t>(v));
+        for(int v = 0; v <= 2 * f; ++v)
+            state.commit(0, r, static_cast<size_t>(v));
+        committed += state.committed();
+    }
+    auto ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+    if(committed != uint64_t(instances) * (instances + 1) / 2)
+        std::cout << "wrong result" << std::endl;
+    return ns / instances;
+}
+
+void quorum_bench() {
+    std::cout << "quorum tracking: ns per instance" << std::endl;
+    std::cout << std::setw(4) << "f" << std::setw(10) << "counter" << std::setw(10) << "bitmap"
+              << std::setw(10) << "fixed" << std::setw(8) << "bytes" << std::endl;
+    auto row = [](int f, double fixed, size_t bytes) {
+        std::cout << std::setw(4) << f << std::setw(10) << instance_ns<BasicState<CountingVotes>>(f)
+                  << std::setw(10) << instance_ns<State>(f) << std::setw(10) << fixed << std::setw(8) << bytes << std::endl;
+    };
+    row(1, instance_ns<BasicState<VoteTracker<1>>>(1), sizeof(BasicState<VoteTracker<1>>));
+    row(2, instance_ns<BasicState<VoteTracker<2>>>(2), sizeof(BasicState<VoteTracker<2>>));
+    row(3, instance_ns<BasicState<VoteTracker<3>>>(3), sizeof(BasicState<VoteTracker<3>>));
+}
+
+// Protocol logic on real threads, a thread per node, against the single-threaded
+// simulator running the same closed-loop workload; both in wall clock
+void runtime_bench() {
+    std::cout << "runtime: closed-loop, 2000 requests, " << std::thread::hardware_concurrency() << " cores" << std::endl;
+    std::cout << std::setw(8) << "clients" << std::setw(8) << "window" << std::setw(12) << "sim ops/s"
+              << std::setw(12) << "rt ops/s" << std::setw(12) << "msgs/wake" << std::endl;
+    for(uint32_t clients : {1, 4, 16}) {
+        for(size_t window : {1, 4}) {
+            WorkloadConfig c;
+            c.mode = Workload::Mode::Closed;
+            c.clients = clients;
+            c.ops = 2000;
+            WorkloadGenerator w(c), w2(c);
+            Simulator sim(1, 0, clients);
+            auto start = std::chrono::steady_clock::now();
+            auto stats = sim.run(w);
+            auto seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            RuntimeCluster::Config rc;
+            rc.clients = clients;
+            rc.window = window;
+            auto r = RuntimeCluster(rc).run(w2);
+            std::cout << std::setw(8) << clients << std::setw(8) << window
+                      << std::setw(12) << static_cast<uint64_t>(stats.completed / seconds)
+                      << std::setw(12) << static_cast<uint64_t>(r.completed / r.seconds)
+                      << std::setw(12) << r.runtime.delivered / std::max<uint64_t>(r.runtime.wakeups, 1) << std::endl;
+        }
+    }
+}
+
+// Throughput with one primary and with the sequence space split across leaders
+void leaders_bench() {
+    std::cout << "leaders: closed-loop, 32 clients, 2000 requests" << std::endl;
+    std::cout << std::setw(6) << "n" << std::setw(9) << "leaders" << std::setw(12) << "ops/ktick"
+              << std::setw(10) << "mean" << std::setw(10) << "p99" << std::setw(16) << "replica0 msgs" << std::endl;
+    for(int n : {4, 7, 16}) {
+        for(int leaders : {1, (n + 1) / 2, n}) {
+            WorkloadConfig c;
+            c.mode = Workload::Mode::Closed;
+            c.clients = 32;
+            c.ops = 2000;
+            WorkloadGenerator w(c);
+            Simulator sim((n - 1) / 3, n, c.clients, leaders);
+            auto stats = sim.run(w);
+            uint64_t sent = 0;
+            for(int l = 0; l < leaders; ++l)
+                sent += sim.node(0, static_cast<size_t>(l))->sent().messages;
+            std::cout << std::setw(6) << n << std::setw(9) << leaders << std::setw(12) << stats.completed * 1000 / stats.ticks
+                      << std::setw(10) << stats.latency.mean() << std::setw(10) << stats.latency.percentile(0.99)
+                      << std::setw(16) << sent / stats.completed << std::endl;
+        }
+    }
+}
+
+// Throughput by write payload size. Links carry 4 KB per tick, payload bytes take the
+// bandwidth, while wall clock shows what it costs to move them around in the process
+void payload_bench() {
+    std::cout << "payload: closed-loop writes, 16 clients, 1000 requests, links 4 KB/tick" << std::endl;
+    std::cout << std::setw(8) << "bytes" << std::setw(12) << "ops/ktick" << std::setw(12) << "KB/ktick"
+              << std::setw(10) << "mean" << std::setw(12) << "wire/op" << std::setw(12) << "ops/s" << std::endl;
+    for(uint32_t size : {0, 256, 1024, 4096, 16384}) {
+        WorkloadConfig c;
+        c.mode = Workload::Mode::Closed;
+        c.clients = 16;
+        c.ops = 1000;
+        c.read_ratio = 0;
+        c.payload = size;
+        WorkloadGenerator w(c);
+        NetworkConfig net;
+        net.default_profile.bandwidth = 4 * 1024;
+        Simulator sim(1, 0, c.clients);
+        sim.set_network(net);
+        auto start = std::chrono::steady_clock::now();
+        auto stats = sim.run(w);
+        auto seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        std::cout << std::setw(8) << size << std::setw(12) << stats.completed * 1000 / stats.ticks
+                  << std::setw(12) << stats.completed * size / stats.ticks
+                  << std::setw(10) << stats.latency.mean() << std::setw(12) << sim.network_stats().bytes / stats.completed
+                  << std::setw(12) << static_cast<uint64_t>(stats.completed / seconds) << std::endl;
+    }
+}
+
+// Three-phase agreement against speculative execution, healthy and with the last
+// replica destroyed at tick 100, when speculative clients fall back to certificates
+void speculative_bench() {
+    std::cout << "speculative: closed-loop, 8 clients, 1000 requests, client timeout 10" << std::endl;
+    std::cout << std::setw(6) << "n" << std::setw(8) << "mode" << std::setw(10) << "replica" << std::setw(12) << "ops/ktick"
+              << std::setw(10) << "mean" << std::setw(10) << "p99" << std::setw(10) << "msgs/op" << std::setw(12) << "certified" << std::endl;
+    for(int n : {4, 7}) {
+        for(bool speculative : {false, true}) {
+            for(bool dead : {false, true}) {
+                WorkloadConfig c;
+                c.mode = Workload::Mode::Closed;
+                c.clients = 8;
+                c.ops = 1000;
+                WorkloadGenerator w(c);
+                Simulator sim((n - 1) / 3, n, c.clients);
+                if(speculative)
+                    sim.set_speculative(10);
+                if(dead)
+                    sim.at(100, [&sim, n] { sim.destroy_node(static_cast<size_t>(n - 1)); });
+                auto stats = sim.run(w);
+                std::cout << std::setw(6) << n << std::setw(8) << (speculative ? "spec" : "pbft") << std::setw(10) << (dead ? "dead" : "alive")
+                          << std::setw(12) << stats.completed * 1000 / stats.ticks << std::setw(10) << stats.latency.mean()
+                          << std::setw(10) << stats.latency.percentile(0.99) << std::setw(10) << sim.network_stats().sent / stats.completed
+                          << std::setw(12) << sim.certified() << std::endl;
+            }
+        }
+    }
+}
+
+// Bursts of client requests against a replica handling a few messages a tick: the
+// inbox in arrival order against the intake lanes, see PBFTNode
+void intake_bench() {
+    std::cout << "intake: bursty open-loop, 20 clients, 1000 requests, 10 of 200 ticks on" << std::endl;
+    std::cout << std::setw(6) << "rate" << std::setw(8) << "budget" << std::setw(8) << "order" << std::setw(10) << "ticks"
+              << std::setw(10) << "mean" << std::setw(10) << "p99" << std::setw(8) << "aged" << std::endl;
+    for(double rate : {2.0, 4.0}) {
+        for(size_t budget : {0, 2, 3}) {
+            for(bool lanes : {false, true}) {
+                if(budget == 0 && lanes)
+                    continue;
+                WorkloadConfig c;
+                c.clients = 20;
+                c.ops = 1000;
+                c.rate = rate;
+                c.arrival = WorkloadConfig::Arrival::Bursty;
+                c.burst_off = 190;
+                WorkloadGenerator w(c);
+                Simulator sim(1, 0, c.clients);
+                PBFTNode::Intake intake;
+                intake.budget = budget;
+                intake.lanes = lanes;
+                sim.set_intake(intake);
+                auto stats = sim.run(w);
+                uint64_t aged = 0;
+                for(size_t i = 0; i < 4; ++i)
+                    aged += sim.node(i)->aged();
+                std::cout << std::setw(6) << rate << std::setw(8) << budget << std::setw(8) << (lanes ? "lanes" : "fifo")
+                          << std::setw(10) << stats.ticks << std::setw(10) << stats.latency.mean()
+                          << std::setw(10) << stats.latency.percentile(0.99) << std::setw(8) << aged << std::endl;
+            }
+        }
+    }
+}
+
+// One sweep of failures and latencies after a long warmup: every configuration run from
+// tick 0, against one warmup forked for every configuration
+void sweep_bench() {
+    WorkloadConfig c;
+    c.clients = 20;
+    c.ops = 4000;
+    c.rate = 0.1;
+    constexpr uint64_t warmup = 36000;
+    std::vector<std::pair<std::string, std::function<void(Simulator &)>>> configs = {
+        {"baseline", [](Simulator &) {}},
+        {"replica", [](Simulator &sim) { sim.destroy_node(3); }},
+        {"primary", [](Simulator &sim) { sim.destroy_node(0); }},
+        {"latency 1", [](Simulator &sim) { NetworkConfig net; net.default_profile.latency = 1; sim.set_network(net); }},
+        {"latency 2", [](Simulator &sim) { NetworkConfig net; net.default_profile.latency = 2; sim.set_network(net); }},
+    };
+    auto row = [](WorkloadStats const &s) {
+        std::ostringstream os;
+        os << std::setw(10) << s.completed << std::setw(10) << s.latency.mean() << std::setw(10) << s.latency.percentile(0.99);
+        return os.str();
+    };
+
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::string> scratch;
+    for(auto const &cfg : configs) {
+        WorkloadGenerator w(c);
+        Simulator sim(1, 0, c.clients);
+        sim.set_timeout(20);
+        sim.run(w, warmup);
+        cfg.second(sim);
+        scratch.push_back(row(sim.resume()));
+    }
+    auto scratch_s = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    start = std::chrono::steady_clock::now();
+    WorkloadGenerator w(c);
+    Simulator sim(1, 0, c.clients);
+    sim.set_timeout(20);
+    sim.run(w, warmup);
+    Sweep sweep;
+    for(auto const &cfg : configs)
+        sweep.add(cfg.first, [&cfg, &row](Simulator &s) { cfg.second(s); return row(s.resume()); });
+    auto rows = sweep.run(sim, std::max(1u, std::thread::hardware_concurrency()));
+    auto fork_s = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    std::cout << "sweep: open-loop, 20 clients, " << c.ops << " requests, change at tick " << warmup << std::endl;
+    std::cout << std::setw(10) << "config" << std::setw(10) << "completed" << std::setw(10) << "mean" << std::setw(10) << "p99"
+              << std::setw(8) << "same" << std::endl;
+    for(size_t i = 0; i < rows.size(); ++i)
+        std::cout << std::setw(10) << rows[i].name << (rows[i].ok ? rows[i].text : "    failed")
+                  << std::setw(8) << (rows[i].text == scratch[i] ? "yes" : "no") << std::endl;
+    std::cout << "from tick 0: " << scratch_s << " s, forked: " << fork_s << " s" << std::endl;
+}
+
+// Geo-distributed replicas: 0, 1, 4, 5 and the clients 2 ticks apart, 2 and 3 12 ticks
+// from everyone. Classic 3f+1 against weighted voting with an extra replica or two,
+// heavy replicas near or far; the last two rows lose the primary at tick 3000 and the
+// new one keeps the weights or picks them from vote delays.
+void weighted_bench() {
+    NetworkConfig net;
+    net.default_profile.latency = 12;
+    net.zones = {{"a", {0, NetworkConfig::clients}}, {"b", {1}}, {"c", {2}}, {"d", {3}}, {"e", {4, 5}}};
+    LinkProfile near;
+    near.latency = 2;
+    for(auto a : {"a", "b", "e"})
+        for(auto b : {"a", "b", "e"})
+            net.link(a, b, near);
+    struct Config {
+        char const *name;
+        int n;
+        uint64_t heavy;
+        bool adaptive;
+        bool failover;
+    };
+    std::cout << "weighted: closed-loop, 8 clients, 1000 requests, f=1, near links 2 ticks, far 12" << std::endl;
+    std::cout << std::setw(16) << "mode" << std::setw(4) << "n" << std::setw(8) << "heavy" << std::setw(10) << "ticks"
+              << std::setw(10) << "mean" << std::setw(10) << "p99" << std::endl;
+    for(auto const &cfg : {Config{"classic", 4, 0, false, false}, Config{"weighted near", 5, 0b11, false, false},
+                           Config{"weighted far", 5, 0b1100, false, false}, Config{"fixed failover", 6, 0b1100, false, true},
+                           Config{"adapt failover", 6, 0b1100, true, true}}) {
+        WorkloadConfig c;
+        c.mode = Workload::Mode::Closed;
+        c.clients = 8;
+        c.ops = 1000;
+        WorkloadGenerator w(c);
+        Simulator sim(1, cfg.n, c.clients);
+        sim.set_network(net);
+        sim.set_timeout(100);
+        if(cfg.heavy != 0)
+            sim.set_weighted(cfg.heavy, cfg.adaptive);
+        if(cfg.failover)
+            sim.at(3000, [&sim] { sim.destroy_node(0); });
+        auto stats = sim.run(w);
+        auto const heavy = sim.node(1)->heavy();
+        std::cout << std::setw(16) << cfg.name << std::setw(4) << cfg.n << std::setw(8) << heavy << std::setw(10) << stats.ticks
+                  << std::setw(10) << stats.latency.mean() << std::setw(10) << stats.latency.percentile(0.99) << std::endl;
+    }
+}
+
+int main() {
+    failover_bench();
+    communication_bench();
+    dissemination_bench();
+    sharding_bench();
+    quorum_bench();
+    overload_bench();
+    runtime_bench();
+    leaders_bench();
+    payload_bench();
+    speculative_bench();
+    intake_bench();
+    sweep_bench();
+    weighted_bench();
+    return 0;
+}
@@ -1,6 +1,12 @@
 #include "pbft.h"
 #include "crypto.h"
+#include "simulator.h"
+#include "sharding.h"
+#include "runtime.h"
+#include "sweep.h"
 #include <vector>
+#include <sstream>
+#include <numeric>
 
 std::shared_ptr<Link> make_link(std::shared_ptr<Node> const &a, std::shared_ptr<Node> const &b) {
     auto link = Link::make(a, b);
@@ -98,7 +104,7 @@ void crypto_test() {
     assert(verify_message(m, s, node->id()));
 }
 
-struct ClientNode : Node {
+struct TestClientNode : Node {
     void on_tick() {
         broadcast(Message::WriteOpRequest{42});
     }
@@ -106,23 +112,23 @@ struct ClientNode : Node {
 
 void pbft_state_f0_test() {
     State state(0); // f=0
-    assert(not(state.prepare(0, 0)));
+    assert(not(state.prepare(0, 0, 0)));
     assert(state.preprepare(0, 0));
     assert(state.state() == State::Type::PrePrepare);
     assert(not(state.preprepare(0, 0)));
-    assert(not(state.prepare(1, 0)));
-    assert(not(state.prepare(0, 1)));
-    assert(state.prepare(0, 0));
+    assert(not(state.prepare(1, 0, 0)));
+    assert(not(state.prepare(0, 1, 0)));
+    assert(state.prepare(0, 0, 0));
     assert(state.approves() == 1);
     assert(state.state() == State::Type::Prepared);
-    assert(not(state.prepare(0, 0)));
+    assert(not(state.prepare(0, 0, 0)));
     assert(not(state.preprepare(0, 0)));
-    assert(not(state.commit(1, 0)));
-    assert(not(state.commit(0, 1)));
-    assert(state.commit(0, 0));
+    assert(not(state.commit(1, 0, 0)));
+    assert(not(state.commit(0, 1, 0)));
+    assert(state.commit(0, 0, 0));
     assert(state.state() == State::Type::Committed);
-    assert(not(state.commit(0, 0)));
-    assert(not(state.prepare(0, 0)));
+    assert(not(state.commit(0, 0, 0)));
+    assert(not(state.prepare(0, 0, 0)));
     assert(not(state.preprepare(1, 0)));
     assert(not(state.preprepare(1, 1)));
     assert(state.preprepare(0, 1));
@@ -130,33 +136,49 @@ void pbft_state_f0_test() {
 
 void pbft_state_f1_test() {
     State state(1); // f=1
-    assert(not(state.prepare(0, 0)));
+    assert(not(state.prepare(0, 0, 1)));
     assert(state.preprepare(0, 0));
     assert(state.state() == State::Type::PrePrepare);
     assert(not(state.preprepare(0, 0)));
-    assert(not(state.prepare(1, 0)));
-    assert(not(state.prepare(0, 1)));
-    assert(state.prepare(0, 0));
+    assert(not(state.prepare(1, 0, 1)));
+    assert(not(state.prepare(0, 1, 1)));
+    assert(state.prepare(0, 0, 1));
     assert(state.approves() == 1);
     assert(state.state() == State::Type::Prepare);
-    assert(state.prepare(0, 0));
+    assert(not(state.prepare(0, 0, 1))); // the same replica again
     assert(state.approves() == 1);
+    assert(state.state() == State::Type::Prepare);
+    assert(state.prepare(0, 0, 2));
+    assert(state.approves() == 2);
     assert(state.state() == State::Type::Prepared);
-    assert(not(state.prepare(0, 0)));
+    assert(not(state.preprepare(0, 1))); // not before 0 is committed
+    assert(not(state.prepare(0, 0, 3)));
     assert(not(state.preprepare(0, 0)));
-    assert(not(state.commit(1, 0)));
-    assert(not(state.commit(0, 1)));
-    assert(state.commit(0, 0));
+    assert(not(state.commit(1, 0, 0)));
+    assert(not(state.commit(0, 1, 0)));
+    assert(state.commit(0, 0, 0));
+    assert(state.state() == State::Type::Commit);
+    assert(state.commit(0, 0, 1));
     assert(state.state() == State::Type::Commit);
-    assert(state.commit(0, 0));
+    assert(not(state.commit(0, 0, 1)));
     assert(state.state() == State::Type::Commit);
-    assert(state.commit(0, 0));
+    assert(state.commit(0, 0, 2));
     assert(state.state() == State::Type::Committed);
-    assert(not(state.commit(0, 0)));
-    assert(not(state.prepare(0, 0)));
+    assert(not(state.commit(0, 0, 3)));
+    assert(not(state.prepare(0, 0, 3)));
     assert(not(state.preprepare(1, 0)));
     assert(not(state.preprepare(1, 1)));
     assert(state.preprepare(0, 1));
+
+    // Compile time specialized state runs the same way
+    BasicState<VoteTracker<1>> fixed(1);
+    assert(fixed.preprepare(0, 1));
+    assert(fixed.prepare(0, 1, 1) && !fixed.prepare(0, 1, 1) && fixed.prepare(0, 1, 2));
+    assert(fixed.prepared());
+    assert(fixed.commit(0, 1, 0) && fixed.commit(0, 1, 1) && !fixed.commit(0, 1, 0) && fixed.commit(0, 1, 3));
+    assert(fixed.committed() == 1);
+    static_assert(VoteTracker<2>::prepare_quorum == 4 && VoteTracker<2>::commit_quorum == 5, "");
+
 }
 
 void pbft_messaging_f1_test() {
@@ -175,7 +197,7 @@ void pbft_messaging_f1_test() {
         }
     }
 
-    auto client = std::make_shared<ClientNode>();
+    auto client = std::make_shared<TestClientNode>();
     auto client_link = make_link(client, nodes[0]);
 
     auto tick_links = [&links, &client_link] {
@@ -238,7 +260,7 @@ void pbft_messaging_f1_dead_node_test() {
 
     nodes[1].reset(); // dead one
 
-    auto client = std::make_shared<ClientNode>();
+    auto client = std::make_shared<TestClientNode>();
     auto client_link = make_link(client, nodes[0]);
 
     auto tick_links = [&links, &client_link] {
@@ -279,6 +301,1266 @@ void pbft_messaging_f1_dead_node_test() {
     assert(nodes[3]->state().state() == State::Type::Committed);
 }
 
+void workload_generator_test() {
+    WorkloadConfig c;
+    c.clients = 10;
+    c.ops = 10000;
+    c.rate = 2.0;
+    c.read_ratio = 0.25;
+    c.keys = WorkloadConfig::Keys::Zipfian;
+    c.key_space = 100;
+    WorkloadGenerator g1(c), g2(c);
+    WorkloadOp op1, op2;
+    uint64_t ticks = 0, reads = 0, hot = 0, cold = 0;
+    for(uint64_t i = 0; i < c.ops; ++i) {
+        assert(g1.next(op1));
+        assert(g2.next(op2));
+        assert(op1.delay == op2.delay && op1.client == op2.client && digest(op1.msg) == digest(op2.msg));
+        assert(op1.client < c.clients);
+        ticks += op1.delay;
+        if(op1.msg.type == Message::Type::Read) {
+            ++reads;
+            hot += op1.msg.data.read.index == 0;
+            cold += op1.msg.data.read.index == 99;
+        }
+    }
+    assert(not(g1.next(op1)));
+    assert(ticks > 4500 && ticks < 5500); // 2 ops per tick
+    assert(reads > 2200 && reads < 2800);
+    assert(hot > cold * 10);
+
+    c.arrival = WorkloadConfig::Arrival::Bursty;
+    c.burst_on = 10;
+    c.burst_off = 30;
+    WorkloadGenerator bursty(c);
+    uint64_t t = 0;
+    while(bursty.next(op1)) {
+        t += op1.delay;
+        assert(t % 40 < 10);
+    }
+}
+
+void workload_file_test() {
+    WorkloadConfig c;
+    c.clients = 1000;
+    c.ops = 1000;
+    c.mode = Workload::Mode::Closed;
+    c.think = 5;
+    WorkloadGenerator g(c), expected(c);
+    std::stringstream ss;
+    assert(write_workload(ss, g) == c.ops);
+    WorkloadReader r(ss);
+    assert(r.good());
+    assert(r.mode() == Workload::Mode::Closed);
+    assert(r.clients() == c.clients);
+    WorkloadOp op, exp;
+    uint64_t count = 0;
+    while(r.next(op)) {
+        assert(expected.next(exp));
+        assert(op.delay == exp.delay && op.client == exp.client && op.msg.type == exp.msg.type);
+        assert(digest(op.msg) == digest(exp.msg));
+        ++count;
+    }
+    assert(count == c.ops);
+    assert(r.good());
+
+    std::stringstream bad("PBWX");
+    assert(not(WorkloadReader(bad).good()));
+
+    // Kv transactions aren't written
+    struct Kv : Workload {
+        Mode mode() const override { return Mode::Open; }
+        uint32_t clients() const override { return 1; }
+        bool next(WorkloadOp &op) override {
+            op.msg = Message::OpRequestMessage(Message::KvRequest{});
+            return ++count <= 2;
+        }
+        uint64_t count = 0;
+    } kv;
+    std::stringstream out;
+    assert(write_workload(out, kv) == 0 && out.fail());
+}
+
+void simulator_workload_test() {
+    WorkloadConfig c;
+    c.clients = 200;
+    c.ops = 300;
+    c.rate = 0.1;
+    WorkloadGenerator open(c);
+    Simulator sim(1, 0, c.clients);
+    auto stats = sim.run(open);
+    assert(stats.issued == c.ops);
+    assert(stats.completed == c.ops);
+    assert(stats.latency.count() == c.ops);
+    assert(stats.latency.percentile(0.5) >= 4);
+
+    c.mode = Workload::Mode::Closed;
+    c.clients = 20;
+    c.think = 2;
+    WorkloadGenerator closed(c);
+    stats = sim.run(closed);
+    assert(stats.issued == c.ops);
+    assert(stats.completed == c.ops);
+
+    // f+1 answers must match, different results don't add up
+    auto client = std::make_shared<ClientNode>();
+    client->set_verbose(false);
+    std::vector<std::shared_ptr<Node>> replicas = {std::make_shared<Node>(), std::make_shared<Node>(), std::make_shared<Node>()};
+    std::vector<std::shared_ptr<Link>> links;
+    for(auto &r : replicas)
+        links.push_back(Link::make(client, r));
+    client->action(Message::ReadOpRequest{0}, 2);
+    uint64_t const t = 1; // stamped by the client
+    auto answer = [&](size_t i, int value) {
+        Message::OpResponseMessage msg(Message::ReadOpResponse{true, value});
+        auto const sig = signature(digest(Message(msg)), replicas[i]->id());
+        Node::test_interface(*replicas[i]).send_to(client->id(), Message::Response{std::move(msg), sig, t});
+        for(int k = 0; k < 3; ++k) {
+            for(auto &l : links)
+                l->on_tick();
+            client->on_tick();
+        }
+    };
+    answer(0, 1);
+    answer(1, 2);
+    assert(!client->ready() && client->completed() == 0);
+    answer(2, 2);
+    assert(client->ready() && client->completed() == 1);
+}
+
+void link_profile_test() {
+    auto n1 = std::make_shared<Node>();
+    auto n2 = std::make_shared<Node>();
+    auto link = make_link(n1, n2);
+    auto inbox = [&n2] { return Node::test_interface(*n2).inbox().size(); };
+    auto send = [&n1, &n2] { assert(Node::test_interface(*n1).send_to(n2->id(), Message::WriteOpRequest{1})); };
+
+    LinkProfile p;
+    p.latency = 3;
+    link->set_profile(p, 1);
+    send();
+    for(int i = 0; i < 3; ++i) {
+        link->on_tick();
+        assert(inbox() == 0);
+    }
+    link->on_tick();
+    assert(inbox() == 1);
+
+    // 4 frames fit into a tick, so 8 frames take 2 ticks to push out
+    p = LinkProfile();
+    p.bandwidth = 4 * wire_size(Message::WriteOpRequest{1});
+    link->set_profile(p, 1);
+    for(int i = 0; i < 8; ++i)
+        send();
+    link->on_tick();
+    assert(inbox() == 5);
+    link->on_tick();
+    assert(inbox() == 9);
+
+    p = LinkProfile();
+    p.drop = 1.0;
+    link->set_profile(p, 1);
+    send();
+    link->on_tick();
+    assert(inbox() == 9);
+    assert(link->stats().dropped == 1);
+
+    p = LinkProfile();
+    p.duplicate = 1.0;
+    link->set_profile(p, 1);
+    send();
+    link->on_tick();
+    assert(inbox() == 11);
+
+    auto partitions = std::make_shared<Partitions>();
+    link->set_partitions(partitions);
+    partitions->split({{n1->id()}, {n2->id()}});
+    link->set_profile(LinkProfile(), 1);
+    send();
+    link->on_tick();
+    assert(inbox() == 11);
+    partitions->heal();
+    send();
+    link->on_tick();
+    assert(inbox() == 12);
+}
+
+void network_config_test() {
+    std::istringstream geo(
+        "# two regions\n"
+        "seed 7\n"
+        "default latency 1\n"
+        "zone eu 0 1 clients\n"
+        "zone us 2 3\n"
+        "link eu us latency 20 jitter 4 normal bandwidth 1000 drop 0.01\n");
+    NetworkConfig c;
+    assert(c.parse(geo));
+    assert(c.seed == 7);
+    assert(c.zone(NetworkConfig::clients) == "eu");
+    assert(c.profile(0, 1).latency == 1);
+    assert(c.profile(0, 2).latency == 20);
+    assert(c.profile(3, NetworkConfig::clients).jitter_dist == LinkProfile::Jitter::Normal);
+    assert(c.profile(2, 3).latency == 1);
+
+    std::istringstream bad("zone eu 0\nlink eu eu latency fast\n");
+    std::string error;
+    assert(not(NetworkConfig().parse(bad, &error)));
+    assert(error.find("line 2") == 0);
+
+    WorkloadConfig w;
+    w.clients = 10;
+    w.ops = 50;
+    w.rate = 0.05;
+    auto run = [&w, &c] {
+        WorkloadGenerator g(w);
+        Simulator sim(1, 0, w.clients);
+        sim.set_network(c);
+        return sim.run(g, 100000);
+    };
+    auto a = run(), b = run();
+    assert(a.ticks == b.ticks && a.completed == b.completed && a.latency.mean() == b.latency.mean());
+    assert(a.latency.percentile(0.5) > 20); // quorum needs a transatlantic replica
+}
+
+// Votes overtake each other on jittered links; a replica never starts the next instance
+// before it commits the current one, so it executes every request
+void jitter_order_test() {
+    Simulator sim(1, 0, 8);
+    NetworkConfig net;
+    net.default_profile.latency = 1;
+    net.default_profile.jitter = 10;
+    sim.set_network(net);
+    WorkloadConfig c;
+    c.mode = Workload::Mode::Closed;
+    c.clients = 8;
+    c.ops = 2000;
+    c.read_ratio = 0;
+    WorkloadGenerator w(c);
+    assert(sim.run(w).completed == c.ops);
+    sim.idle(100);
+    for(size_t i = 0; i < 4; ++i)
+        assert(sim.node(i)->view() == 0 && sim.node(i)->executed() == c.ops);
+}
+
+// Votes and commits get lost: stalled instances resend their messages, replicas which
+// missed commits fetch them, view changes carry certificates; every replica executes
+// every request in the same order
+void lossy_test() {
+    auto run = [](PBFTNode::Communication comm, double drop, uint32_t jitter) {
+        Simulator sim(1, 0, 4);
+        sim.set_communication(comm);
+        sim.set_timeout(100);
+        sim.set_retransmit(200);
+        NetworkConfig net;
+        net.default_profile.drop = drop;
+        net.default_profile.jitter = jitter;
+        sim.set_network(net);
+        WorkloadConfig c;
+        c.mode = Workload::Mode::Closed;
+        c.clients = 4;
+        c.ops = 1000;
+        WorkloadGenerator w(c);
+        assert(sim.run(w).completed == c.ops);
+        sim.idle(1000);
+        for(size_t i = 0; i < 4; ++i) {
+            assert(sim.node(i)->executed() == c.ops);
+            assert(sim.node(i)->state().committed() == sim.node(0)->state().committed());
+        }
+    };
+    run(PBFTNode::Communication::AllToAll, 0.01, 0);
+    run(PBFTNode::Communication::AllToAll, 0.05, 3);
+    run(PBFTNode::Communication::Collector, 0.01, 0);
+    run(PBFTNode::Communication::Collector, 0.05, 3);
+
+    // The primary of view 1 makes up a NewView skipping requests: replicas haven't got
+    // the ViewChange-s it names, or it names too few, and they don't take it
+    Simulator sim(1, 4, 1);
+    auto proposal = Message::PrePrepare{Message::ReadOpRequest{0}, 0, 0, 1, 6};
+    Node::test_interface faulty(*sim.node(1));
+    for(uint64_t senders : {0xe, 0x2}) {
+        faulty.send_to(sim.node(2)->id(), Message::NewView{1, 5, false, proposal, senders});
+        sim.idle(10);
+        assert(sim.node(2)->view() == 0 && sim.node(2)->state().committed() == 0);
+    }
+}
+
+void pbft_state_new_view_test() {
+    State state(1);
+    assert(state.committed() == 0);
+    assert(state.preprepare(0, 1));
+    assert(state.prepare(0, 1, 0));
+    assert(state.prepare(0, 1, 1));
+    assert(state.prepared());
+    assert(state.committed() == 0);
+    state.new_view(1, 0);
+    assert(not(state.prepared()));
+    assert(state.state() == State::Type::Committed);
+    assert(not(state.preprepare(0, 1)));
+    assert(not(state.preprepare(1, 2)));
+    assert(state.preprepare(1, 1));
+    assert(state.view() == 1);
+}
+
+void view_change_test() {
+    WorkloadConfig c;
+    c.mode = Workload::Mode::Closed;
+    c.clients = 5;
+    c.ops = 200;
+    c.think = 1;
+    WorkloadGenerator w(c);
+    Simulator sim(1, 0, c.clients);
+    sim.set_timeout(20);
+    sim.at(50, [&sim] { sim.destroy_node(0); });
+    auto stats = sim.run(w, 100000);
+    assert(stats.completed == c.ops);
+    assert(sim.failover() > 20 && sim.failover() < 100);
+    for(size_t i = 1; i < 4; ++i) {
+        assert(sim.node(i)->view() == 1);
+        assert(not(sim.node(i)->view_changing()));
+    }
+    assert(sim.node(1)->role() == PBFTNode::Role::Primary);
+    assert(sim.node(1)->executed() == sim.node(2)->executed());
+
+    // The next primary is dead too, so the first attempt times out and view 2 takes over.
+    // 5 nodes to keep 2f+1 alive
+    WorkloadGenerator w2(c);
+    Simulator sim2(1, 5, c.clients);
+    sim2.set_timeout(20);
+    sim2.destroy_node(1);
+    sim2.at(50, [&sim2] { sim2.destroy_node(0); });
+    stats = sim2.run(w2, 100000);
+    assert(stats.completed == c.ops);
+    assert(sim2.node(2)->view() == 2);
+    assert(sim2.node(2)->role() == PBFTNode::Role::Primary);
+    assert(sim2.failover() > 40); // request timer, then view 1 change timer
+    assert(sim2.failover() > sim.failover());
+}
+
+void collector_test() {
+    WorkloadConfig c;
+    c.mode = Workload::Mode::Closed;
+    c.clients = 4;
+    c.ops = 100;
+    auto run = [&c](PBFTNode::Communication comm, bool kill_primary) {
+        WorkloadGenerator w(c);
+        Simulator sim(5, 16, c.clients);
+        sim.set_communication(comm);
+        sim.set_timeout(30);
+        if(kill_primary)
+            sim.at(50, [&sim] { sim.destroy_node(0); });
+        auto stats = sim.run(w, 100000);
+        assert(stats.completed == c.ops);
+        assert(sim.node(1)->executed() == sim.node(15)->executed());
+        return sim.network_stats().sent / stats.completed;
+    };
+    auto all = run(PBFTNode::Communication::AllToAll, false);
+    auto collector = run(PBFTNode::Communication::Collector, false);
+    auto rotating = run(PBFTNode::Communication::RotatingCollector, false);
+    assert(all > 16 * 15 * 2);
+    assert(collector < 16 * 7);
+    assert(rotating < 16 * 7);
+    run(PBFTNode::Communication::Collector, true);
+
+    // A replica relays a genuine PrePrepare with certificates of votes nobody cast:
+    // it's not the collector, and the collector's ones don't carry the votes
+    Simulator sim(1, 4, 1);
+    sim.set_communication(PBFTNode::Communication::Collector);
+    Message::WriteOpRequest w{7};
+    Message::PrePrepare pp{w, signature(digest(Message::OpRequestMessage(w)), sim.node(0)->id()), 0, 0, 1};
+    for(size_t from : {2, 0}) {
+        Node::test_interface faulty(*sim.node(from));
+        faulty.send_to(sim.node(1)->id(), Message::PrePrepare(pp));
+        faulty.send_to(sim.node(1)->id(), Message::PrepareCertificate(Message::PrePrepare(pp), 0xf, 0));
+        faulty.send_to(sim.node(1)->id(), Message::CommitCertificate(Message::PrePrepare(pp), 0xf, 0));
+        sim.idle(10);
+        assert(sim.node(1)->executed() == 0);
+    }
+}
+
+void tree_dissemination_test() {
+    WorkloadConfig c;
+    c.mode = Workload::Mode::Closed;
+    c.clients = 4;
+    c.ops = 100;
+    auto run = [&c](unsigned fanout, bool kill_inner) {
+        WorkloadGenerator w(c);
+        Simulator sim(5, 16, c.clients);
+        sim.set_communication(PBFTNode::Communication::RotatingCollector);
+        sim.set_dissemination(fanout, 10);
+        sim.set_timeout(100);
+        if(kill_inner)
+            sim.destroy_node(1); // root of the biggest subtree
+        auto stats = sim.run(w, 100000);
+        assert(stats.completed == c.ops);
+        assert(kill_inner || sim.node(0)->view() == 0); // dead rotating collector needs view change
+        return double(sim.node(0)->sent().messages) / stats.completed;
+    };
+    auto direct = run(0, false);
+    auto tree = run(2, false);
+    auto fallback = run(2, true);
+    assert(direct > 15);
+    assert(tree < 8);
+    assert(fallback > tree);
+}
+
+void shard_router_test() {
+    ShardRouter r(4);
+    std::vector<int> hits(4, 0);
+    for(int v = 0; v < 4000; ++v)
+        ++hits[r.group(Message::WriteOpRequest{v})];
+    for(auto h : hits)
+        assert(h > 800 && h < 1200);
+
+    // Every group's database; a read of the index the write returned sees the write
+    std::vector<std::unique_ptr<PBFTNode::SuccessStrategy>> dbs;
+    for(int g = 0; g < 4; ++g)
+        dbs.emplace_back(new PBFT_DB());
+    std::vector<std::pair<size_t, int>> written;
+    for(int v = 0; v < 200; ++v) {
+        Message::OpRequestMessage write(Message::WriteOpRequest{v * 7});
+        auto const g = r.group(write);
+        auto answer = dbs[g]->accept(r.local(write));
+        written.emplace_back(r.index(g, answer.data.write_ack.index), v * 7);
+    }
+    std::set<uint32_t> groups;
+    for(auto const &w : written) {
+        Message::OpRequestMessage read(Message::ReadOpRequest{w.first});
+        auto const g = r.group(read);
+        groups.insert(g);
+        auto answer = dbs[g]->accept(r.local(read));
+        assert(answer.data.read_ack.success && answer.data.read_ack.value == w.second);
+    }
+    assert(groups.size() == 4);
+}
+
+void sharded_cluster_test() {
+    WorkloadConfig c;
+    c.clients = 40;
+    c.ops = 400;
+    c.rate = 0.2;
+    WorkloadGenerator w(c);
+    ShardedCluster::Config sc;
+    sc.groups = 4;
+    sc.clients = 10;
+    ShardedCluster cluster(sc);
+    auto r = cluster.run(w);
+    assert(r.groups.size() == 4);
+    assert(r.completed == c.ops);
+    for(auto const &g : r.groups)
+        assert(g.completed > 50);
+
+    // Closed loop, every group takes its operations as its clients get idle
+    c.mode = Workload::Mode::Closed;
+    WorkloadGenerator closed(c);
+    sc.groups = 2;
+    r = ShardedCluster(sc).run(closed);
+    assert(r.completed == c.ops);
+}
+
+
+void parallel_execution_test() {
+    // w0 w1 r0 w0 r1: the second write of key 0 waits for the read, the reads for writes
+    auto waves = schedule_waves({{{0, true}}, {{1, true}}, {{0, false}}, {{0, true}}, {{1, false}}});
+    assert((waves == std::vector<size_t>{0, 0, 1, 2, 1}));
+
+    auto pool = std::make_shared<ThreadPool>(3);
+    // Back to back batches, every index of every batch runs once
+    for(size_t round = 0; round < 2000; ++round) {
+        std::vector<std::atomic<int>> calls(2 + round % 5);
+        pool->parallel_for(calls.size(), [&calls](size_t i) { ++calls[i]; });
+        for(auto const &c : calls)
+            assert(c == 1);
+    }
+    std::unique_ptr<PBFTNode::SuccessStrategy> seq(new PBFT_DB()), par(new PBFT_DB(pool));
+    std::mt19937_64 rng(7);
+    for(int round = 0; round < 50; ++round) {
+        std::vector<Message::OpRequestMessage> run;
+        for(int i = 0; i < 64; ++i) {
+            if(rng() % 2)
+                run.emplace_back(Message::WriteOpRequest{static_cast<int>(rng() % 1000)});
+            else
+                run.emplace_back(Message::ReadOpRequest{static_cast<size_t>(rng() % (round * 40 + 40))});
+        }
+        std::vector<Message::OpResponseMessage> expected, got;
+        seq->accept_run(run, expected);
+        par->accept_run(run, got);
+        assert(expected.size() == got.size());
+        for(size_t i = 0; i < got.size(); ++i)
+            assert(digest(expected[i]) == digest(got[i]));
+    }
+
+    Simulator sim(1, 0, 4);
+    sim.set_execution_threads(2);
+    WorkloadConfig c;
+    c.clients = 4;
+    c.ops = 100;
+    WorkloadGenerator w(c);
+    assert(sim.run(w).completed == c.ops);
+}
+
+void execution_stage_test() {
+    SpscQueue<int> q(3, 0);
+    assert(q.capacity() == 4);
+    for(int i = 0; i < 4; ++i)
+        assert(q.push(i));
+    assert(!q.push(4));
+    int v;
+    assert(q.pop(v) && v == 0 && q.size() == 3);
+
+    // Results come back in order; in-flight jobs are limited till they're drained
+    ExecutionStage<int, int> stage(2, [](std::vector<int> const &in, std::vector<int> &out) {
+        for(auto i : in)
+            out.push_back(i * 10);
+    }, 0, 0);
+    assert(stage.push(1) && stage.push(2) && !stage.push(3));
+    std::vector<int> got;
+    while(got.size() < 2)
+        stage.drain([&got](int &&r) { got.push_back(r); });
+    assert((got == std::vector<int>{10, 20}));
+    assert(stage.push(3));
+    auto st = stage.stats();
+    // The asked capacity bounds the stage, not the queues' power of two
+    ExecutionStage<int, int> odd(3, [](std::vector<int> const &in, std::vector<int> &out) { out = in; }, 0, 0);
+    assert(odd.capacity() == 3 && odd.push(1) && odd.push(2) && odd.push(3) && !odd.push(4));
+    for(int n = 0; n < 3;)
+        odd.drain([&n](int &&) { ++n; });
+    // Every push wakes the sleeping stage, no timed wait covers a lost one
+    for(int i = 0; i < 2000; ++i) {
+        assert(odd.push(i));
+        int r = -1;
+        while(r != i)
+            odd.drain([&r](int &&x) { r = x; });
+    }
+    assert(st.pushed == 3 && st.rejected == 1 && st.max_depth <= 2);
+
+    Simulator sim(1, 0, 4);
+    sim.set_execution_stage(2);
+    WorkloadConfig c;
+    c.clients = 4;
+    c.ops = 100;
+    WorkloadGenerator w(c);
+    assert(sim.run(w).completed == c.ops);
+    auto es = sim.execution_stats();
+    assert(es.executed >= 2 * c.ops && es.max_depth <= 2);
+}
+
+void reply_cache_test() {
+    ReplyCache cache(2);
+    auto response = [](int v, uint64_t t) { return Message::Response{Message::ReadOpResponse{true, v}, 0, t}; };
+    assert(cache.check(1, 1) == ReplyCache::Status::New);
+    cache.commit(1, 1);
+    assert(cache.check(1, 1) == ReplyCache::Status::Stale); // not executed yet
+    cache.answer(1, response(10, 1));
+    assert(cache.check(1, 1) == ReplyCache::Status::Answered);
+    assert(cache.response(1).msg.data.read_ack.value == 10 && cache.hits() == 1);
+    assert(cache.check(1, 2) == ReplyCache::Status::New);
+    assert(cache.check(1, 0) == ReplyCache::Status::New);
+    cache.commit(1, 2);
+    cache.answer(1, response(11, 1)); // late answer of the older one
+    assert(cache.check(1, 1) == ReplyCache::Status::Stale && cache.check(1, 2) == ReplyCache::Status::Stale);
+    cache.commit(2, 1);
+    assert(cache.evicted() == 0);
+    cache.commit(3, 1); // client 1 is the least recent one
+    assert(cache.size() == 2 && cache.evicted() == 1 && cache.check(1, 2) == ReplyCache::Status::New);
+    cache.commit(2, 2); // refreshes client 2, client 3 goes next
+    cache.commit(1, 3);
+    assert(cache.evicted() == 2 && cache.check(3, 1) == ReplyCache::Status::New && cache.check(2, 2) == ReplyCache::Status::Stale);
+    auto checkpoint = cache;
+    cache.commit(1, 5);
+    assert(checkpoint.check(1, 5) == ReplyCache::Status::New && checkpoint.check(2, 2) == ReplyCache::Status::Stale);
+
+    // Clients retransmit every tick over slow links, every request is still executed once
+    Simulator sim(1, 0, 4);
+    NetworkConfig net;
+    net.default_profile.latency = 5;
+    sim.set_network(net);
+    sim.set_retransmit(1);
+    WorkloadConfig c;
+    c.mode = Workload::Mode::Closed;
+    c.clients = 4;
+    c.ops = 100;
+    WorkloadGenerator w(c);
+    assert(sim.run(w).completed == c.ops);
+    for(size_t i = 0; i < 4; ++i)
+        assert(sim.node(i)->executed() == c.ops);
+    assert(sim.node(0)->reply_cache().hits() > 0 && sim.node(0)->reply_cache().size() == 4);
+
+    // Too small a cache: evicted clients' late duplicates run again, on every replica alike
+    Simulator small(1, 0, 4);
+    for(size_t i = 0; i < 4; ++i)
+        small.node(i)->set_reply_cache(ReplyCache(2));
+    small.set_network(net);
+    small.set_retransmit(1);
+    WorkloadGenerator w2(c);
+    assert(small.run(w2).completed == c.ops);
+    assert(small.node(0)->reply_cache().evicted() > 0 && small.node(0)->executed() >= c.ops);
+    for(size_t i = 1; i < 4; ++i)
+        assert(small.node(i)->executed() == small.node(0)->executed());
+}
+
+void flow_control_test() {
+    auto n1 = std::make_shared<Node>();
+    auto n2 = std::make_shared<Node>();
+    auto link = make_link(n1, n2);
+    auto inbox = [&n2] { return Node::test_interface(*n2).inbox().size(); };
+    auto send = [&n1, &n2] { return Node::test_interface(*n1).send_to(n2->id(), Message::WriteOpRequest{1}); };
+
+    // 2 credits and 1 place at the sender, the 4th message doesn't fit
+    LinkProfile p;
+    p.window = 2;
+    p.queue = 1;
+    link->set_profile(p, 1);
+    assert(send() && send() && send());
+    assert(!send());
+    link->on_tick();
+    link->on_tick();
+    assert(inbox() == 2); // the 3rd waits till n2 takes its inbox
+    Node::test_interface(*n2).take_inbox();
+    link->on_tick();
+    assert(inbox() == 1);
+    assert(link->stats().sent == 3 && link->stats().deferred == 1 && link->stats().rejected == 1);
+
+    // Full inbox holds messages in the link
+    link->set_profile(LinkProfile(), 1);
+    n2->set_inbox_capacity(2);
+    assert(send() && send());
+    link->on_tick();
+    assert(inbox() == 2);
+    Node::test_interface(*n2).take_inbox();
+    link->on_tick();
+    assert(inbox() == 1);
+
+    // Messages behind the held one keep aging
+    Node::test_interface(*n2).take_inbox();
+    n2->set_inbox_capacity(1);
+    assert(send() && send());
+    link->on_tick();
+    assert(inbox() == 1);
+    p = LinkProfile();
+    p.latency = 3;
+    link->set_profile(p, 1);
+    assert(send());
+    for(int i = 0; i < 3; ++i)
+        link->on_tick();
+    for(int i = 0; i < 2; ++i) {
+        Node::test_interface(*n2).take_inbox();
+        link->on_tick();
+        assert(inbox() == 1);
+    }
+
+    // No queue limit with credits
+    Node::test_interface(*n2).take_inbox();
+    n2->set_inbox_capacity(0);
+    p = LinkProfile();
+    p.window = 1;
+    link->set_profile(p, 1);
+    auto const rejected = link->stats().rejected;
+    for(int i = 0; i < 100; ++i)
+        assert(send());
+    assert(link->stats().rejected == rejected);
+    for(int i = 0; i < 100; ++i) {
+        link->on_tick();
+        assert(inbox() == 1);
+        Node::test_interface(*n2).take_inbox();
+    }
+
+    // Open-loop overload, about 3 times more than the cluster commits. Admission sheds
+    // the excess and keeps latency short.
+    auto overload = [](size_t window) {
+        Simulator sim(1, 0, 20);
+        sim.set_admission(window);
+        WorkloadConfig c;
+        c.clients = 20;
+        c.ops = 600;
+        c.rate = 1.0;
+        WorkloadGenerator w(c);
+        return sim.run(w);
+    };
+    auto unlimited = overload(0);
+    auto admitted = overload(4);
+    assert(unlimited.completed == 600 && unlimited.rejected == 0);
+    assert(admitted.rejected > 100 && admitted.completed + admitted.rejected == 600);
+    assert(admitted.latency.percentile(0.99) * 10 < unlimited.latency.percentile(0.99));
+}
+
+void kv_store_test() {
+    KvIndex index(8);
+    for(uint64_t k = 0; k < 100; ++k)
+        index.put(k, static_cast<int64_t>(k) * 2);
+    for(uint64_t k = 0; k < 100; k += 2)
+        assert(index.erase(k));
+    assert(!index.erase(0) && index.size() == 50 && index.capacity() >= 128);
+    assert(index.find(2) == nullptr && *index.find(3) == 6);
+    index.put(2, 1); // takes a tombstone
+    assert(*index.find(2) == 1 && index.size() == 51);
+
+    using Op = Message::KvOp;
+    auto tx = [](std::initializer_list<Op> ops) {
+        Message::KvRequest r{0, {}};
+        for(auto const &op : ops)
+            r.ops[r.size++] = op;
+        return r;
+    };
+    KvStore kv;
+    auto r = kv.apply(tx({{Op::Code::Put, 0, 10, 100, 0}, {Op::Code::Put, 0, 20, 200, 0}, {Op::Code::Put, 0, 30, 300, 0}}));
+    assert(r.success && r.size == 3 && kv.size() == 3);
+    r = kv.apply(tx({{Op::Code::Get, 0, 10, 0, 0}, {Op::Code::Get, 0, 15, 0, 0}}));
+    assert(r.results[0].found && r.results[0].value == 100 && !r.results[1].found);
+
+    // Own writes are visible in the scan, the deleted key isn't
+    r = kv.apply(tx({{Op::Code::Delete, 0, 20, 0, 0}, {Op::Code::Put, 0, 25, 250, 0}, {Op::Code::Scan, 10, 15, 0, 0}}));
+    assert(r.success && r.size == 4 && r.results[0].value == 200);
+    assert(r.results[2].key == 25 && r.results[3].key == 30 && r.results[3].value == 300);
+
+    // Failed Cas aborts the whole transaction
+    r = kv.apply(tx({{Op::Code::Put, 0, 40, 400, 0}, {Op::Code::Cas, 0, 10, 101, 99}, {Op::Code::Put, 0, 50, 500, 0}}));
+    assert(!r.success && r.size == 2 && !r.results[1].found && r.results[1].value == 100);
+    r = kv.apply(tx({{Op::Code::Cas, 0, 10, 101, 100}, {Op::Code::Scan, 255, 0, 0, 0}}));
+    assert(r.success && r.size == 1 + 3 && r.results[0].found && r.results[3].key == 30);
+    assert(kv.size() == 3); // 10 25 30
+
+    // Transactions through the cluster
+    class KvWorkload : public Workload {
+    public:
+        Mode mode() const override { return Mode::Closed; }
+        uint32_t clients() const override { return 2; }
+        bool next(WorkloadOp &op) override {
+            if(_n == 50)
+                return false;
+            auto const key = static_cast<uint64_t>(_n++);
+            Message::KvRequest r{2, {{Op::Code::Put, 0, key, 1, 0}, {Op::Code::Scan, 4, key > 2 ? key - 2 : 0, 0, 0}}};
+            op.client = static_cast<uint32_t>(key % 2);
+            op.msg = r;
+            return true;
+        }
+
+    private:
+        int _n = 0;
+    } w;
+    Simulator sim(1, 0, 2);
+    sim.set_execution_threads(2);
+    assert(sim.run(w).completed == 50);
+}
+
+void lease_test() {
+    WorkloadConfig c;
+    c.mode = Workload::Mode::Closed;
+    c.clients = 4;
+    c.ops = 200;
+    c.read_ratio = 1.0;
+    NetworkConfig net;
+    net.default_profile.latency = 3;
+    auto run = [&](uint64_t lease, Simulator &sim) {
+        WorkloadGenerator w(c);
+        sim.set_network(net);
+        sim.set_lease(lease);
+        return sim.run(w, 100000);
+    };
+    Simulator ordered(1, 0, c.clients), leased(1, 0, c.clients);
+    auto slow = run(0, ordered), fast = run(40, leased);
+    assert(slow.completed == c.ops && fast.completed == c.ops);
+    assert(ordered.lease_reads() == 0 && leased.lease_reads() > c.ops / 2);
+    assert(fast.latency.mean() * 2 < slow.latency.mean());
+
+    // Writes are ordered as usual, a read after them sees them
+    c.read_ratio = 0.5;
+    Simulator mixed(1, 0, c.clients);
+    assert(run(40, mixed).completed == c.ops && mixed.lease_reads() > 0);
+
+    // Replicas hold the view change till the lease they granted expires
+    c.think = 1;
+    Simulator failover(1, 0, c.clients), baseline(1, 0, c.clients);
+    failover.set_timeout(20);
+    baseline.set_timeout(20);
+    failover.at(100, [&failover] { failover.destroy_node(0); });
+    baseline.at(100, [&baseline] { baseline.destroy_node(0); });
+    assert(run(60, failover).completed == c.ops && run(0, baseline).completed == c.ops);
+    assert(failover.node(1)->view() == 1 && failover.node(1)->role() == PBFTNode::Role::Primary);
+    assert(failover.failover() > baseline.failover());
+
+    // Echoes of anyone but replicas don't grant the lease, whatever the stamp
+    Simulator alone(1, 0, 1);
+    alone.set_lease(40);
+    for(size_t i = 1; i < 4; ++i)
+        alone.destroy_node(i);
+    std::vector<std::shared_ptr<Node>> others = {std::make_shared<Node>(), std::make_shared<Node>()};
+    std::vector<std::shared_ptr<Link>> links;
+    for(auto &o : others)
+        links.push_back(Link::make(o, alone.node(0)));
+    alone.idle(5);
+    for(auto &o : others)
+        for(uint64_t stamp = 0; stamp <= alone.now() + 40; ++stamp)
+            Node::test_interface(*o).send_to(alone.node(0)->id(), Message::Lease{0, stamp});
+    for(int t = 0; t < 5; ++t) {
+        for(auto &l : links)
+            l->on_tick();
+        alone.idle(1);
+    }
+    assert(alone.node(0)->role() == PBFTNode::Role::Primary && !alone.node(0)->has_lease());
+}
+
+void runtime_test() {
+    // Producers' orders are kept, nothing is lost
+    MpscQueue<std::pair<int, int>> q({0, 0});
+    constexpr int producers = 4, items = 20000;
+    std::vector<std::thread> threads;
+    for(int p = 0; p < producers; ++p)
+        threads.emplace_back([&q, p] {
+            for(int i = 0; i < items; ++i)
+                q.push({p, i});
+        });
+    std::vector<int> next(producers, 0);
+    int received = 0;
+    while(received < producers * items) {
+        received += static_cast<int>(q.consume([&next](std::pair<int, int> &&x) {
+            assert(next[x.first] == x.second);
+            ++next[x.first];
+        }));
+    }
+    for(auto &t : threads)
+        t.join();
+    assert(q.empty());
+
+    // Sleeping thread is woken by the signal, not by the timeout
+    Wakeup wakeup;
+    auto seq = wakeup.prepare();
+    std::thread signaller([&wakeup] { wakeup.signal(); });
+    auto start = std::chrono::steady_clock::now();
+    wakeup.wait(seq, std::chrono::seconds(10));
+    assert(std::chrono::steady_clock::now() - start < std::chrono::seconds(5));
+    signaller.join();
+
+    WorkloadConfig c;
+    c.mode = Workload::Mode::Closed;
+    c.clients = 3;
+    c.ops = 300;
+    WorkloadGenerator w(c);
+    RuntimeCluster::Config rc;
+    rc.clients = c.clients;
+    rc.window = 2;
+    auto r = RuntimeCluster(rc).run(w);
+    assert(r.completed == c.ops && r.runtime.delivered > 0 && r.runtime.wakeups > 0);
+    // f+1 answered every request, not the same ones; the rest may lag when clients are done
+    assert(std::accumulate(r.executed.begin(), r.executed.end(), uint64_t(0)) >= 2 * c.ops);
+}
+
+void multi_leader_test() {
+    WorkloadConfig c;
+    c.mode = Workload::Mode::Closed;
+    c.clients = 8;
+    c.ops = 400;
+    WorkloadGenerator w1(c), w4(c);
+    Simulator single(1, 4, c.clients), multi(1, 4, c.clients, 4);
+    auto one = single.run(w1), four = multi.run(w4);
+    assert(one.completed == c.ops && four.completed == c.ops);
+    assert(four.ticks * 3 < one.ticks);
+    for(size_t l = 0; l < 4; ++l)
+        assert(multi.node(l, l)->role() == PBFTNode::Role::Primary);
+    for(size_t i = 0; i < 4; ++i)
+        assert(multi.merger(i).executed() == c.ops && multi.merger(i).position() == multi.merger(0).position());
+
+    // The only client is in lane 0, idle lanes fill their positions with no-ops
+    c.clients = 1;
+    c.ops = 50;
+    WorkloadGenerator w(c);
+    Simulator lonely(1, 4, 1, 4);
+    assert(lonely.run(w).completed == c.ops);
+    assert(lonely.merger(1).executed() == c.ops && lonely.merger(1).position() >= 4 * (c.ops - 1));
+
+    // Lane 0 replaces its dead leader, the others keep going
+    c.clients = 4;
+    c.ops = 200;
+    WorkloadGenerator wf(c);
+    Simulator failover(1, 5, c.clients, 2);
+    failover.set_timeout(20);
+    failover.at(50, [&failover] { failover.destroy_node(0); });
+    assert(failover.run(wf, 100000).completed == c.ops);
+    assert(failover.node(1, 0)->view() == 1 && failover.node(1, 1)->view() == 0);
+    assert(failover.merger(1).executed() == failover.merger(2).executed());
+}
+
+void payload_test() {
+    std::string const abc = "abc";
+    auto const h = sha256(reinterpret_cast<uint8_t const *>(abc.data()), abc.size());
+    assert(h[0] == 0xba && h[1] == 0x78 && h[30] == 0x15 && h[31] == 0xad);
+    auto a = make_payload(Bytes(4000, 7));
+    auto b = make_payload(Bytes(4000, 8));
+    assert(a.second != nullptr && a.first.size == 4000 && a.first.digest != b.first.digest);
+    assert(make_payload(Bytes()).second == nullptr);
+
+    Message::WriteOpRequest plain{1, 1}, write{1, 1, a.first};
+    assert(digest(plain) != digest(write));
+    Message carried(write);
+    carried.payload = a.second;
+    assert(wire_size(carried) == wire_size(Message(plain)) + 4000);
+    Message::PrePrepare pp{write, 0, 0, 0, 1};
+    Message pre{Message::PrePrepare(pp)}, vote{Message::Prepare(Message::PrePrepare(pp), 0)};
+
+    // A node takes only bytes matching the digest and sends them on, votes go by the digest
+    Payloads store(2);
+    Message forged(write);
+    forged.payload = b.second;
+    assert(!store.absorb(forged) && !store.has(write));
+    assert(store.absorb(carried) && store.has(write) && store.get(a.first) == a.second);
+    store.attach(pre);
+    store.attach(vote);
+    assert(pre.payload == a.second && wire_size(pre) > 4000 && vote.payload == nullptr && wire_size(vote) < 200);
+
+    // Executed ones stay, the others go after `limit` newer ones
+    store.keep(write);
+    auto other = make_payload(Bytes(10, 1));
+    store.put(other.first, other.second);
+    for(uint8_t i = 2; i < 8; ++i) {
+        auto p = make_payload(Bytes(10, i));
+        store.put(p.first, p.second);
+    }
+    assert(store.has(write) && store.get(other.first) == nullptr && store.size() <= 4);
+
+    // Reads return the handle of the write
+    std::unique_ptr<PBFTNode::SuccessStrategy> db(new PBFT_DB());
+    std::vector<Message::OpResponseMessage> results;
+    db->accept_run({write, Message::ReadOpRequest{0}}, results);
+    auto const &read = results[1].data.read_ack;
+    assert(read.success && read.payload.digest == a.first.digest && read.payload.size == 4000);
+
+    // Bytes are counted once per hop of the request and PrePrepare, not per vote
+    WorkloadConfig c;
+    c.mode = Workload::Mode::Closed;
+    c.clients = 2;
+    c.ops = 100;
+    c.read_ratio = 0;
+    WorkloadGenerator w0(c);
+    c.payload = 1024;
+    WorkloadGenerator w1(c);
+    Simulator small(1, 0, c.clients), large(1, 0, c.clients);
+    assert(small.run(w0).completed == c.ops && large.run(w1).completed == c.ops);
+    auto const extra = large.network_stats().bytes - small.network_stats().bytes;
+    assert(extra == c.ops * 1024 * (4 + 3));
+    for(size_t i = 0; i < 4; ++i)
+        assert(large.node(i)->payloads().size() == c.ops);
+}
+
+void learner_test() {
+    WorkloadConfig c;
+    c.mode = Workload::Mode::Closed;
+    c.clients = 4;
+    c.ops = 300;
+    WorkloadGenerator w(c), w0(c);
+    Simulator sim(1, 0, c.clients), plain(1, 0, c.clients);
+    sim.add_learner();
+    sim.add_learner();
+    auto small = sim.add_learner(10);
+    std::vector<Learner::Committed> stream;
+    size_t batches = 0;
+    assert(sim.learner(0)->subscribe(1, 16, [&](std::vector<Learner::Committed> const &b) {
+        assert(b.size() <= 16 && (stream.empty() || stream.back().seq < b.front().seq));
+        stream.insert(stream.end(), b.begin(), b.end());
+        ++batches;
+    }) != 0);
+    assert(sim.run(w).completed == c.ops && plain.run(w0).completed == c.ops);
+
+    // Every learner has got all of it, from 2f+1 replicas and nothing else
+    auto const committed = sim.node(0)->state().committed();
+    for(size_t i = 0; i < 3; ++i)
+        assert(sim.learner(i)->applied() == committed && sim.learner(i)->fetches() == 0);
+    assert(sim.network_stats().sent - plain.network_stats().sent == 3 * 3 * committed);
+    assert(stream.size() == sim.learner(0)->executed() && batches <= stream.size());
+
+    // Resuming from the middle gives the rest of the same stream, in batches
+    std::vector<Learner::Committed> rest;
+    auto const from = stream[stream.size() / 2].seq;
+    batches = 0;
+    auto id = sim.learner(0)->subscribe(from, 7, [&](std::vector<Learner::Committed> const &b) {
+        rest.insert(rest.end(), b.begin(), b.end());
+        ++batches;
+    });
+    sim.learner(0)->on_tick();
+    sim.learner(0)->unsubscribe(id);
+    assert(rest.size() == stream.size() - stream.size() / 2 && rest.front().seq == from);
+    assert(batches == (rest.size() + 6) / 7);
+    assert(digest(rest.back().msg) == digest(stream.back().msg));
+    assert(sim.learner(small)->subscribe(1, 1, [](std::vector<Learner::Committed> const &) {}) == 0);
+
+    // The learner answers reads alone from its copy: index 0 is the first write of the stream
+    auto reader = std::make_shared<Node>();
+    auto learner = std::static_pointer_cast<Node>(sim.learner(0));
+    auto link = Link::make(reader, learner);
+    assert(Node::test_interface(*reader).send_to(learner->id(), Message::ReadOpRequest{0, 1}));
+    link->on_tick();
+    learner->on_tick();
+    link->on_tick();
+    auto inbox = Node::test_interface(*reader).take_inbox();
+    assert(inbox.size() == 1 && inbox.front().second.type == Message::Type::Response);
+    auto const &answer = inbox.front().second.data.response;
+    auto first = std::find_if(stream.begin(), stream.end(), [](Learner::Committed const &e) { return e.msg.type == Message::Type::Write; });
+    assert(answer.msg.data.read_ack.success && answer.msg.data.read_ack.value == first->msg.data.write.value);
+    assert(verify_message(answer.msg, answer.sig, learner->id()) && sim.learner(0)->reads() == 1);
+
+    // A well formed Decision of the next req_id isn't enough from a client, or from one
+    // replica of the f+1 needed
+    Message::WriteOpRequest write{7};
+    Message::PrePrepare pp{write, signature(digest(Message::OpRequestMessage(write)), sim.node(0)->id()), 0, 0, committed + 1};
+    auto const vote = PBFTNode::vote_digest(Phase::Commit, pp);
+    Signature votes = 0;
+    for(size_t i = 0; i < 3; ++i)
+        votes = aggregate(votes, signature(vote, sim.node(i)->id()));
+    Node::test_interface(*reader).send_to(learner->id(), Message::Decision(Message::PrePrepare(pp), 0x7, votes));
+    link->on_tick();
+    Node::test_interface(*sim.node(0)).send_to(learner->id(), Message::Decision(Message::PrePrepare(pp), 0x7, votes));
+    sim.idle(10);
+    assert(sim.learner(0)->applied() == committed);
+    Node::test_interface(*sim.node(1)).send_to(learner->id(), Message::Decision(Message::PrePrepare(pp), 0x7, votes));
+    sim.idle(10);
+    assert(sim.learner(0)->applied() == committed + 1);
+
+    // A feeding replica dies and Decision-s get lost: the learner still decides by the
+    // others and fetches what it missed, the stream has no gaps
+    Simulator lossy(1, 0, c.clients);
+    lossy.add_learner();
+    lossy.set_timeout(100);
+    lossy.set_retransmit(200);
+    NetworkConfig net;
+    net.default_profile.drop = 0.02;
+    lossy.set_network(net);
+    std::vector<uint32_t> seqs;
+    lossy.learner(0)->subscribe(1, 16, [&seqs](std::vector<Learner::Committed> const &b) {
+        for(auto const &e : b)
+            seqs.push_back(e.seq);
+    });
+    lossy.at(200, [&lossy] { lossy.destroy_node(1); });
+    WorkloadGenerator w1(c);
+    assert(lossy.run(w1).completed == c.ops);
+    lossy.idle(1000);
+    auto const &l = *lossy.learner(0);
+    assert(l.applied() == lossy.node(0)->state().committed() && l.executed() == lossy.node(0)->executed());
+    assert(l.fetches() > 0 && seqs.size() == l.executed());
+    for(size_t i = 1; i < seqs.size(); ++i)
+        assert(seqs[i] > seqs[i - 1]);
+}
+
+void speculative_test() {
+    WorkloadConfig c;
+    c.mode = Workload::Mode::Closed;
+    c.clients = 4;
+    c.ops = 200;
+    WorkloadGenerator w(c), ws(c);
+    Simulator pbft(1, 0, c.clients), spec(1, 0, c.clients);
+    spec.set_speculative(10);
+    auto slow = pbft.run(w), fast = spec.run(ws);
+    assert(fast.completed == c.ops && spec.certified() == 0);
+    assert(fast.latency.mean() * 2 < slow.latency.mean() && fast.ticks < slow.ticks);
+    assert(spec.network_stats().sent * 2 < pbft.network_stats().sent);
+    assert(spec.node(1)->state().committed() == spec.node(0)->state().committed());
+
+    // A replica is gone: 3f matching answers, every request goes through the certificate
+    WorkloadGenerator wd(c);
+    Simulator degraded(1, 0, c.clients);
+    degraded.set_speculative(10);
+    degraded.at(30, [&degraded] { degraded.destroy_node(3); });
+    auto d = degraded.run(wd);
+    assert(d.completed == c.ops && degraded.certified() > c.ops / 2);
+    assert(d.latency.percentile(1.0) >= 10);
+
+    // The primary is gone: the new view continues after the highest request executed
+    WorkloadGenerator wf(c);
+    Simulator failover(1, 0, c.clients);
+    failover.set_speculative(10);
+    failover.set_timeout(20);
+    failover.at(30, [&failover] { failover.destroy_node(0); });
+    assert(failover.run(wf, 100000).completed == c.ops);
+    assert(failover.node(1)->view() >= 1 && failover.node(1)->state().committed() >= c.ops);
+}
+
+void intake_test() {
+    WorkloadConfig c;
+    c.clients = 20;
+    c.ops = 400;
+    c.rate = 4;
+    c.arrival = WorkloadConfig::Arrival::Bursty;
+    c.burst_off = 190;
+    auto run = [&c](PBFTNode::Intake const &intake) {
+        WorkloadGenerator w(c);
+        Simulator sim(1, 0, c.clients);
+        sim.set_intake(intake);
+        auto stats = sim.run(w);
+        assert(stats.completed == c.ops);
+        for(size_t i = 0; i < 4; ++i)
+            assert(sim.node(i)->backlog() == 0 && sim.node(i)->state().committed() == c.ops);
+        return std::make_pair(stats.latency.percentile(0.99), sim.node(1)->aged());
+    };
+    PBFTNode::Intake fifo, lanes;
+    fifo.budget = lanes.budget = 2;
+    fifo.lanes = false;
+    auto unlimited = run(PBFTNode::Intake()), arrival = run(fifo), prioritized = run(lanes);
+    assert(unlimited.first < arrival.first && prioritized.first < arrival.first);
+    assert(arrival.second == 0 && prioritized.second > 0);
+
+    // Client requests behind a flood of agreement still get in
+    lanes.weights = {{64, 64, 1}};
+    lanes.max_wait = 4;
+    auto starving = run(lanes);
+    assert(starving.second > prioritized.second);
+}
+
+void sweep_test() {
+    WorkloadConfig c;
+    c.mode = Workload::Mode::Closed;
+    c.clients = 4;
+    c.ops = 300;
+    WorkloadGenerator whole(c), w(c);
+    Simulator straight(1, 0, c.clients), sim(1, 0, c.clients);
+    straight.set_timeout(20);
+    sim.set_timeout(20);
+    auto full = straight.run(whole);
+    auto warm = sim.run(w, 200);
+    assert(warm.ticks == 200 && warm.completed < c.ops);
+
+    auto row = [](Simulator &s) {
+        auto stats = s.resume();
+        return std::to_string(stats.ticks) + " " + std::to_string(stats.completed) + " " + std::to_string(s.node(1)->state().committed());
+    };
+    Sweep sweep;
+    sweep.add("same", row);
+    sweep.add("primary", [&row](Simulator &s) { s.destroy_node(0); return row(s); });
+    sweep.add("crash", [](Simulator &) -> std::string { ::_exit(2); });
+    auto rows = sweep.run(sim, 2);
+    assert(rows.size() == 3 && rows[0].name == "same" && rows[0].ok && rows[1].ok && !rows[2].ok);
+    // The fork goes on as if it never stopped
+    std::istringstream same(rows[0].text);
+    uint64_t ticks = 0, completed = 0, committed = 0;
+    same >> ticks >> completed >> committed;
+    assert(warm.ticks + ticks == full.ticks && warm.completed + completed == c.ops);
+    assert(committed == straight.node(1)->state().committed());
+    std::istringstream failover(rows[1].text);
+    failover >> ticks >> completed >> committed;
+    assert(warm.completed + completed == c.ops && ticks > full.ticks - warm.ticks);
+
+    // Forks didn't touch the parent
+    assert(sim.node(0) != nullptr && sim.resume().ticks + warm.ticks == full.ticks);
+
+    // A new run drops the stopped one
+    WorkloadGenerator stopped(c), next(c);
+    assert(straight.run(stopped, 50).completed < c.ops && straight.run(next).issued == c.ops);
+}
+
+void profile_test() {
+    WorkloadConfig c;
+    c.mode = Workload::Mode::Closed;
+    c.clients = 2;
+    c.ops = 100;
+    WorkloadGenerator w(c);
+    Simulator sim(1, 0, c.clients);
+    sim.run(w);
+    std::ostringstream os;
+    sim.write_profile(os);
+    auto const folded = os.str();
+    for(auto stack : {"replica0;PBFTNode;propose;multicast;send ", "replica1;PBFTNode;PrePrepare;verify;digest ",
+                      "replica2;PBFTNode;Commit ", "replica3;PBFTNode;execute;accept ", "network;Link "})
+        assert(folded.find(stack) != std::string::npos);
+    std::istringstream lines(folded);
+    for(std::string line; std::getline(lines, line);)
+        assert(std::stoull(line.substr(line.rfind(' ') + 1)) > 0);
+    auto per_request = sim.profile_per_request();
+    assert(per_request["verify"] > 0 && per_request["accept"] > 0 && per_request.count("Read") == 1);
+
+    // A new simulator counts from scratch, whatever ids its nodes got
+    Simulator idle(1, 0, 1);
+    std::ostringstream none;
+    idle.write_profile(none);
+    assert(none.str().empty());
+}
+
+// Replicas 0, 1, 4, 5 and the clients are near each other, 2 and 3 are far from everyone
+NetworkConfig geo_network() {
+    NetworkConfig net;
+    net.default_profile.latency = 12;
+    net.zones = {{"a", {0, NetworkConfig::clients}}, {"b", {1}}, {"c", {2}}, {"d", {3}}, {"e", {4, 5}}};
+    LinkProfile near;
+    near.latency = 2;
+    for(auto a : {"a", "b", "e"})
+        for(auto b : {"a", "b", "e"})
+            net.link(a, b, near);
+    return net;
+}
+
+void weighted_test() {
+    for(int f = 1; f <= 2; ++f) {
+        for(size_t n = 3 * f + 1; n <= 3 * static_cast<size_t>(f) + 3; ++n) {
+            auto w = wheat_weights(f, n, (uint64_t(1) << 2 * f) - 1);
+            auto weigh = [&w](uint64_t set) {
+                int s = 0;
+                for(size_t i = 0; i < w.weight.size(); ++i)
+                    s += (set >> i & 1) ? w.weight[i] : 0;
+                return s;
+            };
+            // Quorums intersect in more than f replicas weigh, f heaviest can't block one
+            for(uint64_t a = 0; a < (uint64_t(1) << n); ++a) {
+                if(__builtin_popcountll(a) <= f)
+                    assert(weigh(a) <= w.faulty);
+                if(weigh(a) < w.quorum)
+                    continue;
+                assert(__builtin_popcountll(a) >= 2 * f + 1);
+                for(uint64_t b = a; b < (uint64_t(1) << n); ++b)
+                    if(weigh(b) >= w.quorum)
+                        assert(weigh(a & b) > w.faulty);
+            }
+            assert(weigh((uint64_t(1) << n) - 1) - w.faulty >= w.quorum);
+        }
+    }
+
+    VoteTracker<0> votes(1);
+    auto w = wheat_weights(1, 5, 0b11);
+    votes.set_weights(w.weight, w.quorum - w.weight[0], w.quorum);
+    votes.clear();
+    assert(votes.vote(Phase::Commit, 0) && votes.vote(Phase::Commit, 1) && votes.count(Phase::Commit) == 4);
+    assert(!votes.vote(Phase::Commit, 1) && votes.vote(Phase::Commit, 4) && votes.count(Phase::Commit) >= votes.quorum(Phase::Commit));
+
+    // Heavy replicas near each other commit without the far ones
+    WorkloadConfig c;
+    c.mode = Workload::Mode::Closed;
+    c.clients = 4;
+    c.ops = 200;
+    auto run = [&c](Simulator &sim) {
+        WorkloadGenerator w(c);
+        sim.set_network(geo_network());
+        auto stats = sim.run(w);
+        assert(stats.completed == c.ops);
+        return stats;
+    };
+    Simulator classic(1, 4, c.clients), near(1, 5, c.clients), far(1, 5, c.clients);
+    near.set_weighted(0b00011);
+    far.set_weighted(0b01100);
+    auto slow = run(classic), fast = run(near), wrong = run(far);
+    assert(fast.latency.mean() * 2 < slow.latency.mean() && fast.latency.mean() * 2 < wrong.latency.mean());
+    assert(near.node(4)->state().committed() == c.ops);
+
+    // The new primary makes the replicas which voted fastest heavy
+    Simulator adaptive(1, 6, c.clients), fixed(1, 6, c.clients);
+    adaptive.set_weighted(0b001100);
+    fixed.set_weighted(0b001100, false);
+    for(auto sim : {&adaptive, &fixed}) {
+        sim->set_timeout(100);
+        sim->at(500, [sim] { sim->destroy_node(0); });
+    }
+    auto learnt = run(adaptive), stuck = run(fixed);
+    auto const heavy = adaptive.node(1)->heavy();
+    assert(adaptive.node(1)->view() == 1 && (heavy == 0b010010 || heavy == 0b100010));
+    assert(fixed.node(1)->heavy() == 0b001100 && learnt.ticks * 2 < stuck.ticks);
+
+    // The f faulty replicas are heavy, the primary and the next one: the rest still make
+    // quorums, the new heavy ones are 2f live replicas with the new primary
+    Simulator faulty(2, 8, c.clients);
+    faulty.set_weighted(0b00001111);
+    faulty.set_timeout(100);
+    faulty.at(500, [&faulty] { faulty.destroy_node(0); faulty.destroy_node(1); });
+    run(faulty);
+    for(size_t i = 2; i < 8; ++i) {
+        auto const &node = *faulty.node(i);
+        assert(node.view() == 2 && node.heavy() == faulty.node(2)->heavy() && node.state().committed() == c.ops);
+    }
+    auto const chosen = faulty.node(2)->heavy();
+    assert(__builtin_popcountll(chosen) == 4 && (chosen & 0b111) == 0b100);
+}
 
 int main() {
     links_test();
@@ -288,5 +1570,33 @@ int main() {
     pbft_state_f1_test();
     pbft_messaging_f1_test();
     pbft_messaging_f1_dead_node_test();
+    workload_generator_test();
+    workload_file_test();
+    simulator_workload_test();
+    link_profile_test();
+    network_config_test();
+    jitter_order_test();
+    lossy_test();
+    pbft_state_new_view_test();
+    view_change_test();
+    collector_test();
+    tree_dissemination_test();
+    shard_router_test();
+    sharded_cluster_test();
+    parallel_execution_test();
+    execution_stage_test();
+    reply_cache_test();
+    flow_control_test();
+    kv_store_test();
+    lease_test();
+    runtime_test();
+    multi_leader_test();
+    payload_test();
+    learner_test();
+    speculative_test();
+    intake_test();
+    sweep_test();
+    profile_test();
+    weighted_test();
     return 0;
 }
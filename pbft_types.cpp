@@ -1,4 +1,139 @@
 #include "pbft_types.h"
+#include "payload.h"
+#include "profile.h"
+#include <algorithm>
+#include <cmath>
+
+// Requests and responses travel in unions sized for the largest of them, only the used
+// part of the union goes on the wire
+static size_t kv_size(Message::KvRequest const &msg) {
+    return sizeof(msg) - (Message::KvRequest::max_ops - msg.size) * sizeof(Message::KvOp);
+}
+
+static size_t kv_size(Message::KvResponse const &msg) {
+    return sizeof(msg) - (Message::KvResponse::max_results - msg.size) * sizeof(Message::KvResult);
+}
+
+static size_t payload_size(Message::OpRequestMessage const &msg) {
+    switch(msg.type) {
+    case Message::Type::Write:
+        return sizeof(msg.data.write);
+    case Message::Type::Read:
+        return sizeof(msg.data.read);
+    case Message::Type::Kv:
+        return kv_size(msg.data.kv);
+    case Message::Type::WriteAck:
+    case Message::Type::ReadAck:
+    case Message::Type::KvAck:
+    case Message::Type::Response:
+    case Message::Type::PrePrepare:
+    case Message::Type::Prepare:
+    case Message::Type::Commit:
+    case Message::Type::ViewChange:
+    case Message::Type::NewView:
+    case Message::Type::PrepareCertificate:
+    case Message::Type::CommitCertificate:
+    case Message::Type::Busy:
+    case Message::Type::Lease:
+    case Message::Type::Decision:
+    case Message::Type::SpecCommit:
+    case Message::Type::LocalCommit:
+    case Message::Type::Fetch:
+        assert(not("Unreachable"));
+    }
+    return 0; // happy gcc
+}
+
+static size_t payload_size(Message::OpResponseMessage const &msg) {
+    switch(msg.type) {
+    case Message::Type::WriteAck:
+        return sizeof(msg.data.write_ack);
+    case Message::Type::ReadAck:
+        return sizeof(msg.data.read_ack);
+    case Message::Type::KvAck:
+        return kv_size(msg.data.kv_ack);
+    case Message::Type::Write:
+    case Message::Type::Read:
+    case Message::Type::Kv:
+    case Message::Type::Response:
+    case Message::Type::PrePrepare:
+    case Message::Type::Prepare:
+    case Message::Type::Commit:
+    case Message::Type::ViewChange:
+    case Message::Type::NewView:
+    case Message::Type::PrepareCertificate:
+    case Message::Type::CommitCertificate:
+    case Message::Type::Busy:
+    case Message::Type::Lease:
+    case Message::Type::Decision:
+    case Message::Type::SpecCommit:
+    case Message::Type::LocalCommit:
+    case Message::Type::Fetch:
+        assert(not("Unreachable"));
+    }
+    return 0; // happy gcc
+}
+
+// Payload bytes count where they go, see `payload.h`
+size_t wire_size(Message const &msg) {
+    size_t header = sizeof(msg.type) + (msg.payload != nullptr ? msg.payload->size() : 0);
+    auto const request_size = sizeof(Message::OpRequestData);
+    switch(msg.type) {
+    case Message::Type::Write:
+        return header + sizeof(msg.data.write);
+    case Message::Type::Read:
+        return header + sizeof(msg.data.read);
+    case Message::Type::Kv:
+        return header + kv_size(msg.data.kv);
+    case Message::Type::WriteAck:
+        return header + sizeof(msg.data.write_ack);
+    case Message::Type::ReadAck:
+        return header + sizeof(msg.data.read_ack);
+    case Message::Type::KvAck:
+        return header + kv_size(msg.data.kv_ack);
+    case Message::Type::Response:
+        return header + sizeof(msg.data.response) - sizeof(Message::OpResponseData) + payload_size(msg.data.response.msg);
+    case Message::Type::PrePrepare:
+        return header + sizeof(msg.data.preprepare) - request_size + payload_size(msg.data.preprepare.msg);
+    case Message::Type::Prepare:
+    case Message::Type::Commit:
+        return header + sizeof(msg.data.prepare) - request_size + payload_size(msg.data.prepare.msg);
+    case Message::Type::ViewChange:
+        return header + sizeof(msg.data.view_change) - request_size + payload_size(msg.data.view_change.proposal.msg);
+    case Message::Type::NewView:
+        return header + sizeof(msg.data.new_view) - request_size + payload_size(msg.data.new_view.proposal.msg);
+    case Message::Type::PrepareCertificate:
+    case Message::Type::CommitCertificate:
+        return header + sizeof(msg.data.prepare_certificate) - request_size + payload_size(msg.data.prepare_certificate.msg);
+    case Message::Type::Decision:
+        return header + sizeof(msg.data.decision) - request_size + payload_size(msg.data.decision.msg);
+    case Message::Type::SpecCommit:
+        return header + sizeof(msg.data.spec_commit);
+    case Message::Type::LocalCommit:
+        return header + sizeof(msg.data.local_commit);
+    case Message::Type::Busy:
+        return header + sizeof(msg.data.busy);
+    case Message::Type::Lease:
+        return header + sizeof(msg.data.lease);
+    case Message::Type::Fetch:
+        return header + sizeof(msg.data.fetch);
+    }
+    return header; // happy gcc
+}
+
+void Partitions::split(std::vector<std::vector<uintptr_t>> const &groups) {
+    _group.clear();
+    for(size_t i = 0; i < groups.size(); ++i)
+        for(auto n : groups[i])
+            _group[n] = i;
+}
+
+bool Partitions::reachable(uintptr_t a, uintptr_t b) const {
+    auto ga = _group.find(a);
+    auto gb = _group.find(b);
+    return ga == _group.end() || gb == _group.end() || ga->second == gb->second;
+}
+
 
 uintptr_t Node::id() const {
     return reinterpret_cast<uintptr_t>(this);
@@ -32,20 +167,56 @@ bool Node::send_to(uintptr_t node, Message &&msg) {
         return false;
     auto link_ptr = it->second.lock();
     assert(link_ptr != nullptr);
-    return link_ptr->send(node, std::move(msg));
+    return send(*link_ptr, node, std::move(msg));
+}
+
+Payloads &Node::payloads() {
+    if(_payloads == nullptr)
+        _payloads = std::make_shared<Payloads>();
+    return *_payloads;
+}
+
+void Node::share_payloads(Node &other) {
+    other.payloads();
+    _payloads = other._payloads;
 }
 
 void Node::broadcast(Message &&msg) {
+    PBFT_PROFILE_SCOPE("broadcast");
+    payloads().attach(msg);
     for(auto &l : _links) {
         auto link_ptr = l.second.lock();
         assert(link_ptr != nullptr);
-        link_ptr->send(l.first, Message(msg));
+        send(*link_ptr, l.first, Message(msg));
     }
 }
 
+bool Node::send(Link &link, uintptr_t node, Message &&msg) {
+    PBFT_PROFILE_SCOPE("send");
+    payloads().attach(msg);
+    auto size = wire_size(msg);
+    bool sent = _transport != nullptr ? _transport->deliver(id(), node, std::move(msg)) : link.send(node, std::move(msg));
+    if(!sent)
+        return false;
+    ++_sent.messages;
+    _sent.bytes += size;
+    return true;
+}
+
+void Node::multicast(std::vector<uintptr_t> const &nodes, Message &&msg) {
+    PBFT_PROFILE_SCOPE("multicast");
+    payloads().attach(msg);
+    for(auto n : nodes)
+        if(n != id())
+            send_to(n, Message(msg));
+}
+
 void Node::put(uintptr_t src_id, Message &&msg) {
     assert(has_link(src_id));
+    if(!payloads().absorb(msg))
+        return; // bytes other than the digest says
     _inbox.push_back({src_id, std::move(msg)});
+    ++_queued[src_id];
 }
 
 
@@ -94,26 +265,111 @@ bool Link::send(uintptr_t dst_id, Message &&msg) {
     assert(d.src.node_id == dst_id);
     if(d.src.node.expired())
         return false; // just drop the message
-    d.src.inbox.push_back(std::move(msg));
+    if(!d.src.waiting.empty() || !has_credit(d.dst.node_id, d.src)) {
+        if(_profile.queue != 0 && d.src.waiting.size() >= _profile.queue) {
+            ++_stats.rejected;
+            return false;
+        }
+        ++_stats.deferred;
+        d.src.waiting.push_back(std::move(msg));
+        return true;
+    }
+    transmit(d.dst.node_id, d.src, std::move(msg));
     return true;
 }
 
+// Credits in use are messages on the wire to `dst` and ones it hasn't taken from its inbox
+bool Link::has_credit(uintptr_t src, Mailbox &dst) const {
+    if(_profile.window == 0)
+        return true;
+    auto node_ptr = dst.node.lock();
+    size_t used = dst.inbox.size() + (node_ptr == nullptr ? 0 : node_ptr->queued(src));
+    return used < _profile.window;
+}
+
+void Link::transmit(uintptr_t src, Mailbox &dst, Message &&msg) {
+    ++_stats.sent;
+    if((_partitions != nullptr && !_partitions->reachable(src, dst.node_id)) || chance(_profile.drop)) {
+        ++_stats.dropped;
+        return; // lost on the wire, sender doesn't know
+    }
+    if(chance(_profile.duplicate)) {
+        ++_stats.duplicated;
+        schedule(dst, Message(msg));
+    }
+    schedule(dst, std::move(msg));
+}
+
+void Link::release_waiting(uintptr_t src, Mailbox &dst) {
+    while(!dst.waiting.empty() && has_credit(src, dst)) {
+        transmit(src, dst, std::move(dst.waiting.front()));
+        dst.waiting.pop_front();
+    }
+}
+
 void Link::on_tick() {
+    PBFT_PROFILE_NODE(reinterpret_cast<uintptr_t>(this), "Link");
+    if(_profile.bandwidth > 0) {
+        first.backlog -= std::min(first.backlog, _profile.bandwidth);
+        second.backlog -= std::min(second.backlog, _profile.bandwidth);
+    }
+    release_waiting(second.node_id, first);
+    release_waiting(first.node_id, second);
     process_messages(second.node_id, first);
     process_messages(first.node_id, second);
 }
 
+void Link::set_profile(LinkProfile const &p, uint64_t seed) {
+    _profile = p;
+    _rng.seed(seed);
+}
+
+void Link::schedule(Mailbox &dst, Message &&msg) {
+    auto size = wire_size(msg);
+    _stats.bytes += size;
+    if(_profile.bandwidth > 0) {
+        dst.backlog += size;
+        // The frame leaves the wire when everything queued before it and itself are transmitted
+        msg.deliver_timeout += static_cast<int>((dst.backlog + _profile.bandwidth - 1) / _profile.bandwidth - 1);
+    }
+    msg.deliver_timeout += static_cast<int>(_profile.latency + jitter());
+    dst.inbox.push_back(std::move(msg));
+}
+
+uint32_t Link::jitter() {
+    if(_profile.jitter == 0)
+        return 0;
+    double j = _profile.jitter;
+    switch(_profile.jitter_dist) {
+    case LinkProfile::Jitter::Uniform:
+        return std::uniform_int_distribution<uint32_t>(0, _profile.jitter)(_rng);
+    case LinkProfile::Jitter::Normal:
+        return static_cast<uint32_t>(std::lround(std::abs(std::normal_distribution<double>(0.0, j)(_rng))));
+    case LinkProfile::Jitter::Exponential:
+        return static_cast<uint32_t>(std::lround(std::exponential_distribution<double>(1.0 / j)(_rng)));
+    }
+    return 0; // happy gcc
+}
+
+bool Link::chance(double p) {
+    return p > 0.0 && std::uniform_real_distribution<double>(0.0, 1.0)(_rng) < p;
+}
+
+// Messages which arrived are held in the link while the node's inbox is full, the rest
+// of the wire keeps going meanwhile
 void Link::process_messages(uintptr_t src, Mailbox &dst) {
+    auto node_ptr = dst.node.lock();
     for(auto it = dst.inbox.begin(); it != dst.inbox.end(); ) {
         if(it->deliver_timeout > 0) {
             --it->deliver_timeout;
             ++it;
+        } else if(node_ptr == nullptr) {
+            dst.inbox.clear();
+            dst.waiting.clear();
+            return;
+        } else if(node_ptr->full()) {
+            ++it;
         } else {
-            auto node_ptr = dst.node.lock();
-            if(node_ptr == nullptr) {
-                dst.inbox.clear();
-                return;
-            }
             node_ptr->put(src, std::move(*it));
             it = dst.inbox.erase(it);
         }
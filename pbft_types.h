@@ -1,23 +1,42 @@
 #pragma once
 
+#include <array>
 #include <memory>
 #include <map>
 #include <list>
+#include <vector>
 #include <iostream>
 #include <cassert>
+#include <random>
 
 using Digest = uint64_t;
 using Signature = uint64_t;
+using PayloadDigest = std::array<uint8_t, 32>; // SHA-256
+using Bytes = std::vector<uint8_t>;
+using Buffer = std::shared_ptr<Bytes const>;
+
+class Payloads;
 
 
 // Common Message structure, includes all possible message types, both user and service ones
 
 struct Message {
-    enum class Type { Write, WriteAck, Read, ReadAck, Response, PrePrepare, Prepare, Commit };
+    enum class Type { Write, WriteAck, Read, ReadAck, Kv, KvAck, Response, PrePrepare, Prepare, Commit, ViewChange, NewView,
+                      PrepareCertificate, CommitCertificate, Busy, Lease, Decision, SpecCommit, LocalCommit, Fetch };
     Type type;
 
+    // Opaque bytes of a request or response, by their digest and size. Size 0 is no
+    // payload. The bytes go in `Message::payload` of the messages which carry them.
+    struct Payload {
+        PayloadDigest digest;
+        uint32_t size;
+    };
+
+    // Requests carry the client's timestamp, increasing per client; 0 means not stamped
     struct WriteOpRequest {
         int value;
+        uint64_t timestamp = 0;
+        Payload payload = {};
     };
     struct WriteOpResponse { // IRL it'd be two different messages: ack and nack btw
         bool success;
@@ -25,10 +44,42 @@ struct Message {
     };
     struct ReadOpRequest {
         size_t index;
+        uint64_t timestamp = 0;
     };
     struct ReadOpResponse {
         bool success;
         int value;
+        Payload payload = {}; // of the write read
+    };
+
+    // Key-value transaction: up to `max_ops` operations executed atomically in one ordered
+    // request. A failed Cas aborts it, nothing is applied then.
+    struct KvOp {
+        enum class Code : uint8_t { Get, Put, Delete, Cas, Scan };
+        Code code;
+        uint8_t count;     // Scan: at most this many pairs with keys from `key` on
+        uint64_t key;
+        int64_t value;     // Put, Cas: the new value
+        int64_t expected;  // Cas
+    };
+    struct KvRequest {
+        enum : uint8_t { max_ops = 4 };
+        uint8_t size;
+        KvOp ops[max_ops];
+        uint64_t timestamp = 0;
+    };
+    // Get, Delete: the value, if found. Put: the new value. Cas: the value after it,
+    // `found` tells it's swapped. Scan: a result per pair.
+    struct KvResult {
+        uint64_t key;
+        int64_t value;
+        bool found;
+    };
+    struct KvResponse {
+        enum : uint8_t { max_results = 8 };
+        bool success;
+        uint8_t size;
+        KvResult results[max_results];
     };
 
     // Operational request. Might be encapsulated in Message.
@@ -37,14 +88,25 @@ struct Message {
         OpRequestData(WriteOpRequest &&msg) : write(std::move(msg)) {}
         OpRequestData(ReadOpRequest const &msg) : read(msg) {}
         OpRequestData(ReadOpRequest &&msg) : read(std::move(msg)) {}
+        OpRequestData(KvRequest const &msg) : kv(msg) {}
+        OpRequestData(KvRequest &&msg) : kv(std::move(msg)) {}
         WriteOpRequest write;
         ReadOpRequest read;
+        KvRequest kv;
     };
     struct OpRequestMessage {
         OpRequestMessage(WriteOpRequest const &msg) : type(Type::Write), data(msg) {}
         OpRequestMessage(WriteOpRequest &&msg) : type(Type::Write), data(std::move(msg)) {}
         OpRequestMessage(ReadOpRequest const &msg) : type(Type::Read), data(msg) {}
         OpRequestMessage(ReadOpRequest &&msg) : type(Type::Read), data(std::move(msg)) {}
+        OpRequestMessage(KvRequest const &msg) : type(Type::Kv), data(msg) {}
+        OpRequestMessage(KvRequest &&msg) : type(Type::Kv), data(std::move(msg)) {}
+        uint64_t timestamp() const {
+            return type == Type::Write ? data.write.timestamp : type == Type::Read ? data.read.timestamp : data.kv.timestamp;
+        }
+        void stamp(uint64_t t) {
+            (type == Type::Write ? data.write.timestamp : type == Type::Read ? data.read.timestamp : data.kv.timestamp) = t;
+        }
         Type type;
         OpRequestData data;
     };
@@ -53,18 +115,26 @@ struct Message {
     union OpResponseData {
         OpResponseData(WriteOpResponse &&msg) : write_ack(std::move(msg)) {}
         OpResponseData(ReadOpResponse &&msg) : read_ack(std::move(msg)) {}
+        OpResponseData(KvResponse &&msg) : kv_ack(std::move(msg)) {}
         WriteOpResponse write_ack;
         ReadOpResponse read_ack;
+        KvResponse kv_ack;
     };
     struct OpResponseMessage {
         OpResponseMessage(WriteOpResponse &&msg) : type(Type::WriteAck), data(std::move(msg)) {}
         OpResponseMessage(ReadOpResponse &&msg) : type(Type::ReadAck), data(std::move(msg)) {}
+        OpResponseMessage(KvResponse &&msg) : type(Type::KvAck), data(std::move(msg)) {}
         Type type;
         OpResponseData data;
     };
     struct Response {
         OpResponseMessage msg;
         Signature sig;
+        uint64_t timestamp = 0; // of the request
+        bool leased = false;    // read answered by the primary alone, under the lease of `view`
+        uint32_t view = 0;
+        uint32_t req_id = 0;    // speculative: executed as `req_id`, with `history` after it
+        Digest history = 0;     // 0 if not speculative
     };
 
 
@@ -74,14 +144,110 @@ struct Message {
         uintptr_t client;
         uint32_t view;
         uint32_t req_id;
+        Digest history = 0; // speculative: of the primary after this request
     };
 
+    // `vote` is the sender's signature of the vote, the phase and the instance with the
+    // request, so the vote can be checked in a certificate without the message
     struct Prepare : PrePrepare {
-        Prepare(PrePrepare &&msg) : PrePrepare(std::move(msg)) {}
+        Prepare(PrePrepare &&msg, Signature vote) : PrePrepare(std::move(msg)), vote(vote) {}
+        Signature vote;
     };
 
     struct Commit : Prepare {
-        Commit(Prepare &&msg) : Prepare(std::move(msg)) {}
+        Commit(PrePrepare &&msg, Signature vote) : Prepare(std::move(msg), vote) {}
+    };
+
+    // Quorum of Prepare or Commit votes. `voters` is the bitmap of replica indexes which
+    // voted, `votes` is the aggregate of their vote signatures.
+    struct Certificate : PrePrepare {
+        Certificate(PrePrepare &&msg, uint64_t voters, Signature votes) : PrePrepare(std::move(msg)), voters(voters), votes(votes) {}
+        uint64_t voters;
+        Signature votes;
+    };
+
+    struct PrepareCertificate : Certificate {
+        using Certificate::Certificate;
+    };
+
+    struct CommitCertificate : Certificate {
+        using Certificate::Certificate;
+    };
+
+    // Committed request with its commit certificate, from a replica to learners
+    struct Decision : Certificate {
+        using Certificate::Certificate;
+    };
+
+    // Commit certificate without the request: `request` is its digest with the client
+    struct Proof {
+        uint32_t view;
+        uint32_t req_id;     // 0 is nothing committed
+        Digest request;
+        uint64_t voters;
+        Signature votes;
+    };
+
+    // View change messages. ViewChange is signed by the sender, replica `replica` in
+    // the list, so the new primary may pass it on. It proves the last commit of the
+    // sender, and the prepared proposal with its prepare certificate.
+    struct ViewChange {
+        uint32_t view;        // the view to move to
+        uint32_t replica;
+        Proof committed;
+        bool prepared;        // sender has prepared `proposal`, but not committed it yet
+        Certificate proposal;
+        uint64_t heavy;       // adaptive weighted voting: the replicas the sender would make heavy
+        Signature sig;
+    };
+
+    // `senders` is the bitmap of replicas whose ViewChange-s make the view, replicas
+    // check `committed` and the proposal against them
+    struct NewView {
+        uint32_t view;
+        uint32_t committed;  // the view continues after this req_id
+        bool prepared;       // `proposal` is re-proposed in the new view
+        PrePrepare proposal;
+        uint64_t senders;
+        uint64_t heavy = 0;  // weighted voting: heavy replicas of the view, derived from the ViewChange-s
+    };
+
+    // The primary's admission window is full, the request isn't taken. Goes to the
+    // client and to replicas, which drop the request too.
+    struct Busy {
+        uintptr_t client;
+        uint64_t timestamp;
+        uint32_t view;
+    };
+
+    // Read lease of the primary. The primary sends it stamped by its clock, a replica
+    // echoes it back when it grants the lease.
+    struct Lease {
+        uint32_t view;
+        uint64_t stamp;
+    };
+
+    // Speculative mode. The client certifies 2f+1 matching speculative responses,
+    // `voters` is the bitmap of replicas which sent them; a replica which has the same
+    // history confirms it to the client.
+    struct SpecCommit {
+        uint64_t timestamp;
+        uint32_t view;
+        uint32_t req_id;
+        Digest history;
+        uint64_t voters;
+    };
+
+    struct LocalCommit {
+        uint64_t timestamp;
+        uint32_t view;
+        uint32_t req_id;
+        Digest history;
+    };
+
+    // Catch-up: asks a replica for the Decision-s of requests from `from` on
+    struct Fetch {
+        uint32_t from;
     };
 
     union Data {
@@ -93,12 +259,26 @@ struct Message {
             case Type::Read:
                 read = std::move(msg.data.read);
                 break;
+            case Type::Kv:
+                kv = std::move(msg.data.kv);
+                break;
             case Type::WriteAck:
             case Type::ReadAck:
+            case Type::KvAck:
             case Type::Response:
             case Type::Prepare:
             case Type::PrePrepare:
             case Type::Commit:
+            case Type::ViewChange:
+            case Type::NewView:
+            case Type::PrepareCertificate:
+            case Type::CommitCertificate:
+            case Type::Busy:
+            case Type::Lease:
+            case Type::Decision:
+            case Type::SpecCommit:
+            case Type::LocalCommit:
+            case Type::Fetch:
                 assert(not("Unreachable"));
             }
         }
@@ -110,12 +290,26 @@ struct Message {
             case Type::ReadAck:
                 read_ack = std::move(msg.data.read_ack);
                 break;
+            case Type::KvAck:
+                kv_ack = std::move(msg.data.kv_ack);
+                break;
             case Type::Write:
             case Type::Read:
+            case Type::Kv:
             case Type::Response:
             case Type::Prepare:
             case Type::PrePrepare:
             case Type::Commit:
+            case Type::ViewChange:
+            case Type::NewView:
+            case Type::PrepareCertificate:
+            case Type::CommitCertificate:
+            case Type::Busy:
+            case Type::Lease:
+            case Type::Decision:
+            case Type::SpecCommit:
+            case Type::LocalCommit:
+            case Type::Fetch:
                 assert(not("Unreachable"));
             }
         }
@@ -123,25 +317,51 @@ struct Message {
         Data(ReadOpRequest &&msg) : read(std::move(msg)) {}
         Data(WriteOpResponse &&msg) : write_ack(std::move(msg)) {}
         Data(ReadOpResponse &&msg) : read_ack(std::move(msg)) {}
+        Data(KvRequest &&msg) : kv(std::move(msg)) {}
+        Data(KvResponse &&msg) : kv_ack(std::move(msg)) {}
         Data(Response &&msg) : response(std::move(msg)) {}
         Data(PrePrepare &&msg) : preprepare(std::move(msg)) {}
         Data(Prepare &&msg) : prepare(std::move(msg)) {}
         Data(Commit &&msg) : commit(std::move(msg)) {}
+        Data(ViewChange &&msg) : view_change(std::move(msg)) {}
+        Data(NewView &&msg) : new_view(std::move(msg)) {}
+        Data(PrepareCertificate &&msg) : prepare_certificate(std::move(msg)) {}
+        Data(CommitCertificate &&msg) : commit_certificate(std::move(msg)) {}
+        Data(Busy &&msg) : busy(std::move(msg)) {}
+        Data(Lease &&msg) : lease(std::move(msg)) {}
+        Data(Decision &&msg) : decision(std::move(msg)) {}
+        Data(SpecCommit &&msg) : spec_commit(std::move(msg)) {}
+        Data(LocalCommit &&msg) : local_commit(std::move(msg)) {}
+        Data(Fetch &&msg) : fetch(std::move(msg)) {}
 
         WriteOpRequest write;
         ReadOpRequest read;
         WriteOpResponse write_ack;
         ReadOpResponse read_ack;
+        KvRequest kv;
+        KvResponse kv_ack;
         Response response;
         PrePrepare preprepare;
         Prepare prepare;
         Commit commit;
+        ViewChange view_change;
+        NewView new_view;
+        PrepareCertificate prepare_certificate;
+        CommitCertificate commit_certificate;
+        Busy busy;
+        Lease lease;
+        Decision decision;
+        SpecCommit spec_commit;
+        LocalCommit local_commit;
+        Fetch fetch;
     };
 
     Message(WriteOpRequest &&msg) : type(Type::Write), data(std::move(msg)) {}
     Message(ReadOpRequest &&msg) : type(Type::Read), data(std::move(msg)) {}
     Message(WriteOpResponse &&msg) : type(Type::WriteAck), data(std::move(msg)) {}
     Message(ReadOpResponse &&msg) : type(Type::ReadAck), data(std::move(msg)) {}
+    Message(KvRequest &&msg) : type(Type::Kv), data(std::move(msg)) {}
+    Message(KvResponse &&msg) : type(Type::KvAck), data(std::move(msg)) {}
     Message(OpRequestMessage &&msg) : type(msg.type), data(std::move(msg)) {}
     Message(OpRequestMessage const &msg) : type(msg.type), data(OpRequestMessage{msg}) {}
     Message(OpResponseMessage &&msg) : type(msg.type), data(std::move(msg)) {}
@@ -150,13 +370,62 @@ struct Message {
     Message(PrePrepare &&msg) : type(Type::PrePrepare), data(std::move(msg)) {}
     Message(Prepare &&msg) : type(Type::Prepare), data(std::move(msg)) {}
     Message(Commit &&msg) : type(Type::Commit), data(std::move(msg)) {}
+    Message(ViewChange &&msg) : type(Type::ViewChange), data(std::move(msg)) {}
+    Message(NewView &&msg) : type(Type::NewView), data(std::move(msg)) {}
+    Message(PrepareCertificate &&msg) : type(Type::PrepareCertificate), data(std::move(msg)) {}
+    Message(CommitCertificate &&msg) : type(Type::CommitCertificate), data(std::move(msg)) {}
+    Message(Busy &&msg) : type(Type::Busy), data(std::move(msg)) {}
+    Message(Lease &&msg) : type(Type::Lease), data(std::move(msg)) {}
+    Message(Decision &&msg) : type(Type::Decision), data(std::move(msg)) {}
+    Message(SpecCommit &&msg) : type(Type::SpecCommit), data(std::move(msg)) {}
+    Message(LocalCommit &&msg) : type(Type::LocalCommit), data(std::move(msg)) {}
+    Message(Fetch &&msg) : type(Type::Fetch), data(std::move(msg)) {}
     Message(Message&&) = default;
     Message(Message const &) = default;
 
     Data data;
     int deliver_timeout = 0; // in ticks
+    Buffer payload; // bytes of the request or response carried, see `payload.h`
+};
+
+// Size of the message on the wire, in bytes
+size_t wire_size(Message const &msg);
+
+
+// How a link behaves on the wire. Default profile is the ideal network: delivery in the
+// next tick, unlimited bandwidth, no losses.
+
+struct LinkProfile {
+    enum class Jitter { Uniform, Normal, Exponential };
+
+    uint32_t latency = 0;   // extra one-way delay, in ticks
+    uint32_t jitter = 0;    // in ticks: range for Uniform, stddev for Normal, mean for Exponential
+    Jitter jitter_dist = Jitter::Uniform;
+    uint64_t bandwidth = 0; // bytes per tick in each direction, 0 is unlimited
+    double drop = 0.0;      // probabilities
+    double duplicate = 0.0;
+    // Credit-based flow control, 0 is unlimited. The receiver grants `window` credits:
+    // messages on the wire plus delivered ones it hasn't taken yet. Without credits
+    // messages wait at the sender, at most `queue` of them (0 is unlimited), then sends fail.
+    uint32_t window = 0;
+    uint32_t queue = 0;
+};
+
+
+// Splits nodes into groups which cannot talk to each other. Nodes which are not in
+// any group reach everyone, so clients may be left out when only replicas are split.
+
+class Partitions {
+public:
+    void split(std::vector<std::vector<uintptr_t>> const &groups);
+    void heal() { _group.clear(); }
+    bool reachable(uintptr_t a, uintptr_t b) const;
+
+private:
+    std::map<uintptr_t, size_t> _group;
 };
 
+
 // Node::id() is a way to identify the node. IRL it might be ip address or so on
 
 // Destroying of the node doesn't cause breaking its links. I.e. other ends still
@@ -164,24 +433,54 @@ struct Message {
 
 class Link;
 
+// Delivers messages straight to the receiver's inbox instead of the link, e.g. the threaded
+// runtime. Links still tell who may talk to whom. Called on the sender's thread.
+struct Transport {
+    virtual ~Transport() = default;
+    virtual bool deliver(uintptr_t src, uintptr_t dst, Message &&msg) = 0;
+};
+
+
 class Node : public std::enable_shared_from_this<Node> {
 public:
+    struct Traffic {
+        uint64_t messages = 0, bytes = 0;
+    };
+
     virtual ~Node() = default;
     uintptr_t id() const;
     bool has_link(uintptr_t node) const;
     virtual void on_tick() {};
+    Traffic const &sent() const { return _sent; } // egress, accepted by links
+    // Links hold messages back while the inbox is full, 0 is unlimited
+    void set_inbox_capacity(size_t c) { _inbox_capacity = c; }
+    // nullptr sends over links
+    void set_transport(Transport *t) { _transport = t; }
+    // Payload bytes the node has. It takes them from messages it gets and attaches them
+    // to messages it sends, see `payload.h`. Lanes of a replica share them.
+    Payloads &payloads();
+    void share_payloads(Node &other);
 
 protected:
-    auto take_inbox() { decltype(_inbox) inbox; std::swap(inbox, _inbox); return inbox; }
+    auto take_inbox() { decltype(_inbox) inbox; std::swap(inbox, _inbox); _queued.clear(); return inbox; }
     bool unlink(uintptr_t node, bool interlink = true);
     bool send_to(uintptr_t node, Message &&msg);
     void broadcast(Message &&msg);
+    void multicast(std::vector<uintptr_t> const &nodes, Message &&msg);
 
 private:
     void link(uintptr_t node, std::shared_ptr<Link> const &link);
     void put(uintptr_t src_id, Message &&msg);
+    bool send(Link &link, uintptr_t node, Message &&msg);
+    bool full() const { return _inbox_capacity != 0 && _inbox.size() >= _inbox_capacity; }
+    size_t queued(uintptr_t src_id) const { auto it = _queued.find(src_id); return it == _queued.end() ? 0 : it->second; }
 
     std::map<uintptr_t, std::weak_ptr<Link>> _links;
+    std::map<uintptr_t, size_t> _queued; // messages in the inbox by sender, they hold link credits
+    size_t _inbox_capacity = 0;
+    Transport *_transport = nullptr;
+    Traffic _sent;
+    std::shared_ptr<Payloads> _payloads;
     std::list<std::pair<uintptr_t, Message>> _inbox; // Messages are supposed to be processed in the next `on_tick`
 
 public:
@@ -194,20 +493,37 @@ public:
         Node &_this;
     };
     friend class Link;
+    friend class Runtime;
 };
 
 
 // The owner of link absraction. When destroyed, notifies nodes, and at this point
 // them cannot send messages each other.
+// Network profile adds delay to message's own `deliver_timeout`. Frames are serialized
+// one after another when bandwidth is limited. Losses, duplicates and partitions are
+// decided at send time, from the link's own seeded random generator.
+// With flow control a message goes on the wire only when the receiver has granted a
+// credit, otherwise it waits at the sender's end.
 
 class Link{
 public:
+    struct Stats {
+        uint64_t sent = 0, dropped = 0, duplicated = 0, bytes = 0;
+        uint64_t deferred = 0, rejected = 0; // waited for credits, didn't fit the sender's queue
+    };
+
     static std::shared_ptr<Link> make(std::shared_ptr<Node> const &first, std::shared_ptr<Node> const &second);
     ~Link();
     void release(uintptr_t src_id);
     bool send(uintptr_t dst_id, Message &&msg);
     void on_tick();
 
+    void set_profile(LinkProfile const &p, uint64_t seed);
+    void set_partitions(std::shared_ptr<Partitions> const &p) { _partitions = p; }
+    std::pair<uintptr_t, uintptr_t> nodes() const { return {first.node_id, second.node_id}; }
+    LinkProfile const &profile() const { return _profile; }
+    Stats const &stats() const { return _stats; }
+
 private:
     Link(std::shared_ptr<Node> const &first, std::shared_ptr<Node> const &second) : first(first), second(second) {}
     struct Mailbox {
@@ -215,6 +531,8 @@ private:
         uintptr_t node_id;
         std::weak_ptr<Node> node;
         std::list<Message> inbox; // messages in the link (channel, wire, whatever), not yet delivered to the `node`
+        std::list<Message> waiting; // for credits, not on the wire yet
+        uint64_t backlog = 0; // bytes not yet pushed to the wire
     };
     struct Destinations {
         Mailbox &src, &dst;
@@ -224,8 +542,18 @@ private:
     Destinations get_dst(uintptr_t id);
     void unlink(Mailbox &a, Mailbox &b);
     void process_messages(uintptr_t src, Mailbox &dst);
+    bool has_credit(uintptr_t src, Mailbox &dst) const;
+    void transmit(uintptr_t src, Mailbox &dst, Message &&msg);
+    void release_waiting(uintptr_t src, Mailbox &dst);
+    void schedule(Mailbox &dst, Message &&msg);
+    uint32_t jitter();
+    bool chance(double p);
 
     Mailbox first, second;
+    LinkProfile _profile;
+    std::mt19937_64 _rng;
+    std::shared_ptr<Partitions> _partitions;
+    Stats _stats;
 
 public:
     struct test_interface {
@@ -238,12 +566,13 @@ public:
 
 template<typename Stream>
 Stream &operator<<(Stream &os, Message::WriteOpRequest const &m) {
-    return os << "value=" << m.value;
+    os << "value=" << m.value << ", t=" << m.timestamp;
+    return m.payload.size ? os << ", payload=" << m.payload.size : os;
 }
 
 template<typename Stream>
 Stream &operator<<(Stream &os, Message::ReadOpRequest const &m) {
-    return os << "index=" << m.index;
+    return os << "index=" << m.index << ", t=" << m.timestamp;
 }
 
 template<typename Stream>
@@ -253,7 +582,33 @@ Stream &operator<<(Stream &os, Message::WriteOpResponse const &m) {
 
 template<typename Stream>
 Stream &operator<<(Stream &os, Message::ReadOpResponse const &m) {
-    return os << "success=" << m.success << ", value=" << m.value;
+    os << "success=" << m.success << ", value=" << m.value;
+    return m.payload.size ? os << ", payload=" << m.payload.size : os;
+}
+
+template<typename Stream>
+Stream &operator<<(Stream &os, Message::KvRequest const &m) {
+    static char const *names[] = {"get", "put", "delete", "cas", "scan"};
+    for(uint8_t i = 0; i < m.size; ++i) {
+        auto const &op = m.ops[i];
+        os << (i ? ", " : "") << names[static_cast<int>(op.code)] << " " << op.key;
+        if(op.code == Message::KvOp::Code::Put || op.code == Message::KvOp::Code::Cas)
+            os << "=" << op.value;
+        if(op.code == Message::KvOp::Code::Scan)
+            os << "+" << int(op.count);
+    }
+    return os << ", t=" << m.timestamp;
+}
+
+template<typename Stream>
+Stream &operator<<(Stream &os, Message::KvResponse const &m) {
+    os << "success=" << m.success;
+    for(uint8_t i = 0; i < m.size; ++i) {
+        os << ", " << m.results[i].key;
+        if(m.results[i].found)
+            os << "=" << m.results[i].value;
+    }
+    return os;
 }
 
 template<typename Stream>
@@ -266,6 +621,56 @@ Stream &operator<<(Stream &os, Message::PrePrepare const &m) {
     return os << m.view << ":" << m.req_id << ", " << Message(m.msg);
 }
 
+template<typename Stream>
+Stream &operator<<(Stream &os, Message::Certificate const &m) {
+    return os << static_cast<Message::PrePrepare const &>(m) << ", voters=" << std::hex << m.voters << std::dec;
+}
+
+template<typename Stream>
+Stream &operator<<(Stream &os, Message::Proof const &m) {
+    return os << m.view << ":" << m.req_id << ", voters=" << std::hex << m.voters << std::dec;
+}
+
+template<typename Stream>
+Stream &operator<<(Stream &os, Message::ViewChange const &m) {
+    os << "view=" << m.view << ", replica=" << m.replica << ", committed=" << m.committed;
+    if(m.prepared)
+        os << ", prepared=" << m.proposal;
+    if(m.heavy != 0)
+        os << ", heavy=" << std::hex << m.heavy << std::dec;
+    return os;
+}
+
+template<typename Stream>
+Stream &operator<<(Stream &os, Message::NewView const &m) {
+    os << "view=" << m.view << ", committed=" << m.committed;
+    if(m.prepared)
+        os << ", proposal=" << m.proposal;
+    return os << ", senders=" << std::hex << m.senders << ", heavy=" << m.heavy << std::dec;
+}
+
+template<typename Stream>
+Stream &operator<<(Stream &os, Message::Busy const &m) {
+    return os << "view=" << m.view << ", client=" << m.client << ", t=" << m.timestamp;
+}
+
+template<typename Stream>
+Stream &operator<<(Stream &os, Message::Lease const &m) {
+    return os << "view=" << m.view << ", stamp=" << m.stamp;
+}
+
+template<typename Stream>
+Stream &operator<<(Stream &os, Message::SpecCommit const &m) {
+    return os << "view=" << m.view << ", req_id=" << m.req_id << ", t=" << m.timestamp << ", history=" << std::hex
+              << m.history << ", voters=" << m.voters << std::dec;
+}
+
+template<typename Stream>
+Stream &operator<<(Stream &os, Message::LocalCommit const &m) {
+    return os << "view=" << m.view << ", req_id=" << m.req_id << ", t=" << m.timestamp << ", history=" << std::hex
+              << m.history << std::dec;
+}
+
 template<typename Stream>
 Stream &operator<<(Stream &os, Message const &m) {
     switch(m.type) {
@@ -277,6 +682,10 @@ Stream &operator<<(Stream &os, Message const &m) {
         return os << "WriteAck{" << m.data.write_ack << "}";
     case Message::Type::ReadAck:
         return os << "ReadAck{" << m.data.read_ack << "}";
+    case Message::Type::Kv:
+        return os << "Kv{" << m.data.kv << "}";
+    case Message::Type::KvAck:
+        return os << "KvAck{" << m.data.kv_ack << "}";
     case Message::Type::Response:
         return os << "Response{" << m.data.response << "}";
     case Message::Type::PrePrepare:
@@ -285,6 +694,73 @@ Stream &operator<<(Stream &os, Message const &m) {
         return os << "Prepare{" << m.data.prepare << "}";
     case Message::Type::Commit:
         return os << "Commit{" << m.data.commit << "}";
+    case Message::Type::ViewChange:
+        return os << "ViewChange{" << m.data.view_change << "}";
+    case Message::Type::NewView:
+        return os << "NewView{" << m.data.new_view << "}";
+    case Message::Type::PrepareCertificate:
+        return os << "PrepareCertificate{" << m.data.prepare_certificate << "}";
+    case Message::Type::CommitCertificate:
+        return os << "CommitCertificate{" << m.data.commit_certificate << "}";
+    case Message::Type::Busy:
+        return os << "Busy{" << m.data.busy << "}";
+    case Message::Type::Lease:
+        return os << "Lease{" << m.data.lease << "}";
+    case Message::Type::Decision:
+        return os << "Decision{" << m.data.decision << "}";
+    case Message::Type::SpecCommit:
+        return os << "SpecCommit{" << m.data.spec_commit << "}";
+    case Message::Type::LocalCommit:
+        return os << "LocalCommit{" << m.data.local_commit << "}";
+    case Message::Type::Fetch:
+        return os << "Fetch{from=" << m.data.fetch.from << "}";
     }
     return os; // happy gcc
 }
+
+// The type's name, a literal
+inline char const *type_name(Message::Type t) {
+    switch(t) {
+    case Message::Type::Write:
+        return "Write";
+    case Message::Type::Read:
+        return "Read";
+    case Message::Type::WriteAck:
+        return "WriteAck";
+    case Message::Type::ReadAck:
+        return "ReadAck";
+    case Message::Type::Kv:
+        return "Kv";
+    case Message::Type::KvAck:
+        return "KvAck";
+    case Message::Type::Response:
+        return "Response";
+    case Message::Type::PrePrepare:
+        return "PrePrepare";
+    case Message::Type::Prepare:
+        return "Prepare";
+    case Message::Type::Commit:
+        return "Commit";
+    case Message::Type::ViewChange:
+        return "ViewChange";
+    case Message::Type::NewView:
+        return "NewView";
+    case Message::Type::PrepareCertificate:
+        return "PrepareCertificate";
+    case Message::Type::CommitCertificate:
+        return "CommitCertificate";
+    case Message::Type::Busy:
+        return "Busy";
+    case Message::Type::Lease:
+        return "Lease";
+    case Message::Type::Decision:
+        return "Decision";
+    case Message::Type::SpecCommit:
+        return "SpecCommit";
+    case Message::Type::LocalCommit:
+        return "LocalCommit";
+    case Message::Type::Fetch:
+        return "Fetch";
+    }
+    return ""; // happy gcc
+}
@@ -0,0 +1,211 @@
+#pragma once
+
+#include <map>
+#include <algorithm>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <cstdint>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+// CPU time by code region, per node. Counted only when built with PBFT_PROFILE, otherwise
+// the macros below are empty. A node's tick opens the node's tree (PBFT_PROFILE_NODE),
+// scopes within it (PBFT_PROFILE_SCOPE) are frames of the tree: the handler of a message
+// type, verify, digest, send, execute... A frame counts cycles (rdtsc, the steady clock
+// where there's none) and calls, its children's cycles are part of its own. Frames are
+// told apart by the address of the name, so names are literals. A scope outside of any
+// tree isn't counted, e.g. on execution stage threads. A tree is written only by the
+// thread ticking its owner and read when nobody ticks.
+
+namespace profile {
+
+inline uint64_t cycles() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return static_cast<uint64_t>(std::chrono::steady_clock::now().time_since_epoch().count());
+#endif
+}
+
+struct Frame {
+    Frame(char const *n, size_t p) : name(n), parent(p) {}
+
+    char const *name;
+    size_t parent;
+    uint64_t cycles = 0, calls = 0;
+    std::vector<size_t> children;
+};
+
+class Tree {
+public:
+    Tree() { _frames.emplace_back("", 0); } // the root, it counts nothing
+
+    size_t child(size_t parent, char const *name) {
+        for(auto c : _frames[parent].children)
+            if(_frames[c].name == name)
+                return c;
+        _frames.emplace_back(name, parent);
+        _frames[parent].children.push_back(_frames.size() - 1);
+        return _frames.size() - 1;
+    }
+
+    Frame &frame(size_t i) { return _frames[i]; }
+    std::vector<Frame> const &frames() const { return _frames; }
+
+    // Cycles of the frame itself, not of its children
+    uint64_t self(size_t i) const {
+        auto s = _frames[i].cycles;
+        for(auto c : _frames[i].children)
+            s -= std::min(s, _frames[c].cycles);
+        return s;
+    }
+
+    // Names from the root down, ';' separated
+    std::string path(size_t i) const {
+        std::string p = _frames[i].name;
+        for(i = _frames[i].parent; i != 0; i = _frames[i].parent)
+            p = _frames[i].name + (';' + p);
+        return p;
+    }
+
+private:
+    std::vector<Frame> _frames;
+};
+
+// Trees by owner: the node's or link's id
+class Registry {
+public:
+    static Tree &tree(uintptr_t owner) {
+        std::lock_guard<std::mutex> lock(mutex());
+        return trees()[owner];
+    }
+
+    // Forgets what the previous owner of the id counted
+    static void erase(uintptr_t owner) {
+        std::lock_guard<std::mutex> lock(mutex());
+        trees().erase(owner);
+    }
+
+    static std::map<uintptr_t, Tree> snapshot() {
+        std::lock_guard<std::mutex> lock(mutex());
+        return trees();
+    }
+
+private:
+    static std::mutex &mutex() {
+        static std::mutex m;
+        return m;
+    }
+
+    static std::map<uintptr_t, Tree> &trees() {
+        static std::map<uintptr_t, Tree> t;
+        return t;
+    }
+};
+
+struct Context {
+    Tree *tree = nullptr;
+    size_t frame = 0;
+};
+
+inline Context &context() {
+    static thread_local Context c;
+    return c;
+}
+
+class Scope {
+public:
+    explicit Scope(char const *name) : _tree(context().tree) {
+        if(_tree == nullptr)
+            return;
+        auto &c = context();
+        _parent = c.frame;
+        c.frame = _tree->child(_parent, name);
+        _start = cycles();
+    }
+
+    ~Scope() {
+        if(_tree == nullptr)
+            return;
+        auto &c = context();
+        auto &f = _tree->frame(c.frame);
+        f.cycles += cycles() - _start;
+        ++f.calls;
+        c.frame = _parent;
+    }
+
+    Scope(Scope const &) = delete;
+    Scope &operator=(Scope const &) = delete;
+
+private:
+    Tree *_tree;
+    size_t _parent = 0;
+    uint64_t _start = 0;
+};
+
+// Opens the owner's tree with the root frame `name`, restores the outer one after
+class NodeScope {
+public:
+    NodeScope(uintptr_t owner, char const *name) : _restore{enter(owner)}, _scope(name) {}
+
+private:
+    struct Restore {
+        Context saved;
+        ~Restore() { context() = saved; }
+    };
+
+    static Context enter(uintptr_t owner) {
+        auto saved = context();
+        context() = Context{&Registry::tree(owner), 0};
+        return saved;
+    }
+
+    Restore _restore;
+    Scope _scope;
+};
+
+// Folded stacks of the named owners, "name;frame;...;frame self-cycles" a line, lines of
+// owners of the same name are summed. For flamegraph.pl, speedscope and the like.
+template<typename Stream>
+void write_folded(Stream &os, std::map<uintptr_t, std::string> const &names) {
+    std::map<std::string, uint64_t> stacks;
+    for(auto const &t : Registry::snapshot()) {
+        auto name = names.find(t.first);
+        if(name == names.end())
+            continue;
+        for(size_t i = 1; i < t.second.frames().size(); ++i)
+            stacks[name->second + ';' + t.second.path(i)] += t.second.self(i);
+    }
+    for(auto const &s : stacks)
+        if(s.second != 0)
+            os << s.first << ' ' << s.second << '\n';
+}
+
+// Self cycles by frame name over the given owners
+inline std::map<std::string, uint64_t> by_frame(std::vector<uintptr_t> const &owners) {
+    std::map<std::string, uint64_t> total;
+    auto trees = Registry::snapshot();
+    for(auto o : owners) {
+        auto t = trees.find(o);
+        if(t == trees.end())
+            continue;
+        for(size_t i = 1; i < t->second.frames().size(); ++i)
+            total[t->second.frames()[i].name] += t->second.self(i);
+    }
+    return total;
+}
+
+} // namespace profile
+
+#ifdef PBFT_PROFILE
+#define PBFT_PROFILE_CAT_(a, b) a##b
+#define PBFT_PROFILE_CAT(a, b) PBFT_PROFILE_CAT_(a, b)
+#define PBFT_PROFILE_SCOPE(name) ::profile::Scope PBFT_PROFILE_CAT(profile_scope_, __LINE__)(name)
+#define PBFT_PROFILE_NODE(owner, name) ::profile::NodeScope PBFT_PROFILE_CAT(profile_scope_, __LINE__)(owner, name)
+#else
+#define PBFT_PROFILE_SCOPE(name)
+#define PBFT_PROFILE_NODE(owner, name)
+#endif
@@ -0,0 +1,86 @@
+#pragma once
+
+#include <map>
+#include <unordered_map>
+#include "pbft_types.h"
+
+// Last request of every client the replica has committed, and the signed response once
+// it's executed. A request with the same timestamp is answered from here without being
+// ordered again, an older one is dropped. At most `capacity` clients are kept, the one
+// which committed least recently is evicted first; its late duplicates would be executed
+// again, so the capacity should cover the active clients. Eviction goes by the commit
+// order, so replicas which committed the same requests evict the same clients and treat
+// a late duplicate alike; `evicted()` tells the capacity is short.
+// Plain copyable value, it's a part of the replica's state a checkpoint carries.
+
+class ReplyCache {
+public:
+    enum class Status { New, Answered, Stale };
+
+    explicit ReplyCache(size_t capacity = 1024) : _capacity(capacity) { assert(capacity > 0); }
+
+    size_t size() const { return _entries.size(); }
+    size_t capacity() const { return _capacity; }
+    uint64_t hits() const { return _hits; }
+    uint64_t evicted() const { return _evicted; }
+
+    // Unstamped requests are always new
+    Status check(uintptr_t client, uint64_t timestamp) const {
+        auto it = _entries.find(client);
+        if(timestamp == 0 || it == _entries.end() || timestamp > it->second.timestamp)
+            return Status::New;
+        if(timestamp == it->second.timestamp && it->second.answered)
+            return Status::Answered;
+        return Status::Stale; // older, or committed and not executed yet
+    }
+
+    // The cached response of Answered request
+    Message::Response const &response(uintptr_t client) {
+        ++_hits;
+        return _entries.at(client).response;
+    }
+
+    // Request is committed, its response comes with `answer`
+    void commit(uintptr_t client, uint64_t timestamp) {
+        if(timestamp == 0)
+            return;
+        auto it = _entries.find(client);
+        if(it == _entries.end()) {
+            if(_entries.size() == _capacity) {
+                _entries.erase(_by_age.begin()->second);
+                _by_age.erase(_by_age.begin());
+                ++_evicted;
+            }
+            it = _entries.emplace(client, Entry{timestamp, 0, false, placeholder()}).first;
+        } else {
+            _by_age.erase(it->second.age);
+        }
+        it->second.timestamp = timestamp;
+        it->second.answered = false;
+        it->second.age = ++_clock;
+        _by_age.emplace(it->second.age, client);
+    }
+
+    void answer(uintptr_t client, Message::Response const &r) {
+        auto it = _entries.find(client);
+        if(r.timestamp == 0 || it == _entries.end() || it->second.timestamp != r.timestamp)
+            return;
+        it->second.response = r;
+        it->second.answered = true;
+    }
+
+private:
+    struct Entry {
+        uint64_t timestamp;
+        uint64_t age;
+        bool answered;
+        Message::Response response;
+    };
+
+    static Message::Response placeholder() { return Message::Response{Message::ReadOpResponse{false, 0}, 0}; }
+
+    size_t _capacity;
+    uint64_t _clock = 0, _hits = 0, _evicted = 0;
+    std::unordered_map<uintptr_t, Entry> _entries;
+    std::map<uint64_t, uintptr_t> _by_age;
+};
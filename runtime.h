@@ -0,0 +1,323 @@
+#pragma once
+
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <unordered_map>
+#include "simulator.h"
+
+#if defined (__linux__)
+#include <ctime>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#else
+#include <mutex>
+#include <condition_variable>
+#endif
+
+// Lock-free unbounded queue for many producer threads and one consumer (Vyukov's list).
+// A producer swaps itself in as the head and links the previous one; until it does, the
+// consumer doesn't see the item, `consume` stops before it while `size` counts it.
+// The list always keeps one consumed cell, the first one is made of `fill`.
+
+template<typename T>
+class MpscQueue {
+public:
+    explicit MpscQueue(T const &fill) : _tail(new Cell(T(fill))) { _head.store(_tail); }
+
+    ~MpscQueue() {
+        while(_tail != nullptr) {
+            auto next = _tail->next.load(std::memory_order_relaxed);
+            delete _tail;
+            _tail = next;
+        }
+    }
+
+    MpscQueue(MpscQueue const &) = delete;
+    MpscQueue &operator=(MpscQueue const &) = delete;
+
+    size_t size() const { return _size.load(std::memory_order_acquire); }
+    bool empty() const { return size() == 0; }
+
+    // true if the queue was empty, the consumer may be asleep
+    bool push(T &&item) {
+        auto cell = new Cell(std::move(item));
+        auto prev = _head.exchange(cell, std::memory_order_acq_rel);
+        prev->next.store(cell, std::memory_order_release);
+        return _size.fetch_add(1, std::memory_order_acq_rel) == 0;
+    }
+
+    // Consumer thread only. Calls f(T&&) for every item ready, returns their number
+    template<typename F>
+    size_t consume(F &&f) {
+        size_t n = 0;
+        for(Cell *next; (next = _tail->next.load(std::memory_order_acquire)) != nullptr; ++n) {
+            f(std::move(next->value));
+            delete _tail;
+            _tail = next;
+            _size.fetch_sub(1, std::memory_order_acq_rel);
+        }
+        return n;
+    }
+
+private:
+    struct Cell {
+        explicit Cell(T &&v) : value(std::move(v)) {}
+        std::atomic<Cell *> next{nullptr};
+        T value;
+    };
+
+    // producers and the consumer on their own cache lines
+    std::atomic<Cell *> _head;
+    char _pad0[64 - sizeof(std::atomic<Cell *>)];
+    Cell *_tail;
+    char _pad1[64 - sizeof(Cell *)];
+    std::atomic<size_t> _size{0};
+};
+
+
+// Sleep of one thread till another one signals or the timeout passes. The waiter takes
+// the sequence number before it checks its condition, a signal coming after that makes
+// `wait` return at once, so no wakeup is lost. A futex on Linux, condvar elsewhere.
+
+class Wakeup {
+public:
+    uint32_t prepare() const { return _seq.load(std::memory_order_acquire); }
+
+    void wait(uint32_t seq, std::chrono::microseconds timeout) {
+#if defined (__linux__)
+        timespec ts{static_cast<time_t>(timeout.count() / 1000000), static_cast<long>(timeout.count() % 1000000 * 1000)};
+        syscall(SYS_futex, reinterpret_cast<uint32_t *>(&_seq), FUTEX_WAIT_PRIVATE, seq, &ts, nullptr, 0);
+#else
+        std::unique_lock<std::mutex> lock(_mutex);
+        _cv.wait_for(lock, timeout, [this, seq] { return _seq.load() != seq; });
+#endif
+    }
+
+    void signal() {
+        _seq.fetch_add(1, std::memory_order_release);
+#if defined (__linux__)
+        syscall(SYS_futex, reinterpret_cast<uint32_t *>(&_seq), FUTEX_WAKE_PRIVATE, 1, nullptr, nullptr, 0);
+#else
+        std::lock_guard<std::mutex> lock(_mutex);
+        _cv.notify_one();
+#endif
+    }
+
+private:
+    std::atomic<uint32_t> _seq{0};
+    static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t), "futex word");
+#if !defined (__linux__)
+    std::mutex _mutex;
+    std::condition_variable _cv;
+#endif
+};
+
+
+// Real-time mode: every node runs on its own thread, senders put messages straight into
+// the receiver's lock-free inbox and wake it only when the inbox was empty. The node
+// thread moves what came into the node's inbox and calls `on_tick`; an idle node ticks
+// every `tick`, so timers still go. A tick is a wakeup here, not a unit of time.
+// Links only tell who is connected: their profiles and flow control don't apply, inboxes
+// are unbounded. Nodes and links are set up before `start` and aren't touched from other
+// threads till `stop`.
+
+class Runtime : public Transport {
+public:
+    struct Stats {
+        uint64_t delivered = 0;
+        uint64_t wakeups = 0;   // signals sent to sleeping inboxes
+        uint64_t ticks = 0;
+    };
+
+    explicit Runtime(std::chrono::microseconds tick = std::chrono::milliseconds(1)) : _tick(tick) {}
+    ~Runtime() { stop(); }
+
+    void add(std::shared_ptr<Node> const &node) {
+        assert(!_running);
+        _slots.emplace_back(new Slot(node));
+        _by_id[node->id()] = _slots.back().get();
+    }
+
+    void start() {
+        assert(!_running);
+        _running = true;
+        _stop = false;
+        for(auto &s : _slots)
+            s->node->set_transport(this);
+        for(auto &s : _slots)
+            s->thread = std::thread([this, slot = s.get()] { work(*slot); });
+    }
+
+    void stop() {
+        if(!_running)
+            return;
+        _stop = true;
+        for(auto &s : _slots) {
+            s->wakeup.signal();
+            s->thread.join();
+            s->node->set_transport(nullptr);
+        }
+        _running = false;
+    }
+
+    bool deliver(uintptr_t src, uintptr_t dst, Message &&msg) override {
+        auto it = _by_id.find(dst);
+        if(it == _by_id.end())
+            return false;
+        auto &s = *it->second;
+        s.delivered.fetch_add(1, std::memory_order_relaxed);
+        if(s.inbox.push(Item(src, std::move(msg)))) {
+            s.wakeups.fetch_add(1, std::memory_order_relaxed);
+            s.wakeup.signal();
+        }
+        return true;
+    }
+
+    Stats stats() const {
+        Stats st;
+        for(auto const &s : _slots) {
+            st.delivered += s->delivered.load();
+            st.wakeups += s->wakeups.load();
+            st.ticks += s->ticks.load();
+        }
+        return st;
+    }
+
+private:
+    using Item = std::pair<uintptr_t, Message>;
+
+    struct Slot {
+        explicit Slot(std::shared_ptr<Node> const &n) : node(n), inbox(Item(0, Message::ReadOpRequest{0})) {}
+        std::shared_ptr<Node> node;
+        MpscQueue<Item> inbox;
+        Wakeup wakeup;
+        std::thread thread;
+        std::atomic<uint64_t> delivered{0}, wakeups{0}, ticks{0};
+    };
+
+    void work(Slot &s) {
+        while(!_stop.load(std::memory_order_acquire)) {
+            auto seq = s.wakeup.prepare();
+            if(s.inbox.empty())
+                s.wakeup.wait(seq, _tick);
+            s.inbox.consume([&s](Item &&item) { s.node->put(item.first, std::move(item.second)); });
+            s.node->on_tick();
+            s.ticks.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    std::chrono::microseconds _tick;
+    std::vector<std::unique_ptr<Slot>> _slots;
+    std::unordered_map<uintptr_t, Slot *> _by_id;
+    std::atomic<bool> _stop{false};
+    bool _running = false;
+};
+
+
+// Client driving itself: keeps `window` requests in flight till its operations are all
+// answered. Nothing else calls `action` on it, so it runs on its own runtime thread.
+
+class ClosedLoopClient : public ClientNode {
+public:
+    ClosedLoopClient(std::vector<WorkloadOp> &&ops, size_t window, int answers)
+        : _ops(std::move(ops)), _window(std::max<size_t>(window, 1)), _answers(answers) {
+        set_verbose(false);
+    }
+
+    bool done() const { return _done.load(std::memory_order_acquire); }
+
+    void on_tick() override {
+        ClientNode::on_tick();
+        for(; _next < _ops.size() && in_flight() < _window; ++_next)
+            action(std::move(_ops[_next].msg), _answers, std::move(_ops[_next].payload));
+        if(_next == _ops.size() && ready())
+            _done.store(true, std::memory_order_release);
+    }
+
+private:
+    std::vector<WorkloadOp> _ops;
+    size_t _next = 0;
+    size_t _window;
+    int _answers;
+    std::atomic<bool> _done{false};
+};
+
+
+// One PBFT group on the runtime, the threaded counterpart of `Simulator::run` for
+// closed-loop workloads. The workload is split by client upfront.
+
+class RuntimeCluster {
+public:
+    struct Config {
+        int f = 1;
+        int nodes = 0;
+        uint32_t clients = 1;
+        size_t window = 1;          // requests in flight per client
+        uint64_t timeout = 1 << 20; // request timeout in node ticks, which are wakeups here
+        std::chrono::microseconds tick = std::chrono::milliseconds(1);
+    };
+
+    struct Result {
+        uint64_t completed = 0;
+        double seconds = 0;         // wall clock
+        Runtime::Stats runtime;
+        std::vector<uint64_t> executed; // by replica
+    };
+
+    explicit RuntimeCluster(Config const &c) : _c(c) {}
+
+    Result run(Workload &w) {
+        auto const n = std::max(_c.nodes, 3 * _c.f + 1);
+        std::vector<std::vector<WorkloadOp>> ops(_c.clients);
+        WorkloadOp op;
+        while(w.next(op))
+            ops[op.client % _c.clients].push_back(op);
+
+        std::vector<std::shared_ptr<PBFTNode>> nodes;
+        std::vector<std::shared_ptr<ClosedLoopClient>> clients;
+        std::vector<std::shared_ptr<Link>> links;
+        std::vector<uintptr_t> ids;
+        for(int i = 0; i < n; ++i) {
+            nodes.emplace_back(std::make_shared<PBFTNode>(i == 0 ? PBFTNode::Role::Primary : PBFTNode::Role::Replica, _c.f));
+            nodes.back()->set_success_startegy(std::make_unique<PBFT_DB>());
+            nodes.back()->set_timeout(_c.timeout);
+            ids.push_back(nodes.back()->id());
+        }
+        for(auto &r : nodes)
+            r->set_replicas(ids);
+        for(size_t i = 0; i < nodes.size(); ++i)
+            for(size_t j = i + 1; j < nodes.size(); ++j)
+                links.emplace_back(Link::make(nodes[i], nodes[j]));
+        for(auto &o : ops) {
+            clients.emplace_back(std::make_shared<ClosedLoopClient>(std::move(o), _c.window, _c.f + 1));
+            for(auto &r : nodes)
+                links.emplace_back(Link::make(clients.back(), r));
+        }
+
+        Runtime runtime(_c.tick);
+        for(auto &r : nodes)
+            runtime.add(r);
+        for(auto &c : clients)
+            runtime.add(c);
+        auto start = std::chrono::steady_clock::now();
+        runtime.start();
+        for(auto const &c : clients)
+            while(!c->done())
+                std::this_thread::sleep_for(std::chrono::microseconds(100));
+        Result result;
+        result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        runtime.stop();
+        result.runtime = runtime.stats();
+        for(auto const &c : clients)
+            result.completed += c->completed();
+        for(auto const &r : nodes)
+            result.executed.push_back(r->executed());
+        return result;
+    }
+
+private:
+    Config _c;
+};
@@ -0,0 +1,200 @@
+#pragma once
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#if defined (__linux__)
+#include <pthread.h>
+#endif
+#include "simulator.h"
+
+// Several independent PBFT groups in one process. The PBFT_DB keyspace is partitioned,
+// every group owns its part and runs its own Simulator (nodes, links, clients, sequence
+// state) on its own thread, pinned to its own core.
+// The router sends each operation of the workload to the owning group.
+
+
+// Slots of PBFT_DB are one global index space striped over the groups: slot `local` of
+// group g is global index local * groups + g. A read goes to the group of its global
+// index, as the group's local one; a write lands at the next slot of whatever group takes
+// it, the group is picked by the value to spread the load, and `index` tells its global
+// index from the group's answer. So a read of the index a write returned sees the write.
+// A key-value transaction goes by its first key, it's expected to stay within a group.
+
+class ShardRouter {
+public:
+    explicit ShardRouter(uint32_t groups) : _groups(groups) { assert(groups > 0); }
+
+    uint32_t groups() const { return _groups; }
+
+    uint32_t group(Message::OpRequestMessage const &msg) const {
+        switch(msg.type) {
+        case Message::Type::Write:
+            return static_cast<uint32_t>(mix(static_cast<uint64_t>(msg.data.write.value)) % _groups);
+        case Message::Type::Read:
+            return static_cast<uint32_t>(msg.data.read.index % _groups);
+        case Message::Type::Kv:
+            return static_cast<uint32_t>(mix(msg.data.kv.ops[0].key) % _groups);
+        default:
+            assert(not("Unreachable"));
+        }
+        return 0; // happy gcc
+    }
+
+    // The operation as its group sees it: a read gets the local index
+    Message::OpRequestMessage local(Message::OpRequestMessage msg) const {
+        if(msg.type == Message::Type::Read)
+            msg.data.read.index /= _groups;
+        return msg;
+    }
+
+    // Global index of the group's slot
+    size_t index(uint32_t group, size_t local) const {
+        return local * _groups + group;
+    }
+
+private:
+    // splitmix64 finalizer, so neighbouring keys don't land in the same group
+    static uint64_t mix(uint64_t x) {
+        x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9;
+        x = (x ^ (x >> 27)) * 0x94d049bb133111eb;
+        return x ^ (x >> 31);
+    }
+
+    uint32_t _groups;
+};
+
+
+// Bounded blocking queue of operations from the router thread to a group thread.
+// It's the workload of the group's Simulator; `next` blocks till an operation comes
+// or the queue is closed.
+
+class ShardQueue : public Workload {
+public:
+    ShardQueue(Mode mode, uint32_t clients, size_t capacity = 4096)
+        : _mode(mode), _clients(clients), _capacity(capacity) {}
+
+    Mode mode() const override { return _mode; }
+    uint32_t clients() const override { return _clients; }
+
+    void push(WorkloadOp const &op) {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _not_full.wait(lock, [this] { return _ops.size() < _capacity; });
+        _ops.push_back(op);
+        _not_empty.notify_one();
+    }
+
+    void close() {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _closed = true;
+        _not_empty.notify_one();
+    }
+
+    bool next(WorkloadOp &op) override {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _not_empty.wait(lock, [this] { return !_ops.empty() || _closed; });
+        if(_ops.empty())
+            return false;
+        op = _ops.front();
+        _ops.pop_front();
+        _not_full.notify_one();
+        return true;
+    }
+
+private:
+    Mode _mode;
+    uint32_t _clients;
+    size_t _capacity;
+    std::mutex _mutex;
+    std::condition_variable _not_empty, _not_full;
+    std::deque<WorkloadOp> _ops;
+    bool _closed = false;
+};
+
+
+class ShardedCluster {
+public:
+    struct Config {
+        uint32_t groups = 1;
+        int f = 1;
+        int nodes = 0;              // per group
+        uint32_t clients = 1;       // per group
+        bool pin = true;            // pin group threads to cores
+        std::function<void(Simulator &)> setup; // applied to every group's Simulator before run
+    };
+
+    struct Result {
+        std::vector<WorkloadStats> groups;
+        uint64_t completed = 0;
+        uint64_t ticks = 0;         // of the slowest group
+        double seconds = 0;         // wall clock
+    };
+
+    explicit ShardedCluster(Config const &c) : _c(c), _router(c.groups) {}
+
+    ShardRouter const &router() const { return _router; }
+
+    // The router runs in the calling thread. In open-loop mode delays are recomputed per
+    // group, so every group sees arrivals at the same ticks as in the original stream.
+    Result run(Workload &w, uint64_t ticks_limit = 10000000) {
+        std::vector<std::unique_ptr<ShardQueue>> queues;
+        for(uint32_t g = 0; g < _c.groups; ++g)
+            queues.emplace_back(new ShardQueue(w.mode(), _c.clients));
+        Result result;
+        result.groups.resize(_c.groups);
+
+        auto start = std::chrono::steady_clock::now();
+        std::vector<std::thread> threads;
+        for(uint32_t g = 0; g < _c.groups; ++g) {
+            threads.emplace_back([this, g, &queues, &result, ticks_limit] {
+                Simulator sim(_c.f, _c.nodes, _c.clients);
+                if(_c.setup)
+                    _c.setup(sim);
+                result.groups[g] = sim.run(*queues[g], ticks_limit);
+            });
+            if(_c.pin)
+                pin(threads.back(), g);
+        }
+
+        uint64_t now = 0;
+        std::vector<uint64_t> last(_c.groups, 0);
+        WorkloadOp op;
+        while(w.next(op)) {
+            auto g = _router.group(op.msg);
+            op.msg = _router.local(op.msg);
+            if(w.mode() == Workload::Mode::Open) {
+                now += op.delay;
+                op.delay = static_cast<uint32_t>(now - last[g]);
+                last[g] = now;
+                op.client %= _c.clients;
+            }
+            queues[g]->push(op);
+        }
+        for(auto &q : queues)
+            q->close();
+        for(auto &t : threads)
+            t.join();
+
+        result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        for(auto const &g : result.groups) {
+            result.completed += g.completed;
+            result.ticks = std::max(result.ticks, g.ticks);
+        }
+        return result;
+    }
+
+private:
+    static void pin(std::thread &t [[gnu::unused]], uint32_t group [[gnu::unused]]) {
+#if defined (__linux__)
+        auto cores = std::max(1u, std::thread::hardware_concurrency());
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(group % cores, &set);
+        pthread_setaffinity_np(t.native_handle(), sizeof(set), &set);
+#endif
+    }
+
+    Config _c;
+    ShardRouter _router;
+};
@@ -0,0 +1,913 @@
+#pragma once
+
+#include "pbft.h"
+#include "workload.h"
+#include "network.h"
+#include "executor.h"
+#include "kv_store.h"
+#include "multileader.h"
+#include "learner.h"
+#include <vector>
+#include <deque>
+#include <set>
+#include <functional>
+
+
+// Database built on top of PBFT. With the thread pool a run of committed requests is
+// executed in parallel waves. Write appends, so its slot is known before the run starts;
+// read depends on the write of its slot if that one comes earlier in the run, and fails
+// if the slot is written later. Writes never conflict with each other.
+// Key-value transactions go to `KvStore`, they're serialized with each other and run
+// in parallel with the slot operations.
+
+class PBFT_DB : public PBFTNode::SuccessStrategy {
+public:
+    explicit PBFT_DB(std::shared_ptr<ThreadPool> const &pool = nullptr) : _pool(pool) {}
+
+private:
+    Message::OpResponseMessage accept(Message::OpRequestMessage const &msg) override {
+        switch(msg.type) {
+        case Message::Type::Write:
+            return accept(msg.data.write);
+        case Message::Type::Read:
+            return accept(msg.data.read);
+        case Message::Type::Kv:
+            return _kv.apply(msg.data.kv);
+        case Message::Type::WriteAck:
+        case Message::Type::ReadAck:
+        case Message::Type::KvAck:
+        case Message::Type::Response:
+        case Message::Type::PrePrepare:
+        case Message::Type::Prepare:
+        case Message::Type::Commit:
+        case Message::Type::ViewChange:
+        case Message::Type::NewView:
+        case Message::Type::PrepareCertificate:
+        case Message::Type::CommitCertificate:
+        case Message::Type::Busy:
+        case Message::Type::Lease:
+        case Message::Type::Decision:
+        case Message::Type::SpecCommit:
+        case Message::Type::LocalCommit:
+        case Message::Type::Fetch:
+            assert(not("Unreachable"));
+        }
+        return Message::ReadOpResponse{false, 0}; // happy gcc
+    }
+
+    Message::WriteOpResponse accept(Message::WriteOpRequest const &msg) {
+        _data.push_back(entry(msg));
+        return Message::WriteOpResponse{true, _data.size() - 1};
+    }
+
+    Message::ReadOpResponse accept(Message::ReadOpRequest const &msg) {
+        if(msg.index < _data.size())
+            return Message::ReadOpResponse{true, _data[msg.index].value, _data[msg.index].payload};
+        return Message::ReadOpResponse{false, 0};
+    }
+
+    // The bytes of the payload are in the node's `Payloads`, the read answer carries them
+    struct Entry {
+        int value = 0;
+        Message::Payload payload = {};
+    };
+
+    static Entry entry(Message::WriteOpRequest const &msg) {
+        return Entry{msg.value, msg.payload};
+    }
+
+    void accept_run(std::vector<Message::OpRequestMessage> const &run, std::vector<Message::OpResponseMessage> &results) override {
+        if(_pool == nullptr || run.size() < 2) {
+            SuccessStrategy::accept_run(run, results);
+            return;
+        }
+        constexpr uint64_t none = ~uint64_t(0);
+        std::vector<std::vector<Access>> accesses(run.size());
+        std::vector<uint64_t> slots(run.size(), none);
+        uint64_t size = _data.size();
+        for(size_t i = 0; i < run.size(); ++i) {
+            if(run[i].type == Message::Type::Kv) {
+                accesses[i].push_back({none, true}); // the whole store, never a slot
+            } else if(run[i].type == Message::Type::Write) {
+                slots[i] = size++;
+                accesses[i].push_back({slots[i], true});
+            } else if(run[i].data.read.index < size) {
+                slots[i] = run[i].data.read.index;
+                accesses[i].push_back({slots[i], false});
+            }
+        }
+        _data.resize(size);
+        auto const first = results.size();
+        results.resize(first + run.size(), Message::ReadOpResponse{false, 0});
+        execute_waves(*_pool, schedule_waves(accesses), [&](size_t i) {
+            if(run[i].type == Message::Type::Kv) {
+                results[first + i] = _kv.apply(run[i].data.kv);
+            } else if(run[i].type == Message::Type::Write) {
+                _data[slots[i]] = entry(run[i].data.write);
+                results[first + i] = Message::WriteOpResponse{true, slots[i]};
+            } else if(slots[i] != none) {
+                results[first + i] = Message::ReadOpResponse{true, _data[slots[i]].value, _data[slots[i]].payload};
+            }
+        });
+    }
+
+    std::shared_ptr<ThreadPool> _pool;
+    std::vector<Entry> _data;
+    KvStore _kv;
+};
+
+
+// Request latencies in ticks, kept as histogram so millions of requests cost nothing
+
+class LatencyStats {
+public:
+    void add(uint64_t ticks) {
+        if(ticks >= _hist.size())
+            _hist.resize(ticks + 1);
+        ++_hist[ticks];
+        ++_count;
+    }
+
+    void merge(LatencyStats const &other) {
+        if(other._hist.size() > _hist.size())
+            _hist.resize(other._hist.size());
+        for(size_t i = 0; i < other._hist.size(); ++i)
+            _hist[i] += other._hist[i];
+        _count += other._count;
+    }
+
+    uint64_t count() const { return _count; }
+
+    double mean() const {
+        if(_count == 0)
+            return 0;
+        double sum = 0;
+        for(size_t i = 0; i < _hist.size(); ++i)
+            sum += static_cast<double>(i) * _hist[i];
+        return sum / _count;
+    }
+
+    uint64_t percentile(double p) const {
+        auto rank = static_cast<uint64_t>(std::ceil(p * _count));
+        uint64_t seen = 0;
+        for(size_t i = 0; i < _hist.size(); ++i) {
+            seen += _hist[i];
+            if(seen >= rank && seen > 0)
+                return i;
+        }
+        return _hist.empty() ? 0 : _hist.size() - 1;
+    }
+
+private:
+    std::vector<uint64_t> _hist;
+    uint64_t _count = 0;
+};
+
+
+// Client may have several requests in flight. Responses carry the request's timestamp,
+// the client counts them by it: a request is done when `answers` replicas have sent it
+// the same result, f+1 of them can't all be faulty. Answers to requests done already
+// are dropped.
+
+class ClientNode : public Node {
+public:
+    // Request is stamped by the client's clock unless it's stamped already. `payload` is
+    // the bytes of a write, they go with every send of it.
+    void action(Message::OpRequestMessage &&msg, int answers, Buffer payload = nullptr) {
+        if(msg.timestamp() == 0)
+            msg.stamp(++_timestamp);
+        if(_verbose)
+            std::cout << "Send " << msg << std::endl;
+        broadcast(with_payload(msg, payload)); // don't care. only primary node should process it
+        if(_spec_f != 0)
+            answers = 2 * _spec_f + 1; // local commits, if it comes to them
+        _pending.push_back({_now, _now, answers, std::move(msg), std::move(payload)});
+    }
+
+    // Speculative mode of replicas with the given f, see PBFTNode. After `timeout` ticks
+    // with 2f+1 matching answers the client certifies them. f = 0 turns it off.
+    void set_speculative(int f, uint64_t timeout) {
+        _spec_f = f;
+        _spec_timeout = timeout;
+    }
+    uint64_t certified() const { return _certified; } // requests done through SpecCommit
+
+    // Unanswered request is sent again every `ticks`, 0 turns it off
+    void set_retransmit(uint64_t ticks) { _retransmit = ticks; }
+    // Replicas in the order defining primaries, a leased read is taken from the primary alone
+    void set_replicas(std::vector<uintptr_t> const &r) { _replicas = r; }
+
+    bool ready() const {
+        return _pending.empty();
+    }
+
+    size_t in_flight() const { return _pending.size(); }
+    uint64_t completed() const { return _completed; }
+    uint64_t rejected() const { return _rejected; }
+    LatencyStats take_latency() { LatencyStats l; std::swap(l, _latency); return l; }
+    void set_verbose(bool v) { _verbose = v; }
+
+    void on_tick() override {
+        ++_now;
+        auto inbox = take_inbox();
+        for(auto const &m : inbox) {
+            switch(m.second.type) {
+            case Message::Type::Response: {
+                auto const &r = m.second.data.response;
+                bool verified = verify_message(r.msg, r.sig, m.first);
+                if(_verbose)
+                    std::cout << m.first << " -> " << m.second << " :: " << (verified ? "Verified" : "Malformed") << std::endl;
+                if(verified && !_pending.empty() && r.timestamp >= _pending.front().msg.timestamp() && r.history != 0) {
+                    auto &s = _speculated[r.timestamp][digest(r.msg) * 31 + r.history];
+                    s.view = r.view;
+                    s.req_id = r.req_id;
+                    s.history = r.history;
+                    s.replicas.insert(m.first);
+                } else if(verified && !_pending.empty() && r.timestamp >= _pending.front().msg.timestamp()) {
+                    _answers[r.timestamp][digest(r.msg)].insert(m.first);
+                    if(r.leased && leaseholder(m.first, r.view))
+                        settle(r.timestamp);
+                }
+            } break;
+            case Message::Type::Busy:
+                reject(m.second.data.busy.timestamp);
+                break;
+            case Message::Type::LocalCommit: {
+                auto const &l = m.second.data.local_commit;
+                if(!_pending.empty() && l.timestamp >= _pending.front().msg.timestamp())
+                    _answers[l.timestamp][l.history * 31 + l.req_id].insert(m.first);
+            } break;
+            case Message::Type::SpecCommit:
+            case Message::Type::Write:
+            case Message::Type::Read:
+            case Message::Type::Kv:
+            case Message::Type::WriteAck:
+            case Message::Type::ReadAck:
+            case Message::Type::KvAck:
+                assert(not("Unreachable"));
+            case Message::Type::PrePrepare:
+            case Message::Type::Prepare:
+            case Message::Type::Commit:
+            case Message::Type::ViewChange:
+            case Message::Type::NewView:
+            case Message::Type::PrepareCertificate:
+            case Message::Type::CommitCertificate:
+            case Message::Type::Lease:
+            case Message::Type::Decision:
+            case Message::Type::Fetch:
+                // Client is interconnected with all nodes, here you can debug service
+                // messages comming from nodes
+                // std::cout << m.first << " -> " << m.second << std::endl;
+                break;
+            }
+        }
+        complete();
+        retransmit();
+    }
+
+private:
+    struct Pending {
+        uint64_t sent;
+        uint64_t last_sent;
+        int answers;
+        Message::OpRequestMessage msg;
+        Buffer payload; // held till the request is done
+        bool certified = false; // SpecCommit is sent
+    };
+
+    // Matching speculative answers
+    struct Speculation {
+        uint32_t view = 0, req_id = 0;
+        Digest history = 0;
+        std::set<uintptr_t> replicas;
+    };
+
+    // Matching answers are counted per replica, a repeated one doesn't count
+    bool answered(Pending const &p) const {
+        auto it = _answers.find(p.msg.timestamp());
+        if(it == _answers.end())
+            return false;
+        for(auto const &a : it->second)
+            if(static_cast<int>(a.second.size()) >= p.answers)
+                return true;
+        return false;
+    }
+
+    void complete() {
+        while(!_pending.empty()) {
+            auto const t = _pending.front().msg.timestamp();
+            if(!answered(_pending.front()) && !(_spec_f != 0 && speculated(_pending.front())))
+                return;
+            _answers.erase(t);
+            _speculated.erase(t);
+            _latency.add(_now - _pending.front().sent);
+            _pending.pop_front();
+            ++_completed;
+        }
+    }
+
+    // Done with 3f+1 matching answers; with 2f+1 after the timeout their certificate goes
+    // to replicas, local commits are counted as answers then
+    bool speculated(Pending &p) {
+        auto it = _speculated.find(p.msg.timestamp());
+        if(it == _speculated.end())
+            return false;
+        for(auto const &m : it->second) {
+            auto const &s = m.second;
+            auto const matching = static_cast<int>(s.replicas.size());
+            if(matching >= 3 * _spec_f + 1)
+                return true;
+            if(p.certified || matching < 2 * _spec_f + 1 || _now - p.sent < _spec_timeout)
+                continue;
+            uint64_t voters = 0;
+            for(size_t i = 0; i < _replicas.size(); ++i)
+                if(s.replicas.count(_replicas[i]))
+                    voters |= uint64_t(1) << i;
+            p.certified = true;
+            ++_certified;
+            broadcast(Message::SpecCommit{p.msg.timestamp(), s.view, s.req_id, s.history, voters});
+        }
+        return false;
+    }
+
+    bool leaseholder(uintptr_t node, uint32_t view) const {
+        return !_replicas.empty() && _replicas[view % _replicas.size()] == node;
+    }
+
+    // One answer is enough
+    void settle(uint64_t timestamp) {
+        for(auto &p : _pending)
+            if(p.msg.timestamp() == timestamp)
+                p.answers = 1;
+    }
+
+    // The request is shed, not retried
+    void reject(uint64_t timestamp) {
+        for(auto it = _pending.begin(); it != _pending.end(); ++it) {
+            if(it->msg.timestamp() == timestamp) {
+                _pending.erase(it);
+                _answers.erase(timestamp);
+                _speculated.erase(timestamp);
+                ++_rejected;
+                return;
+            }
+        }
+    }
+
+    static Message with_payload(Message::OpRequestMessage const &msg, Buffer const &payload) {
+        Message m(msg);
+        m.payload = payload;
+        return m;
+    }
+
+    void retransmit() {
+        if(_retransmit == 0)
+            return;
+        for(auto &p : _pending) {
+            if(_now - p.last_sent >= _retransmit) {
+                p.last_sent = _now;
+                broadcast(with_payload(p.msg, p.payload));
+            }
+        }
+    }
+
+    bool _verbose = true;
+    uint64_t _now = 0;
+    uint64_t _completed = 0;
+    uint64_t _timestamp = 0;
+    uint64_t _retransmit = 0;
+    uint64_t _rejected = 0;
+    std::vector<uintptr_t> _replicas;
+    std::deque<Pending> _pending;
+    std::map<uint64_t, std::map<Digest, std::set<uintptr_t>>> _answers; // replicas answered, by request timestamp and answer
+    int _spec_f = 0;
+    uint64_t _spec_timeout = 0;
+    uint64_t _certified = 0;
+    std::map<uint64_t, std::map<Digest, Speculation>> _speculated; // by request timestamp, answer and history
+    LatencyStats _latency;
+};
+
+
+struct WorkloadStats {
+    uint64_t ticks = 0;
+    uint64_t issued = 0;
+    uint64_t completed = 0;
+    uint64_t rejected = 0; // answered Busy
+    LatencyStats latency;
+};
+
+template<typename Stream>
+Stream &operator<<(Stream &os, WorkloadStats const &s) {
+    return os << "ticks=" << s.ticks << ", issued=" << s.issued << ", completed=" << s.completed
+              << ", rejected=" << s.rejected << ", latency mean=" << s.latency.mean() << " p50=" << s.latency.percentile(0.5)
+              << " p99=" << s.latency.percentile(0.99) << " max=" << s.latency.percentile(1.0);
+}
+
+
+class Simulator {
+public:
+    using Action = Message::OpRequestMessage;
+
+    // With several leaders every replica runs a lane per leader, see PBFTNode's multi-leader
+    // mode; replica i leads lane i in view 0, client c goes to lane c mod leaders.
+    // node(i) is replica i's lane 0.
+    Simulator(int f, int nodes = 0, int clients = 1, int leaders = 1) : _f(f) {
+        nodes = std::max(nodes, 3 * f + 1);
+        assert(leaders >= 1 && leaders <= nodes);
+        init_nodes(f, nodes, std::max(clients, 1), leaders);
+    }
+
+    void run() {
+        constexpr int ticks_limit = 10000;
+        int c = 0;
+        while(not(_actions.size() == 0 && _clients[0]->ready()) && c < ticks_limit) {
+            tick();
+            ++c;
+        }
+        std::cout << "Simulation has taken " << c << " ticks" << std::endl;
+    }
+
+    void actions(std::list<Action> &&a) {
+        _actions = std::move(a);
+    }
+
+    // Drives all clients by the workload stream till it's exhausted and answered, for
+    // `ticks_limit` ticks at most. Client waits for f+1 responses, as PBFT client does.
+    // Starts a new run, one stopped by the limit before is dropped (see `resume`). Stats
+    // are of the call.
+    WorkloadStats run(Workload &w, uint64_t ticks_limit = 10000000) {
+        _drive.reset(new Drive());
+        _drive->workload = &w;
+        _drive->has_op = w.next(_drive->op);
+        _drive->due = _drive->has_op ? _drive->op.delay : 0;
+        _drive->slots.resize(w.mode() == Workload::Mode::Closed ? _clients.size() : 0);
+        return drive(ticks_limit);
+    }
+
+    // Goes on with the run the limit stopped, e.g. in a fork (see sweep.h)
+    WorkloadStats resume(uint64_t ticks_limit = 10000000) {
+        assert(_drive != nullptr);
+        return drive(ticks_limit);
+    }
+
+    // Ticks with no new requests, e.g. for the replicas to finish what clients don't wait for
+    void idle(uint64_t ticks) {
+        for(uint64_t i = 0; i < ticks; ++i) {
+            tick_network();
+            tick_clients();
+        }
+    }
+
+    // Link gets its profile by the zones of its ends and the random stream by its index,
+    // so the same config gives the same run
+    void set_network(NetworkConfig const &c) {
+        for(size_t i = 0; i < _links.size(); ++i) {
+            auto ends = _links[i]->nodes();
+            _links[i]->set_profile(c.profile(member(ends.first), member(ends.second)), c.seed * 0x9e3779b97f4a7c15 + i);
+        }
+    }
+
+    // Groups are replica indexes, clients stay connected to everyone
+    void partition(std::vector<std::vector<size_t>> const &groups) {
+        std::vector<std::vector<uintptr_t>> ids;
+        for(auto const &g : groups) {
+            ids.emplace_back();
+            for(auto i : g)
+                for(size_t l = 0; l < _leaders; ++l)
+                    ids.back().push_back(_ids.at(l * _replicas + i));
+        }
+        _partitions->split(ids);
+    }
+
+    void heal() {
+        _partitions->heal();
+    }
+
+    Link::Stats network_stats() const {
+        Link::Stats total;
+        for(auto const &l : _links) {
+            total.sent += l->stats().sent;
+            total.dropped += l->stats().dropped;
+            total.duplicated += l->stats().duplicated;
+            total.bytes += l->stats().bytes;
+            total.deferred += l->stats().deferred;
+            total.rejected += l->stats().rejected;
+        }
+        return total;
+    }
+
+    // CPU profile of the replicas and the network as folded stacks, see profile.h. Empty
+    // unless built with PBFT_PROFILE.
+    template<typename Stream>
+    void write_profile(Stream &os) const {
+        profile::write_folded(os, profile_owners());
+    }
+
+    // Self cycles of every frame over the replicas and the network, per request completed
+    std::map<std::string, double> profile_per_request() const {
+        uint64_t completed = 0;
+        for(auto const &c : _clients)
+            completed += c->completed();
+        std::vector<uintptr_t> owners;
+        for(auto const &o : profile_owners())
+            owners.push_back(o.first);
+        std::map<std::string, double> r;
+        for(auto const &f : profile::by_frame(owners))
+            r[f.first] = static_cast<double>(f.second) / std::max<uint64_t>(completed, 1);
+        return r;
+    }
+
+    // Destroying the primary starts failover measurement: ticks till the first commit
+    // in a later view
+    void destroy_node(size_t index) {
+        assert(index < _replicas);
+        for(size_t l = 0; l < _leaders; ++l) {
+            auto &n = _nodes[l * _replicas + index];
+            if(n != nullptr && n->role() == PBFTNode::Role::Primary && !_measuring_failover) {
+                _failover_from = _now;
+                _failover_view = n->view();
+                _failover = -1;
+                _measuring_failover = true;
+            }
+            if(!_mergers.empty())
+                _mergers[index]->detach(l);
+            n.reset();
+        }
+    }
+
+    int64_t failover() const { return _failover; } // -1 if not measured (yet)
+
+    // Calls `f` in the beginning of the given tick
+    void at(uint64_t tick, std::function<void()> f) {
+        _events.emplace(tick, std::move(f));
+    }
+
+    uint64_t now() const { return _now; }
+    std::shared_ptr<PBFTNode> const &node(size_t index) const { return _nodes.at(index); }
+    // Replica's lane `lane`, and its merger with several leaders
+    std::shared_ptr<PBFTNode> const &node(size_t index, size_t lane) const { return _nodes.at(lane * _replicas + index); }
+    LaneMerger const &merger(size_t index) const { return *_mergers.at(index); }
+
+    // Applies `f` to every replica node alive, of every lane
+    void configure(std::function<void(PBFTNode &)> const &f) {
+        for(auto &n : _nodes)
+            if(n != nullptr)
+                f(*n);
+    }
+
+    void set_communication(PBFTNode::Communication c) {
+        configure([=](PBFTNode &n) { n.set_communication(c); });
+    }
+
+    void set_dissemination(unsigned fanout, uint64_t timeout) {
+        configure([=](PBFTNode &n) { n.set_dissemination(fanout, timeout); });
+    }
+
+    void set_timeout(uint64_t ticks) {
+        configure([=](PBFTNode &n) { n.set_timeout(ticks); });
+    }
+
+    void set_admission(size_t window) {
+        configure([=](PBFTNode &n) { n.set_admission(window); });
+    }
+
+    // Weighted voting, see PBFTNode: `heavy` is the bitmap of replica indexes weighing more,
+    // the cluster has 3f+1+delta replicas. Not with several leaders.
+    void set_weighted(uint64_t heavy, bool adaptive = true) {
+        assert(_leaders == 1);
+        configure([=](PBFTNode &n) { n.set_weighted(heavy, adaptive); });
+    }
+
+    // Per tick budget and lanes of the replicas' intake, see PBFTNode
+    void set_intake(PBFTNode::Intake const &intake) {
+        configure([&intake](PBFTNode &n) { n.set_intake(intake); });
+    }
+
+    void set_inbox_capacity(size_t capacity) {
+        configure([=](PBFTNode &n) { n.set_inbox_capacity(capacity); });
+    }
+
+    void set_retransmit(uint64_t ticks) {
+        for(auto &c : _clients)
+            c->set_retransmit(ticks);
+    }
+
+    void set_lease(uint64_t ticks) {
+        configure([=](PBFTNode &n) { n.set_lease(ticks); });
+    }
+
+    // Speculative execution, see PBFTNode: clients certify 2f+1 matching answers after
+    // `timeout` ticks. 0 turns it off. Not with several leaders.
+    void set_speculative(uint64_t timeout) {
+        configure([timeout](PBFTNode &n) { n.set_speculative(timeout != 0); });
+        for(auto &c : _clients)
+            c->set_speculative(timeout != 0 ? _f : 0, timeout);
+    }
+
+    uint64_t certified() const {
+        uint64_t n = 0;
+        for(auto const &c : _clients)
+            n += c->certified();
+        return n;
+    }
+
+    uint64_t lease_reads() const {
+        uint64_t reads = 0;
+        for(auto const &n : _nodes)
+            if(n != nullptr)
+                reads += n->lease_reads();
+        return reads;
+    }
+
+    // Non-voting learner fed by 2f+1 replicas, so f+1 matching Decision-s come with f of
+    // them faulty; learners spread over the replicas. Add learners before `set_network`.
+    // Not with several leaders.
+    size_t add_learner(size_t retention = 1 << 16) {
+        assert(_leaders == 1);
+        auto const k = _learners.size();
+        auto l = std::make_shared<Learner>(_f, std::make_unique<PBFT_DB>(), retention);
+        l->set_replicas(std::vector<uintptr_t>(_ids.begin(), _ids.begin() + static_cast<long>(_replicas)));
+        _learners.push_back(l);
+        _feeds.resize(_replicas);
+        for(size_t j = 0; j <= 2 * static_cast<size_t>(_f); ++j) {
+            auto const i = (k + j) % _replicas;
+            _feeds[i].push_back(l->id());
+            if(_nodes[i] != nullptr) {
+                _nodes[i]->set_learners(_feeds[i]);
+                _links.emplace_back(Link::make(_nodes[i], l));
+                _links.back()->set_partitions(_partitions);
+                profile::Registry::erase(reinterpret_cast<uintptr_t>(_links.back().get()));
+            }
+        }
+        return k;
+    }
+
+    std::shared_ptr<Learner> const &learner(size_t index) const { return _learners.at(index); }
+
+    // Replicas execute committed runs on one shared pool of `threads` extra threads.
+    // Resets the databases, so call it before running.
+    void set_execution_threads(size_t threads) {
+        auto pool = threads == 0 ? nullptr : std::make_shared<ThreadPool>(threads);
+        for(auto &m : _mergers)
+            m->set_strategy(std::make_unique<PBFT_DB>(pool));
+        if(!_mergers.empty())
+            return;
+        for(auto &n : _nodes) {
+            if(n != nullptr) {
+                n->set_execution_stage(0);
+                n->set_success_startegy(std::make_unique<PBFT_DB>(pool));
+                n->set_execution_stage(_stage_capacity);
+            }
+        }
+    }
+
+    // Replicas execute on their own threads, see PBFTNode::set_execution_stage.
+    // Not with several leaders.
+    void set_execution_stage(size_t capacity) {
+        assert(_mergers.empty());
+        _stage_capacity = capacity;
+        configure([capacity](PBFTNode &n) { n.set_execution_stage(capacity); });
+    }
+
+    // Summed over alive replicas, seconds are of the longest running stage
+    PBFTNode::Stage::Stats execution_stats() const {
+        PBFTNode::Stage::Stats total;
+        for(auto const &n : _nodes) {
+            if(n == nullptr)
+                continue;
+            auto s = n->execution_stats();
+            total.pushed += s.pushed;
+            total.executed += s.executed;
+            total.rejected += s.rejected;
+            total.max_depth = std::max(total.max_depth, s.max_depth);
+            total.depth_sum += s.depth_sum;
+            total.busy_seconds += s.busy_seconds;
+            total.seconds = std::max(total.seconds, s.seconds);
+        }
+        return total;
+    }
+
+private:
+    // Lane l's replicas are listed from replica l on, so it's the lane's first primary
+    void init_nodes(int f, int n, int clients, int leaders) {
+        _replicas = static_cast<size_t>(n);
+        _leaders = static_cast<size_t>(leaders);
+        for(int i = 0; leaders > 1 && i < n; ++i)
+            _mergers.emplace_back(std::make_shared<LaneMerger>(_leaders, std::make_unique<PBFT_DB>()));
+        for(int i = 0; i < clients; ++i)
+            _clients.emplace_back(std::make_shared<ClientNode>());
+        for(int l = 0; l < leaders; ++l) {
+            for(int i = 0; i < n; ++i) {
+                auto const k = static_cast<size_t>(l * n + i);
+                _nodes.emplace_back(std::make_shared<PBFTNode>(i == l ? PBFTNode::Role::Primary : PBFTNode::Role::Replica, f));
+                if(_mergers.empty())
+                    _nodes[k]->set_success_startegy(std::make_unique<PBFT_DB>());
+                else
+                    _mergers[static_cast<size_t>(i)]->attach(static_cast<size_t>(l), *_nodes[k]);
+                if(l > 0)
+                    _nodes[k]->share_payloads(*_nodes[static_cast<size_t>(i)]); // answers of a lane read the others' writes
+                for(size_t c = static_cast<size_t>(l); c < _clients.size(); c += _leaders)
+                    _links.emplace_back(Link::make(_clients[c], _nodes[k]));
+            }
+        }
+        for(auto const &r : _nodes)
+            _ids.push_back(r->id());
+        for(size_t l = 0; l < _leaders; ++l) {
+            std::vector<uintptr_t> ids;
+            for(size_t i = 0; i < _replicas; ++i)
+                ids.push_back(_ids[l * _replicas + (l + i) % _replicas]);
+            for(size_t i = 0; i < _replicas; ++i) {
+                _nodes[l * _replicas + i]->set_primary(_nodes[l * _replicas + l]);
+                _nodes[l * _replicas + i]->set_replicas(ids);
+            }
+            for(size_t c = l; c < _clients.size(); c += _leaders)
+                _clients[c]->set_replicas(ids);
+        }
+        for(size_t l = 0; l < _leaders; ++l) {
+            for(size_t i = 0; i < _replicas - 1; ++i) {
+                for(size_t j = i + 1; j < _replicas; ++j) {
+                    _links.emplace_back(Link::make(_nodes[l * _replicas + i], _nodes[l * _replicas + j]));
+                }
+            }
+        }
+        for(auto &l : _links)
+            l->set_partitions(_partitions);
+        for(auto id : _ids)
+            profile::Registry::erase(id);
+        for(auto &l : _links)
+            profile::Registry::erase(reinterpret_cast<uintptr_t>(l.get()));
+    }
+
+    // Names of what the profile counts: replicas (and lanes), every link is the network
+    std::map<uintptr_t, std::string> profile_owners() const {
+        std::map<uintptr_t, std::string> names;
+        for(size_t i = 0; i < _ids.size(); ++i) {
+            names[_ids[i]] = "replica" + std::to_string(i % _replicas);
+            if(_leaders > 1)
+                names[_ids[i]] += "/lane" + std::to_string(i / _replicas);
+        }
+        for(auto const &l : _links)
+            names[reinterpret_cast<uintptr_t>(l.get())] = "network";
+        return names;
+    }
+
+    // Replica index, the same for all lanes of the replica
+    int member(uintptr_t id) const {
+        for(size_t i = 0; i < _ids.size(); ++i)
+            if(_ids[i] == id)
+                return static_cast<int>(i % _replicas);
+        return NetworkConfig::clients;
+    }
+
+    // Replicas with lane 0 alive
+    int alive_nodes() {
+        int c = 0;
+        for(size_t i = 0; i < _replicas; ++i)
+            if(_nodes[i] != nullptr)
+                ++c;
+        return c;
+    }
+
+    bool clients_ready() const {
+        for(auto const &c : _clients)
+            if(!c->ready())
+                return false;
+        return true;
+    }
+
+    void tick() {
+        tick_network();
+        if(_clients[0]->ready() && _actions.size() > 0) {
+            _clients[0]->action(std::move(_actions.front()), alive_nodes());
+            _actions.erase(_actions.begin());
+        }
+        tick_clients();
+    }
+
+    void tick_network() {
+        ++_now;
+        while(!_events.empty() && _events.begin()->first <= _now) {
+            auto f = std::move(_events.begin()->second);
+            _events.erase(_events.begin());
+            f();
+        }
+        for(auto &l : _links)
+            l->on_tick();
+        for(auto &n : _nodes)
+            if(n != nullptr)
+                n->on_tick();
+        for(auto &l : _learners)
+            l->on_tick();
+        if(_measuring_failover) {
+            for(auto const &n : _nodes) {
+                if(n != nullptr && n->last_commit_view() > _failover_view) {
+                    _failover = static_cast<int64_t>(_now - _failover_from);
+                    _measuring_failover = false;
+                    break;
+                }
+            }
+        }
+    }
+
+    void tick_clients() {
+        for(auto &c : _clients)
+            c->on_tick();
+    }
+
+    // Drives `_drive` on, see `run`
+    WorkloadStats drive(uint64_t ticks_limit) {
+        std::vector<uint64_t> completed_before, rejected_before;
+        for(auto &c : _clients) {
+            c->set_verbose(false);
+            c->take_latency();
+            completed_before.push_back(c->completed());
+            rejected_before.push_back(c->rejected());
+        }
+
+        auto &d = *_drive;
+        auto &w = *d.workload;
+        auto &op = d.op;
+        auto &slots = d.slots;
+
+        WorkloadStats stats;
+        auto send = [&](size_t client, WorkloadOp &op) {
+            _clients[client]->action(std::move(op.msg), _f + 1, std::move(op.payload));
+            ++stats.issued;
+        };
+
+        bool done = false;
+        while(stats.ticks < ticks_limit && !done) {
+            tick_network();
+            if(w.mode() == Workload::Mode::Open) {
+                while(d.has_op && d.due <= d.ticks) {
+                    send(op.client % _clients.size(), op);
+                    d.has_op = w.next(op);
+                    d.due += d.has_op ? op.delay : 0;
+                }
+            } else {
+                for(size_t i = 0; i < slots.size(); ++i) {
+                    auto &s = slots[i];
+                    if(!s.busy && d.has_op && _clients[i]->ready()) {
+                        s.busy = true;
+                        s.due = d.ticks + op.delay;
+                        s.op = op;
+                        d.has_op = w.next(op);
+                    }
+                    if(s.busy && s.due <= d.ticks) {
+                        s.busy = false;
+                        send(i, s.op);
+                    }
+                }
+            }
+            tick_clients();
+            ++stats.ticks;
+            ++d.ticks;
+            done = !d.has_op && clients_ready() && std::none_of(slots.begin(), slots.end(), [](Drive::Slot const &s) { return s.busy; });
+        }
+        if(done)
+            _drive.reset();
+
+        for(size_t i = 0; i < _clients.size(); ++i) {
+            stats.completed += _clients[i]->completed() - completed_before[i];
+            stats.rejected += _clients[i]->rejected() - rejected_before[i];
+            stats.latency.merge(_clients[i]->take_latency());
+        }
+        return stats;
+    }
+
+    // Workload driven by `run`, kept for `resume` when the limit stops it
+    struct Drive {
+        struct Slot {
+            bool busy = false;
+            uint64_t due = 0;
+            WorkloadOp op;
+        };
+
+        Workload *workload = nullptr;
+        bool has_op = false;
+        WorkloadOp op;
+        uint64_t due = 0;   // open-loop: tick of the next arrival
+        uint64_t ticks = 0; // of the run
+        std::vector<Slot> slots; // closed-loop: op by client
+    };
+
+    int _f;
+    size_t _replicas = 0, _leaders = 1;
+    std::vector<std::shared_ptr<LaneMerger>> _mergers; // by replica, with several leaders; outlive the nodes
+    std::vector<std::shared_ptr<ClientNode>> _clients;
+    std::vector<std::shared_ptr<PBFTNode>> _nodes; // lane by lane, see `init_nodes`
+    std::vector<uintptr_t> _ids; // replica ids, stay known after the node is destroyed
+    std::vector<std::shared_ptr<Learner>> _learners;
+    std::vector<std::vector<uintptr_t>> _feeds; // learners by replica
+    std::vector<std::shared_ptr<Link>> _links;
+    std::shared_ptr<Partitions> _partitions = std::make_shared<Partitions>();
+    std::list<Action> _actions;
+    uint64_t _now = 0;
+    std::multimap<uint64_t, std::function<void()>> _events;
+    bool _measuring_failover = false;
+    uint64_t _failover_from = 0;
+    uint32_t _failover_view = 0;
+    int64_t _failover = -1;
+    size_t _stage_capacity = 0;
+    std::unique_ptr<Drive> _drive;
+};
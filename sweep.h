@@ -0,0 +1,96 @@
+#pragma once
+
+#include <unistd.h>
+#include <sys/wait.h>
+#include <cerrno>
+#include <deque>
+#include <string>
+#include <vector>
+#include <iostream>
+#include <functional>
+#include "simulator.h"
+
+// Parameter sweep from one warmed up simulator. The caller runs the simulator to the
+// point of interest once (e.g. `run(w, warmup)`), then every branch runs in a process
+// forked from it: nodes, State-s, messages on the wire, PBFT_DB-s, clients and the
+// workload being driven are the parent's, copy-on-write, node ids included. A branch
+// changes what it sweeps (destroys a node, sets the network, ...), goes on with the
+// stopped run (`resume()`) and returns its row of the report, which comes back through
+// a pipe. At most `workers` branches run at once; the parent's simulator isn't touched.
+// Nothing may run on other threads at the fork: no execution threads or stages, no
+// Runtime. A workload reading a file shares the file offset with the forks.
+
+class Sweep {
+public:
+    using Branch = std::function<std::string(Simulator &sim)>;
+    struct Row {
+        std::string name;
+        bool ok;          // the branch returned, didn't crash
+        std::string text; // what it returned
+    };
+
+    void add(std::string name, Branch branch) {
+        _branches.emplace_back(std::move(name), std::move(branch));
+    }
+
+    // Rows in the order of branches
+    std::vector<Row> run(Simulator &sim, size_t workers) const {
+        struct Child {
+            pid_t pid;
+            int fd;
+            size_t branch;
+        };
+        std::vector<Row> rows;
+        for(auto const &b : _branches)
+            rows.push_back(Row{b.first, false, {}});
+        std::deque<Child> running;
+        auto reap = [&rows, &running] {
+            auto c = running.front();
+            running.pop_front();
+            char buf[4096];
+            for(ssize_t n; (n = ::read(c.fd, buf, sizeof(buf))) != 0;) {
+                if(n < 0 && errno != EINTR)
+                    break;
+                if(n > 0)
+                    rows[c.branch].text.append(buf, static_cast<size_t>(n));
+            }
+            ::close(c.fd);
+            int status = 0;
+            ::waitpid(c.pid, &status, 0);
+            rows[c.branch].ok = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+        };
+        std::cout.flush(); // or the forks print what's buffered again
+        for(size_t i = 0; i < _branches.size(); ++i) {
+            if(running.size() >= std::max<size_t>(workers, 1))
+                reap();
+            int fds[2];
+            if(::pipe(fds) != 0)
+                break;
+            auto pid = ::fork();
+            if(pid == 0) {
+                ::close(fds[0]);
+                auto text = _branches[i].second(sim);
+                std::cout.flush();
+                for(size_t sent = 0; sent < text.size();) {
+                    auto n = ::write(fds[1], text.data() + sent, text.size() - sent);
+                    if(n <= 0)
+                        ::_exit(1);
+                    sent += static_cast<size_t>(n);
+                }
+                ::_exit(0); // no destructors, they are the parent's
+            }
+            ::close(fds[1]);
+            if(pid < 0) {
+                ::close(fds[0]);
+                break;
+            }
+            running.push_back(Child{pid, fds[0], i});
+        }
+        while(!running.empty())
+            reap();
+        return rows;
+    }
+
+private:
+    std::vector<std::pair<std::string, Branch>> _branches;
+};
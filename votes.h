@@ -0,0 +1,171 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <cassert>
+#include <vector>
+#include <algorithm>
+
+// Votes of one agreement instance, a bitmap per phase indexed by replica position.
+// A replica is counted once however many times its vote comes, quorum is the number of
+// set bits.
+// VoteTracker<F> is for the cluster of 3F+1 replicas, thresholds are compile time
+// constants; VoteTracker<0> takes f at runtime and fits up to 256 replicas. It may also
+// weigh votes: a replica counts its weight, quorums are weight thresholds, see
+// `wheat_weights`.
+
+enum class Phase { Prepare, Commit };
+
+namespace votes {
+
+constexpr size_t words(size_t replicas) { return (replicas + 63) / 64; }
+
+// Count of set bits is kept along, so the quorum check doesn't rescan the bitmap;
+// popcount() recounts it, e.g. for a certificate
+template<size_t W>
+struct Bitmap {
+    uint64_t w[W];
+    uint32_t n;
+
+    void clear(size_t words = W) {
+        for(size_t i = 0; i < words; ++i)
+            w[i] = 0;
+        n = 0;
+    }
+
+    // false if the bit is already set
+    bool set(size_t i) {
+        auto const bit = uint64_t(1) << (i % 64);
+        auto &x = w[i / 64];
+        if(x & bit)
+            return false;
+        x |= bit;
+        ++n;
+        return true;
+    }
+
+    int count() const { return static_cast<int>(n); }
+
+    int popcount() const {
+        int c = 0;
+        for(auto x : w)
+            c += __builtin_popcountll(x);
+        return c;
+    }
+};
+
+} // namespace votes
+
+
+template<int F>
+class VoteTracker {
+public:
+    static constexpr int replicas = 3 * F + 1;
+    static constexpr int prepare_quorum = 2 * F;
+    static constexpr int commit_quorum = 2 * F + 1;
+
+    explicit VoteTracker(int f = F) { assert(f == F); (void)f; clear(); }
+
+    static constexpr int f() { return F; }
+    static constexpr int quorum(Phase p) { return p == Phase::Prepare ? prepare_quorum : commit_quorum; }
+
+    void clear() {
+        _prepare.clear();
+        _commit.clear();
+    }
+
+    bool vote(Phase p, size_t replica) {
+        assert(replica < replicas);
+        return bitmap(p).set(replica);
+    }
+
+    int count(Phase p) const { return p == Phase::Prepare ? _prepare.count() : _commit.count(); }
+
+private:
+    votes::Bitmap<votes::words(replicas)> &bitmap(Phase p) { return p == Phase::Prepare ? _prepare : _commit; }
+
+    votes::Bitmap<votes::words(replicas)> _prepare, _commit;
+};
+
+
+template<>
+class VoteTracker<0> {
+public:
+    static constexpr int replicas = 256;
+
+    explicit VoteTracker(int f) : _f(f) {
+        assert(f >= 0 && 3 * f + 1 <= replicas);
+        _prepare.clear();
+        _commit.clear();
+    }
+
+    int f() const { return _f; }
+    int quorum(Phase p) const {
+        if(!_weights.empty())
+            return p == Phase::Prepare ? _prepare_quorum : _commit_quorum;
+        return p == Phase::Prepare ? 2 * _f : 2 * _f + 1;
+    }
+
+    // Weight by replica position, empty is one vote each. Takes effect with the next clear().
+    void set_weights(std::vector<uint8_t> const &weights, int prepare_quorum, int commit_quorum) {
+        assert(weights.size() <= replicas);
+        _weights = weights;
+        _prepare_quorum = prepare_quorum;
+        _commit_quorum = commit_quorum;
+    }
+
+    // Words beyond the cluster size are never set, see `vote`
+    void clear() {
+        _prepare.clear(_words);
+        _commit.clear(_words);
+        _prepare_weight = _commit_weight = 0;
+    }
+
+    bool vote(Phase p, size_t replica) {
+        assert(replica < replicas);
+        _words = std::max(_words, replica / 64 + 1);
+        if(!(p == Phase::Prepare ? _prepare : _commit).set(replica))
+            return false;
+        if(!_weights.empty())
+            (p == Phase::Prepare ? _prepare_weight : _commit_weight) += replica < _weights.size() ? _weights[replica] : 0;
+        return true;
+    }
+
+    int count(Phase p) const {
+        if(!_weights.empty())
+            return p == Phase::Prepare ? _prepare_weight : _commit_weight;
+        return p == Phase::Prepare ? _prepare.count() : _commit.count();
+    }
+
+private:
+    int _f;
+    size_t _words = 1; // in use
+    votes::Bitmap<votes::words(replicas)> _prepare, _commit;
+    std::vector<uint8_t> _weights;
+    int _prepare_quorum = 0, _commit_quorum = 0;
+    int _prepare_weight = 0, _commit_weight = 0;
+};
+
+// Weights after WHEAT (Sousa, Bessani, "Separating the WHEAT from the chaff", SRDS'15):
+// n = 3f + 1 + delta replicas, the 2f `heavy` ones (bitmap of positions) weigh
+// Vmax = 1 + delta / f, the rest 1; scaled by f here to keep them integer: f + delta and f.
+// The total is then f * (3(f + delta) + 1) and f replicas weigh f * (f + delta) at most,
+// as 3f' + 1 replicas with f' = f + delta, so the quorum is f * (2(f + delta) + 1): two
+// quorums intersect in more than f replicas can weigh, and the correct ones make one.
+// A quorum has at least 2f + 1 replicas.
+struct Weights {
+    std::vector<uint8_t> weight; // by position
+    int quorum;                  // of commit, prepare is that less the primary's weight
+    int faulty;                  // f replicas weigh at most this
+};
+
+inline Weights wheat_weights(int f, size_t replicas, uint64_t heavy) {
+    auto const delta = static_cast<int>(replicas) - (3 * f + 1);
+    assert(f > 0 && delta >= 0 && replicas <= 64 && __builtin_popcountll(heavy) == 2 * f);
+    assert(replicas == 64 || heavy >> replicas == 0);
+    Weights w{std::vector<uint8_t>(replicas, static_cast<uint8_t>(f)), f * (2 * (f + delta) + 1), f * (f + delta)};
+    for(size_t i = 0; i < replicas; ++i)
+        if(heavy & (uint64_t(1) << i))
+            w.weight[i] = static_cast<uint8_t>(f + delta);
+    return w;
+}
@@ -0,0 +1,314 @@
+#pragma once
+
+#include <algorithm>
+#include <random>
+#include <cmath>
+#include <istream>
+#include <ostream>
+#include <cstring>
+#include <tuple>
+#include "payload.h"
+
+// Workload is a stream of client operations. Simulator pulls operations one by one,
+// so a trace of any length never lives in memory at once.
+// In open-loop mode `delay` is the gap in ticks since the previous operation of the
+// stream (the arrival process), and `client` says who issues it.
+// In closed-loop mode `delay` is the think time: the operation is taken by the first
+// idle client and sent `delay` ticks later; `client` is ignored.
+
+struct WorkloadOp {
+    WorkloadOp() : msg(Message::ReadOpRequest{0}) {}
+    uint32_t delay = 0; // in ticks
+    uint32_t client = 0;
+    Message::OpRequestMessage msg;
+    Buffer payload; // bytes of a write, the client sends them
+};
+
+class Workload {
+public:
+    enum class Mode { Open, Closed };
+
+    virtual ~Workload() = default;
+    virtual Mode mode() const = 0;
+    virtual uint32_t clients() const = 0;
+    virtual bool next(WorkloadOp &op) = 0; // false when the stream is exhausted
+};
+
+
+struct WorkloadConfig {
+    enum class Arrival { Fixed, Poisson, Bursty };
+    enum class Keys { Uniform, Zipfian };
+
+    Workload::Mode mode = Workload::Mode::Open;
+    uint32_t clients = 1;
+    uint64_t ops = 0;
+    Arrival arrival = Arrival::Poisson;
+    double rate = 1.0;        // open-loop: mean operations per tick (within a burst for Bursty)
+    uint32_t burst_on = 10;   // Bursty: ticks of arrivals...
+    uint32_t burst_off = 90;  // ...followed by ticks of silence
+    double think = 0.0;       // closed-loop: mean think time in ticks, exponentially distributed
+    double read_ratio = 0.5;
+    Keys keys = Keys::Uniform;
+    uint64_t key_space = 1000;
+    double zipf_theta = 0.99; // must not be 1
+    uint64_t seed = 1;
+    uint32_t payload = 0;     // bytes carried by every write, workload files don't keep them
+};
+
+
+// Zipfian key chooser by Gray et al. "Quickly generating billion-record synthetic
+// databases", the same one YCSB uses. Key 0 is the hottest one.
+
+class ZipfianKeys {
+public:
+    ZipfianKeys(uint64_t n, double theta) : _n(n), _theta(theta) {
+        assert(n > 0 && theta > 0 && theta != 1.0);
+        double zeta2 = 1.0 + std::pow(0.5, theta);
+        for(uint64_t i = 1; i <= n; ++i)
+            _zetan += 1.0 / std::pow(static_cast<double>(i), theta);
+        _alpha = 1.0 / (1.0 - theta);
+        _eta = (1.0 - std::pow(2.0 / n, 1.0 - theta)) / (1.0 - zeta2 / _zetan);
+    }
+
+    template<typename Rng>
+    uint64_t operator()(Rng &rng) const {
+        double u = std::uniform_real_distribution<double>(0.0, 1.0)(rng);
+        double uz = u * _zetan;
+        if(uz < 1.0)
+            return 0;
+        if(uz < 1.0 + std::pow(0.5, _theta))
+            return std::min<uint64_t>(1, _n - 1);
+        auto k = static_cast<uint64_t>(_n * std::pow(_eta * u - _eta + 1.0, _alpha));
+        return std::min(k, _n - 1);
+    }
+
+private:
+    uint64_t _n;
+    double _theta, _zetan = 0.0, _alpha, _eta;
+};
+
+
+// Synthetic workload. Deterministic for the given config, seed included.
+
+class WorkloadGenerator : public Workload {
+public:
+    explicit WorkloadGenerator(WorkloadConfig const &c)
+        : _c(c), _rng(c.seed), _zipf(c.keys == WorkloadConfig::Keys::Zipfian ? c.key_space : 1, c.zipf_theta) {
+        assert(c.clients > 0 && c.key_space > 0 && c.rate > 0);
+    }
+
+    Mode mode() const override { return _c.mode; }
+    uint32_t clients() const override { return _c.clients; }
+
+    bool next(WorkloadOp &op) override {
+        if(_generated == _c.ops)
+            return false;
+        ++_generated;
+        if(_c.mode == Mode::Open) {
+            op.delay = arrival();
+            op.client = std::uniform_int_distribution<uint32_t>(0, _c.clients - 1)(_rng);
+        } else {
+            op.delay = think();
+            op.client = 0;
+        }
+        auto k = key();
+        op.payload = nullptr;
+        if(std::uniform_real_distribution<double>(0.0, 1.0)(_rng) < _c.read_ratio) {
+            op.msg = Message::OpRequestMessage(Message::ReadOpRequest{k});
+        } else {
+            Message::WriteOpRequest write{static_cast<int>(k)};
+            if(_c.payload > 0)
+                std::tie(write.payload, op.payload) = make_payload(payload(k));
+            op.msg = Message::OpRequestMessage(write);
+        }
+        return true;
+    }
+
+private:
+    uint32_t arrival() {
+        double t = _clock;
+        switch(_c.arrival) {
+        case WorkloadConfig::Arrival::Fixed:
+            t += 1.0 / _c.rate;
+            break;
+        case WorkloadConfig::Arrival::Poisson:
+            t += std::exponential_distribution<double>(_c.rate)(_rng);
+            break;
+        case WorkloadConfig::Arrival::Bursty: {
+            t += std::exponential_distribution<double>(_c.rate)(_rng);
+            double period = _c.burst_on + _c.burst_off;
+            double phase = std::fmod(t, period);
+            if(phase >= _c.burst_on)
+                t += period - phase; // arrival falls into silence, move it to the next burst
+        } break;
+        }
+        auto delay = static_cast<uint32_t>(std::floor(t) - std::floor(_clock));
+        _clock = t;
+        return delay;
+    }
+
+    uint32_t think() {
+        if(_c.think <= 0)
+            return 0;
+        return static_cast<uint32_t>(std::lround(std::exponential_distribution<double>(1.0 / _c.think)(_rng)));
+    }
+
+    // Filled with the key, the operation number in front keeps payloads distinct
+    Bytes payload(uint64_t k) const {
+        Bytes b(_c.payload, static_cast<uint8_t>(k));
+        std::memcpy(b.data(), &_generated, std::min<size_t>(b.size(), sizeof(_generated)));
+        return b;
+    }
+
+    uint64_t key() {
+        if(_c.keys == WorkloadConfig::Keys::Zipfian)
+            return _zipf(_rng);
+        return std::uniform_int_distribution<uint64_t>(0, _c.key_space - 1)(_rng);
+    }
+
+    WorkloadConfig _c;
+    std::mt19937_64 _rng;
+    ZipfianKeys _zipf;
+    uint64_t _generated = 0;
+    double _clock = 0.0;
+};
+
+
+// Compact workload file format, all integers are LEB128 varints:
+//   header: "PBWL" version:u8 mode:u8 clients
+//   record: delay client op:u8 arg
+// where op is 0 for Write (arg is zigzag-encoded value) and 1 for Read (arg is index).
+// Records follow till the end of the stream, the reader never looks ahead more than one.
+
+namespace workload_file {
+
+constexpr char magic[4] = {'P', 'B', 'W', 'L'};
+constexpr uint8_t version = 1;
+
+inline void put_varint(std::ostream &os, uint64_t v) {
+    while(v >= 0x80) {
+        os.put(static_cast<char>((v & 0x7f) | 0x80));
+        v >>= 7;
+    }
+    os.put(static_cast<char>(v));
+}
+
+inline bool get_varint(std::istream &is, uint64_t &v) {
+    v = 0;
+    for(int shift = 0; shift < 64; shift += 7) {
+        auto c = is.get();
+        if(c == std::istream::traits_type::eof())
+            return false;
+        v |= static_cast<uint64_t>(c & 0x7f) << shift;
+        if((c & 0x80) == 0)
+            return true;
+    }
+    return false;
+}
+
+inline uint64_t zigzag(int v) {
+    return (static_cast<uint64_t>(v) << 1) ^ static_cast<uint64_t>(static_cast<int64_t>(v) >> 63);
+}
+
+inline int unzigzag(uint64_t v) {
+    return static_cast<int>(static_cast<int64_t>(v >> 1) ^ -static_cast<int64_t>(v & 1));
+}
+
+} // namespace workload_file
+
+
+class WorkloadReader : public Workload {
+public:
+    explicit WorkloadReader(std::istream &is) : _is(is) {
+        using namespace workload_file;
+        char m[sizeof(magic)];
+        uint64_t clients = 0;
+        _good = bool(_is.read(m, sizeof(m))) && std::equal(m, m + sizeof(m), magic) &&
+            _is.get() == version;
+        auto mode = _is.get();
+        _good = _good && (mode == 0 || mode == 1) && get_varint(_is, clients) && clients > 0;
+        _mode = mode == 1 ? Mode::Closed : Mode::Open;
+        _clients = static_cast<uint32_t>(clients);
+    }
+
+    bool good() const { return _good; }
+    Mode mode() const override { return _mode; }
+    uint32_t clients() const override { return _clients; }
+
+    bool next(WorkloadOp &op) override {
+        using namespace workload_file;
+        uint64_t delay, client, arg;
+        if(!_good || !get_varint(_is, delay))
+            return false;
+        _good = get_varint(_is, client);
+        auto type = _is.get();
+        _good = _good && (type == 0 || type == 1) && get_varint(_is, arg);
+        if(!_good)
+            return false;
+        op.delay = static_cast<uint32_t>(delay);
+        op.client = static_cast<uint32_t>(client);
+        op.payload = nullptr;
+        if(type == 0)
+            op.msg = Message::OpRequestMessage(Message::WriteOpRequest{unzigzag(arg)});
+        else
+            op.msg = Message::OpRequestMessage(Message::ReadOpRequest{arg});
+        return true;
+    }
+
+private:
+    std::istream &_is;
+    bool _good = false;
+    Mode _mode = Mode::Open;
+    uint32_t _clients = 0;
+};
+
+
+// Streams `w` into `os`, returns the number of written operations. Kv transactions
+// have no record in the format: the first one fails `os` and ends the stream.
+
+inline uint64_t write_workload(std::ostream &os, Workload &w) {
+    using namespace workload_file;
+    os.write(magic, sizeof(magic));
+    os.put(static_cast<char>(version));
+    os.put(static_cast<char>(w.mode() == Workload::Mode::Closed ? 1 : 0));
+    put_varint(os, w.clients());
+    uint64_t count = 0;
+    WorkloadOp op;
+    while(w.next(op)) {
+        put_varint(os, op.delay);
+        put_varint(os, op.client);
+        switch(op.msg.type) {
+        case Message::Type::Write:
+            os.put(0);
+            put_varint(os, zigzag(op.msg.data.write.value));
+            break;
+        case Message::Type::Read:
+            os.put(1);
+            put_varint(os, op.msg.data.read.index);
+            break;
+        case Message::Type::Kv:
+            os.setstate(std::ios::failbit);
+            return count;
+        case Message::Type::WriteAck:
+        case Message::Type::ReadAck:
+        case Message::Type::KvAck:
+        case Message::Type::Response:
+        case Message::Type::PrePrepare:
+        case Message::Type::Prepare:
+        case Message::Type::Commit:
+        case Message::Type::ViewChange:
+        case Message::Type::NewView:
+        case Message::Type::PrepareCertificate:
+        case Message::Type::CommitCertificate:
+        case Message::Type::Busy:
+        case Message::Type::Lease:
+        case Message::Type::Decision:
+        case Message::Type::SpecCommit:
+        case Message::Type::LocalCommit:
+        case Message::Type::Fetch:
+            assert(not("Unreachable"));
+        }
+        ++count;
+    }
+    return count;
+}